@@ -0,0 +1,33 @@
+/**
+ * @file    alloccount.c
+ * @brief   Heap allocation counter for 'bench alloc'.
+ * @details Built as a shared library apart from the shell and loaded with LD_PRELOAD, it
+ *          counts every malloc, calloc and realloc of the process, those the C library
+ *          makes on its own included. The shell finds alloc_count at run time, without the
+ *          library it runs with the plain allocator.
+ */
+
+#include <stddef.h>
+
+void *__libc_malloc(size_t size);
+
+void *__libc_calloc(size_t n, size_t size);
+
+void *__libc_realloc(void *ptr, size_t size);
+
+unsigned long alloc_count = 0;      /**< Heap allocations made by the process so far. */
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
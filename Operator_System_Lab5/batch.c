@@ -0,0 +1,248 @@
+/**
+ * @file    batch.c
+ * @brief   Create many entries of one folder together.
+ * @details The parent is resolved once, every name is checked before anything changes,
+ *          then the free slots and the blocks the batch needs are found in one pass each
+ *          and filled. A batch that does not fit changes nothing.
+ */
+
+#include "simplefs.h"
+
+/**
+ * Order two entries by full name for qsort.
+ */
+static int batch_cmp(const void *a, const void *b) {
+    return strcmp(((const batch_entry *) a)->fullname, ((const batch_entry *) b)->fullname);
+}
+
+/**
+ * Split a name the way create and mkdir store it.
+ * @param e Entry, name and is_dir set, fname, exname and fullname filled.
+ */
+static void batch_split(batch_entry *e) {
+    fcb tmp;
+    char *dot;
+
+    memset(e->fname, '\0', sizeof(e->fname));
+    memset(e->exname, '\0', sizeof(e->exname));
+    if (e->is_dir) {
+        strncpy(e->fname, e->name, sizeof(e->fname) - 1);
+        strcpy(e->exname, "di");
+    } else {
+        strncpy(e->fname, e->name, sizeof(e->fname) - 1);
+        if ((dot = strchr(e->fname, '.')) != NULL) {
+            *dot = '\0';
+        }
+        dot = strchr(e->name, '.');
+        strncpy(e->exname, dot != NULL && dot[1] != '\0' ? dot + 1 : "d", sizeof(e->exname) - 1);
+    }
+
+    /**< Same truncation as set_fcb, a stack fcb is not in a directory. */
+    set_fcb(&tmp, e->fname, e->exname, e->is_dir ? 0 : 1, 0, 0, 1);
+    get_fullname(e->fullname, &tmp);
+}
+
+/**
+ * Find free blocks in one pass over the FAT.
+ * @param n Blocks wanted.
+ * @param goal Block to start from, the pass wraps around to block 0.
+ * @param blocks Output, block nums.
+ * @return 0 on success, -1 if fewer are free.
+ */
+static int batch_blocks(int n, int goal, int *blocks) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char *hold = hold_table();
+    int i, k, found = 0;
+
+    for (k = 0; k < BLOCK_NUM && found < n; k++) {
+        i = (goal + k) % BLOCK_NUM;
+        if (fat0[i].id == FREE && (hold == NULL || !hold[i])) {
+            blocks[found++] = i;
+        }
+    }
+    return found == n ? 0 : -1;
+}
+
+/**
+ * Create entries in one folder, all of them or none.
+ * @param first First block of the folder.
+ * @param entries Names and types, sorted by full name on return.
+ * @param count Entry count.
+ * @return 0 on success, -1 on error with nothing changed.
+ */
+int do_batch(int first, batch_entry *entries, int count) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    int inline_data = ((block0 *) fs_head)->flags & FS_INLINE;
+    int i, j, block = first, last = first, nslots = 0, grow, nblocks = 0, used = 0;
+    int *blocks = NULL;
+    fcb **slots, *dir;
+    batch_entry *e;
+
+    for (i = 0; i < count; i++) {
+        batch_split(&entries[i]);
+        if (dir_lookup(first, entries[i].fullname) != NULL) {
+            fprintf(stderr, "batch: cannot create '%s': Folder or file exists\n", entries[i].name);
+            return -1;
+        }
+    }
+    qsort(entries, count, sizeof(batch_entry), batch_cmp);
+    for (i = 1; i < count; i++) {
+        if (!strcmp(entries[i - 1].fullname, entries[i].fullname)) {
+            fprintf(stderr, "batch: '%s' given twice\n", entries[i].fullname);
+            return -1;
+        }
+    }
+
+    if ((slots = (fcb **) malloc(count * sizeof(fcb *))) == NULL) {
+        fprintf(stderr, "batch: allocation error\n");
+        return -1;
+    }
+
+    /**< Free slots of the folder, then the blocks it has to grow by. */
+    i = -1;
+    while (nslots < count && (dir = dir_next(&block, &i)) != NULL) {
+        last = block;
+        if (dir->free == 0) {
+            slots[nslots++] = dir;
+        }
+    }
+    for (; block != END && block != FREE; block = fat_next(fat0[block].id)) {
+        last = block;
+    }
+    grow = (count - nslots + dir_slots() - 1) / dir_slots();
+    for (i = 0; i < count; i++) {
+        nblocks += entries[i].is_dir || !inline_data;
+    }
+    nblocks += grow;
+
+    if ((blocks = (int *) malloc((nblocks ? nblocks : 1) * sizeof(int))) == NULL) {
+        fprintf(stderr, "batch: allocation error\n");
+        free(slots);
+        return -1;
+    }
+    /**< In the group of the folder, which keeps a listing and its files close. */
+    if (batch_blocks(nblocks, ag_goal(first, nblocks), blocks) == -1) {
+        fprintf(stderr, "batch: No more space\n");
+        free(blocks);
+        free(slots);
+        return -1;
+    }
+
+    /**< Everything fits, from here on nothing can fail. */
+    for (j = 0; j < grow; j++) {
+        block = blocks[used++];
+        set_free(block, 1, 0);
+        fat0[last].id = block;
+        fat1[last].id = block;
+        bloom_adopt(first, block);
+        lsview_forget(last);
+        for (i = 0; i < dir_slots(); i++) {
+            dir_slot(block, i)->free = 0;
+        }
+        dir_head_sync(block);
+        dir_slot(first, 0)->length += BLOCK_SIZE;
+        for (i = 0; i < dir_slots() && nslots < count; i++) {
+            slots[nslots++] = dir_slot(block, i);
+        }
+        last = block;
+    }
+
+    for (i = 0; i < count; i++) {
+        e = &entries[i];
+        if (e->is_dir) {
+            block = blocks[used++];
+            set_free(block, 1, 0);
+            set_fcb(slots[i], e->fname, e->exname, 0, block, BLOCK_SIZE, 1);
+            init_folder(first, block);
+        } else if (!inline_data) {
+            block = blocks[used++];
+            set_free(block, 1, 0);
+            set_fcb(slots[i], e->fname, e->exname, 1, block, 0, 1);
+        } else {
+            set_fcb(slots[i], e->fname, e->exname, 1, 0, 0, 1);
+            slots[i]->reserve[0] |= FCB_INLINE;
+            memset(inline_data_of(slots[i]), 0, inline_size());
+        }
+    }
+
+    free(blocks);
+    free(slots);
+    return 0;
+}
+
+/**
+ * Create many files and folders in one folder at once.
+ * @param args '-n count' to expand each name as a pattern with one %d from 1 to count,
+ *             'path' of the parent folder, then names, those ending in '/' are folders.
+ * @return Always 1.
+ */
+int my_batch(char **args) {
+    char path[PATHLENGTH], *slash;
+    batch_entry *entries;
+    int i, k, n = 0, count = 1, pattern = 0, names;
+    const char *p;
+    fcb *parent;
+
+    if (args[1] != NULL && !strcmp(args[1], "-n") && args[2] != NULL) {
+        if ((count = atoi(args[2])) <= 0) {
+            fprintf(stderr, "batch: wrong count %s\n", args[2]);
+            return 1;
+        }
+        pattern = 1;
+        args += 2;
+    }
+    if (args[1] == NULL || args[2] == NULL) {
+        fprintf(stderr, "batch: missing operand\n");
+        return 1;
+    }
+
+    get_abspath(path, args[1]);
+    if ((parent = find_fcb(path)) == NULL || parent->attribute != 0) {
+        fprintf(stderr, "batch: %s: No such folder\n", args[1]);
+        return 1;
+    }
+
+    for (names = 0; args[names + 2] != NULL; names++) {
+        if (pattern) {
+            /**< A pattern holds exactly one %d and no other conversion. */
+            for (p = args[names + 2], k = 0; (p = strchr(p, '%')) != NULL; p++, k++) {
+                if (p[1] != 'd') {
+                    k = -1;
+                    break;
+                }
+            }
+            if (k != 1) {
+                fprintf(stderr, "batch: %s: a pattern needs one %%d\n", args[names + 2]);
+                return 1;
+            }
+        }
+    }
+
+    if ((entries = (batch_entry *) calloc(names * count, sizeof(batch_entry))) == NULL) {
+        fprintf(stderr, "batch: allocation error\n");
+        return 1;
+    }
+    for (i = 0; i < names; i++) {
+        for (k = 1; k <= count; k++, n++) {
+            if (pattern) {
+                snprintf(entries[n].name, NAMELENGTH, args[i + 2], k);
+            } else {
+                snprintf(entries[n].name, NAMELENGTH, "%s", args[i + 2]);
+            }
+            if ((slash = strchr(entries[n].name, '/')) != NULL && slash[1] == '\0') {
+                entries[n].is_dir = 1;
+                *slash = '\0';
+            }
+            if (entries[n].name[0] == '\0' || entries[n].name[0] == '.' || strchr(entries[n].name, '/') != NULL) {
+                fprintf(stderr, "batch: wrong name %s\n", args[i + 2]);
+                free(entries);
+                return 1;
+            }
+        }
+    }
+
+    do_batch(parent->first, entries, n);
+    free(entries);
+    return 1;
+}
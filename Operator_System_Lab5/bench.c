@@ -0,0 +1,296 @@
+/**
+ * @file    bench.c
+ * @brief   Micro benchmarks of the file system internals.
+ * @details Run from the shell with 'bench <name>', results are printed as a table.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include "simplefs.h"
+
+#define BENCH_SECONDS   0.2     /**< Minimum time measured per case. */
+#define BENCH_FILE      "/zbench.c"
+
+static const char *bench_words[] = {
+        "the", "file", "system", "block", "directory", "of", "and", "a", "to", "in",
+        "allocation", "table", "is", "write", "read", "data", "for", "open", "close", "user",
+        "with", "chain", "free", "first", "length", "time", "date", "root", "path", "name"
+};
+
+/**
+ * Wall clock.
+ * @return Seconds.
+ */
+static double bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill a buffer with one of the sample workloads.
+ * @param kind 0 prose, 1 log lines, 2 random bytes.
+ * @param buf Output.
+ * @param len Length of buf.
+ */
+static void bench_fill(int kind, unsigned char *buf, int len) {
+    unsigned int seed = 2019;
+    int pos = 0, n, line = 0;
+    char tmp[128];
+
+    while (pos < len) {
+        if (kind == 0) {
+            n = snprintf(tmp, sizeof(tmp), "%s%s", bench_words[rand_r(&seed) % 30],
+                         rand_r(&seed) % 12 ? " " : ".\n");
+        } else if (kind == 1) {
+            n = snprintf(tmp, sizeof(tmp), "2019-01-03 12:%02d:%02d [%s] block %d %s %s\n",
+                         line / 60 % 60, line % 60, rand_r(&seed) % 8 ? "info" : "warn",
+                         rand_r(&seed) % BLOCK_NUM, bench_words[rand_r(&seed) % 30],
+                         bench_words[rand_r(&seed) % 30]);
+            line++;
+        } else {
+            tmp[0] = (char) rand_r(&seed);
+            n = 1;
+        }
+        if (n > len - pos) {
+            n = len - pos;
+        }
+        memcpy(buf + pos, tmp, n);
+        pos += n;
+    }
+}
+
+/**
+ * Throughput and ratio of the lz codec, chunk by chunk as compressed files store data.
+ * @param kb Size of each workload in KB.
+ */
+static void bench_compress(int kb) {
+    static const char *names[] = {"text", "log", "random"};
+    int len = kb * 1024, cap = lz_bound(LZ_CHUNK);
+    unsigned char *src = (unsigned char *) malloc(len);
+    unsigned char *packed = (unsigned char *) malloc((len / LZ_CHUNK + 1) * cap);
+    unsigned char *out = (unsigned char *) malloc(len);
+    int clen[1024], kind, i, n, chunks, rounds, stored;
+    double start, ctime, dtime;
+
+    if (src == NULL || packed == NULL || out == NULL || kb <= 0 || len / LZ_CHUNK >= 1024) {
+        fprintf(stderr, "bench: size out of range\n");
+        free(src);
+        free(packed);
+        free(out);
+        return;
+    }
+    chunks = (len + LZ_CHUNK - 1) / LZ_CHUNK;
+
+    printf("%-8s %10s %8s %14s %14s\n", "data", "bytes", "ratio", "compress MB/s", "decompress MB/s");
+    for (kind = 0; kind < 3; kind++) {
+        bench_fill(kind, src, len);
+
+        start = bench_now();
+        rounds = 0;
+        do {
+            for (i = 0, stored = 0; i < chunks; i++) {
+                n = len - i * LZ_CHUNK < LZ_CHUNK ? len - i * LZ_CHUNK : LZ_CHUNK;
+                clen[i] = lz_compress(src + i * LZ_CHUNK, n, packed + i * cap, cap);
+                stored += clen[i] < n ? clen[i] : n;
+            }
+            rounds++;
+        } while ((ctime = bench_now() - start) < BENCH_SECONDS);
+        ctime /= rounds;
+
+        start = bench_now();
+        rounds = 0;
+        do {
+            for (i = 0; i < chunks; i++) {
+                n = len - i * LZ_CHUNK < LZ_CHUNK ? len - i * LZ_CHUNK : LZ_CHUNK;
+                if (lz_decompress(packed + i * cap, clen[i], out + i * LZ_CHUNK, n) != n) {
+                    fprintf(stderr, "bench: %s: round trip failed\n", names[kind]);
+                    break;
+                }
+            }
+            rounds++;
+        } while ((dtime = bench_now() - start) < BENCH_SECONDS);
+        dtime /= rounds;
+
+        if (memcmp(src, out, len)) {
+            fprintf(stderr, "bench: %s: round trip differs\n", names[kind]);
+        }
+        printf("%-8s %10d %8.2f %14.1f %14.1f\n", names[kind], len, (double) len / stored,
+               len / ctime / 1048576, len / dtime / 1048576);
+    }
+
+    free(src);
+    free(packed);
+    free(out);
+}
+
+/**
+ * Scaling of the parallel tree walk, du over the whole image with 1, 2, 4 ... threads.
+ */
+static void bench_walk(void) {
+    block0 *init_block = (block0 *) fs_head;
+    fcb *root = dir_slot(init_block->root, 0);
+    du_count total;
+    int nthreads, rounds, steals;
+    double start, elapsed, base = 0;
+
+    printf("%-8s %10s %10s %12s %8s\n", "threads", "dirs", "files", "dirs/s", "speedup");
+    for (nthreads = 1; nthreads <= WALK_MAX_THREADS; nthreads *= 2) {
+        start = bench_now();
+        rounds = 0;
+        steals = 0;
+        do {
+            steals += do_du(root, ROOT, nthreads, &total);
+            rounds++;
+        } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+        elapsed /= rounds;
+        if (nthreads == 1) {
+            base = elapsed;
+        }
+        printf("%-8d %10d %10d %12.0f %8.2f  (%d steals/walk)\n", nthreads, total.dirs, total.files,
+               total.dirs / elapsed, base / elapsed, steals / rounds);
+        if (nthreads >= walk_threads()) {
+            break;
+        }
+    }
+}
+
+/**
+ * One create, write, read, remove cycle on the metadata hot path.
+ * @param text Read buffer of WRITE_SIZE.
+ * @return 0 on success, -1 on error.
+ */
+static int bench_cycle(char *text) {
+    static char line[] = "a line of text written in small pieces\n";
+    int fd, i;
+
+    if (do_create(ROOT, BENCH_FILE + 1) == -1 || (fd = do_open(BENCH_FILE)) == -1) {
+        return -1;
+    }
+    for (i = 0; i < 8; i++) {
+        wb_write(fd, line, sizeof(line) - 1, 'a');
+    }
+    wb_flush(fd);
+    openfile_list[fd].count = 0;
+    do_read(fd, WRITE_SIZE, text);
+    do_close(fd);
+    do_rm(find_fcb(BENCH_FILE));
+    return 0;
+}
+
+/**
+ * Heap allocations of steady state create, write, read and remove.
+ * Counted by liballoccount.so, the shell must run with it in LD_PRELOAD.
+ */
+static void bench_alloc(void) {
+    static char text[WRITE_SIZE];
+    unsigned long *count = (unsigned long *) dlsym(RTLD_DEFAULT, "alloc_count");
+    unsigned long before;
+    int rounds = 0;
+    double start, elapsed;
+
+    if (count == NULL) {
+        fprintf(stderr, "bench: alloc needs the counter, run with LD_PRELOAD=liballoccount.so\n");
+        return;
+    }
+    if (fs_readonly) {
+        fprintf(stderr, "bench: Read-only file system\n");
+        return;
+    }
+    if (find_fcb(BENCH_FILE) != NULL) {
+        fprintf(stderr, "bench: %s exists\n", BENCH_FILE);
+        return;
+    }
+
+    /**< Warm up, the first round may grow caches. */
+    if (bench_cycle(text) == -1) {
+        fprintf(stderr, "bench: cannot create %s\n", BENCH_FILE);
+        return;
+    }
+
+    before = __atomic_load_n(count, __ATOMIC_RELAXED);
+    start = bench_now();
+    do {
+        bench_cycle(text);
+        rounds++;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+
+    printf("%-8s %10s %12s %12s\n", "cycle", "rounds", "cycles/s", "allocs/cycle");
+    printf("%-8s %10d %12.0f %12.2f\n", "crwr", rounds, rounds / elapsed,
+           (double) (__atomic_load_n(count, __ATOMIC_RELAXED) - before) / rounds);
+}
+
+/**
+ * Random one block reads far into a large file.
+ * @param kb Size of the file.
+ */
+static void bench_seek(int kb) {
+    static char text[WRITE_SIZE];
+    unsigned int seed = 1;
+    int fd, i, rounds = 0;
+    double start, elapsed;
+
+    if (fs_readonly) {
+        fprintf(stderr, "bench: Read-only file system\n");
+        return;
+    }
+    if (find_fcb(BENCH_FILE) != NULL) {
+        fprintf(stderr, "bench: %s exists\n", BENCH_FILE);
+        return;
+    }
+    if (kb <= 0 || do_create(ROOT, BENCH_FILE + 1) == -1 || (fd = do_open(BENCH_FILE)) == -1) {
+        fprintf(stderr, "bench: cannot create %s\n", BENCH_FILE);
+        return;
+    }
+    bench_fill(0, (unsigned char *) text, BLOCK_SIZE);
+    for (i = 0; i < kb * 1024 / BLOCK_SIZE; i++) {
+        if (do_write(fd, text, BLOCK_SIZE, 'a') != BLOCK_SIZE) {
+            break;
+        }
+    }
+    if (i == 0) {
+        fprintf(stderr, "bench: No more space\n");
+        do_close(fd);
+        do_rm(find_fcb(BENCH_FILE));
+        return;
+    }
+
+    start = bench_now();
+    do {
+        openfile_list[fd].count = rand_r(&seed) % i * BLOCK_SIZE;
+        do_read(fd, BLOCK_SIZE, text);
+        rounds++;
+    } while ((elapsed = bench_now() - start) < BENCH_SECONDS);
+
+    printf("%-8s %10s %10s %12s\n", "file", "blocks", "reads", "reads/s");
+    printf("%-8s %10d %10d %12.0f\n", "seek", i, rounds, rounds / elapsed);
+    do_close(fd);
+    do_rm(find_fcb(BENCH_FILE));
+}
+
+/**
+ * Run a benchmark.
+ * @param args 'compress [kb]' lz codec on text, log and random data, 'walk' du over the tree,
+ *             'alloc' heap allocations of create, write, read and remove,
+ *             'seek [kb]' random reads in a large file.
+ * @return Always 1.
+ */
+int my_bench(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "bench: missing operand\n");
+        return 1;
+    }
+    if (!strcmp(args[1], "compress")) {
+        bench_compress(args[2] != NULL ? atoi(args[2]) : 256);
+    } else if (!strcmp(args[1], "walk")) {
+        bench_walk();
+    } else if (!strcmp(args[1], "alloc")) {
+        bench_alloc();
+    } else if (!strcmp(args[1], "seek")) {
+        bench_seek(args[2] != NULL ? atoi(args[2]) : 512);
+    } else {
+        fprintf(stderr, "bench: %s: no such benchmark\n", args[1]);
+    }
+    return 1;
+}
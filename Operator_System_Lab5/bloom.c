@@ -0,0 +1,216 @@
+/**
+ * @file    bloom.c
+ * @brief   Bloom filters of directory names for fast negative lookups.
+ * @details A filter is built from the names of a directory on its first lookup and kept
+ *          up to date through dir_touch, which sees every slot taking or losing a name.
+ *          Removed names cannot be cleared from a filter, they only make it answer
+ *          "maybe" more often, and the filter is built again once too many piled up.
+ *          Each directory block remembers the directory it was seen in, so a touch finds
+ *          the filter to update without walking any chain.
+ */
+
+#include "simplefs.h"
+
+/**
+ * @brief Filter of one directory.
+ */
+typedef struct BLOOM {
+    int first;                  /**< First block of the directory, -1 if the slot is empty. */
+    int nbits;                  /**< Bits in use, a power of two. */
+    int capacity;               /**< Bits allocated. */
+    int names;                  /**< Names added. */
+    int removed;                /**< Names removed since the build, their bits are still set. */
+    uint64_t *bits;
+    unsigned long stamp;        /**< Last use, the oldest slot is replaced. */
+} bloom;
+
+static bloom bloom_slot[BLOOM_SLOTS] = {[0 ... BLOOM_SLOTS - 1] = {.first = -1}};
+static unsigned long bloom_clock = 0;
+static unsigned short bloom_owner[BLOCK_NUM];  /**< First block of the directory of each block, 0 if unknown. */
+
+/**
+ * Hash a full name, FNV-1a.
+ * @param name Full name.
+ * @return Hash.
+ */
+static uint32_t bloom_hash(const char *name) {
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Test the bits of a name, setting them if asked.
+ * @param b Filter.
+ * @param h Hash of the name.
+ * @param set 1 to add the name.
+ * @return 1 if every bit was already set, else 0.
+ */
+static int bloom_probe(bloom *b, uint32_t h, int set) {
+    uint32_t step = (h >> 17 | h << 15) | 1, bit;
+    int k, all = 1;
+
+    for (k = 0; k < BLOOM_PROBES; k++, h += step) {
+        bit = h & (b->nbits - 1);
+        if (!(b->bits[bit >> 6] >> (bit & 63) & 1)) {
+            all = 0;
+            if (!set) {
+                break;
+            }
+            b->bits[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+        }
+    }
+    return all;
+}
+
+/**
+ * Get the filter of a directory if it is loaded.
+ * @param first First block of the directory.
+ * @return Filter, NULL if none.
+ */
+static bloom *bloom_find(int first) {
+    int i;
+
+    for (i = 0; i < BLOOM_SLOTS; i++) {
+        if (bloom_slot[i].first == first) {
+            return &bloom_slot[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Build the filter of a directory in the least recently used slot.
+ * @param first First block of the directory.
+ * @return Filter, NULL on allocation failure.
+ */
+static bloom *bloom_build(int first) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    char fullname[NAMELENGTH];
+    bloom *b = NULL;
+    uint64_t *bits;
+    int i, n, block, names = 0;
+    fcb *dir;
+
+    for (i = 0; i < BLOOM_SLOTS; i++) {
+        if (b == NULL || bloom_slot[i].stamp < b->stamp) {
+            b = &bloom_slot[i];
+        }
+    }
+
+    for (block = first, n = 0; block != END && block != FREE && n < BLOCK_NUM; block = fat_next(fat0[block].id), n++) {
+        bloom_owner[block] = (unsigned short) first;
+        for (i = 0; i < dir_slots(); i++) {
+            names += dir_slot(block, i)->free == 1;
+        }
+    }
+
+    /**< Room for the directory to double before the filter gets too full. */
+    b->nbits = BLOOM_MIN_BITS;
+    while (b->nbits < 2 * BLOOM_BITS_PER_NAME * names) {
+        b->nbits *= 2;
+    }
+    if (b->nbits > b->capacity) {
+        if ((bits = (uint64_t *) realloc(b->bits, b->nbits / 8)) == NULL) {
+            b->first = -1;
+            return NULL;
+        }
+        b->bits = bits;
+        b->capacity = b->nbits;
+    }
+    memset(b->bits, 0, b->nbits / 8);
+    b->first = first;
+    b->names = 0;
+    b->removed = 0;
+
+    for (block = first, n = 0; block != END && block != FREE && n < BLOCK_NUM; block = fat_next(fat0[block].id), n++) {
+        for (i = 0; i < dir_slots(); i++) {
+            dir = dir_slot(block, i);
+            if (dir->free == 1) {
+                get_fullname(fullname, dir);
+                bloom_probe(b, bloom_hash(fullname), 1);
+                b->names++;
+            }
+        }
+    }
+    return b;
+}
+
+/**
+ * Check a name is surely not in a directory, building its filter on first use.
+ * @param first First block of the directory.
+ * @param name Full name.
+ * @return 1 if absent, 0 if it may be present.
+ */
+int bloom_absent(int first, const char *name) {
+    bloom *b = bloom_find(first);
+
+    if (b == NULL && (b = bloom_build(first)) == NULL) {
+        return 0;
+    }
+    b->stamp = ++bloom_clock;
+    return !bloom_probe(b, bloom_hash(name), 0);
+}
+
+/**
+ * Update the filter of a directory after one of its slots changed.
+ * @param block Directory block holding the slot.
+ * @param slot Changed slot.
+ */
+void bloom_touch(int block, fcb *slot) {
+    char fullname[NAMELENGTH];
+    bloom *b;
+
+    if (bloom_owner[block] == 0 || (b = bloom_find(bloom_owner[block])) == NULL) {
+        return;
+    }
+    if (slot->free == 1) {
+        get_fullname(fullname, slot);
+        if (!bloom_probe(b, bloom_hash(fullname), 1)) {
+            b->names++;
+        }
+        if (b->names * BLOOM_BITS_PER_NAME > b->nbits) {
+            /**< Grown past its size, rebuilt larger on the next lookup. */
+            b->first = -1;
+        }
+    } else if (++b->removed > BLOOM_MIN_BITS / BLOOM_BITS_PER_NAME && b->removed > b->names / 2) {
+        b->first = -1;
+    }
+}
+
+/**
+ * Record that a block joined the chain of a directory.
+ * @param first First block of the directory.
+ * @param block New block.
+ */
+void bloom_adopt(int first, int block) {
+    bloom_owner[block] = (unsigned short) first;
+}
+
+/**
+ * Drop the filter of a directory whose first block is reused by a new directory.
+ * @param first First block.
+ */
+void bloom_forget(int first) {
+    bloom *b = bloom_find(first);
+
+    if (b != NULL) {
+        b->first = -1;
+    }
+    bloom_owner[first] = (unsigned short) first;
+}
+
+/**
+ * Drop every filter, the directories changed under them.
+ */
+void bloom_reset(void) {
+    int i;
+
+    for (i = 0; i < BLOOM_SLOTS; i++) {
+        bloom_slot[i].first = -1;
+    }
+    memset(bloom_owner, 0, sizeof(bloom_owner));
+}
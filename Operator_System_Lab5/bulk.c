@@ -0,0 +1,388 @@
+/**
+ * @file    bulk.c
+ * @brief   Read or write many files at once with a pool of threads.
+ * @details Each file is handled by one thread from start to end, so its bytes keep their
+ *          order, while the files themselves are spread over the pool. The image is only
+ *          changed by the calling thread: bulkwrite creates the files and gives every one
+ *          its blocks first, the threads then fill those blocks, each its own. bulkcat
+ *          prints the files in the order given as soon as each one is read.
+ */
+
+#include "simplefs.h"
+
+#define BULK_SIZE       (64 * 1024)     /**< Default bytes written per file. */
+#define BULK_LINE       32              /**< Bytes of one line of written data. */
+
+/**
+ * @brief A file being read or written.
+ */
+typedef struct BULKENTRY {
+    char path[PATHLENGTH];
+    fcb *file;                  /**< Directory entry, NULL once skipped. */
+    unsigned long size;
+    unsigned char *data;        /**< Content read, bulkcat only. */
+    int done;                   /**< 1 once the thread is through with the file. */
+} bulk_entry;
+
+/**
+ * @brief Files shared by the pool.
+ */
+typedef struct BULKJOB {
+    bulk_entry *entries;
+    int count;
+    int next;                   /**< Next entry to take. */
+    int write;                  /**< 1 to fill the blocks, 0 to read the files. */
+    int errors;
+    pthread_mutex_t lock;       /**< Protect done. */
+    pthread_cond_t ready;       /**< Signalled when an entry is done. */
+} bulk_job;
+
+/**
+ * Wall clock.
+ * @return Seconds.
+ */
+static double bulk_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill the blocks of a file with lines naming the file and their offset.
+ * @param e Entry, its chain already as long as the size.
+ */
+static void bulk_fill(bulk_entry *e) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    char line[BULK_LINE + 11];  /**< Room for the widest "%-20.20s %10lu", a 20 digit offset. */
+    unsigned char *dst;
+    unsigned long pos;
+    int block = e->file->first, n;
+
+    if (e->file->reserve[0] & FCB_INLINE) {
+        memset(inline_data_of(e->file), 0, inline_size());
+    }
+    for (pos = 0; pos < e->size; pos += n) {
+        snprintf(line, sizeof(line), "%-20.20s %10lu", e->path, pos);
+        line[BULK_LINE - 1] = '\n';
+        n = BULK_LINE < e->size - pos ? BULK_LINE : (int) (e->size - pos);
+        if (e->file->reserve[0] & FCB_INLINE) {
+            dst = inline_data_of(e->file) + pos;
+        } else {
+            if (pos && pos % BLOCK_SIZE == 0) {
+                block = fat_next(fat0[block].id);
+            }
+            dst = fs_head + BLOCK_SIZE * block + pos % BLOCK_SIZE;
+        }
+        memcpy(dst, line, n);
+    }
+    /**< Clear the rest of the last block, it held whatever was there before. */
+    if (!(e->file->reserve[0] & FCB_INLINE) && e->size % BLOCK_SIZE) {
+        memset(fs_head + BLOCK_SIZE * block + e->size % BLOCK_SIZE, 0, BLOCK_SIZE - e->size % BLOCK_SIZE);
+    }
+}
+
+/**
+ * Thread body, read or fill files until none is left.
+ * @param arg Job shared by all threads.
+ */
+static void *bulk_worker(void *arg) {
+    bulk_job *job = (bulk_job *) arg;
+    bulk_entry *e;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        e = &job->entries[i];
+        if (e->file != NULL && job->write) {
+            bulk_fill(e);
+        } else if (e->file != NULL && ((e->data = (unsigned char *) malloc(e->size ? e->size : 1)) == NULL ||
+                                       file_load(e->file, e->data) == -1)) {
+            fprintf(stderr, "bulkcat: cannot read %s\n", e->path);
+            __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+            free(e->data);
+            e->data = NULL;
+        }
+        pthread_mutex_lock(&job->lock);
+        e->done = 1;
+        pthread_cond_broadcast(&job->ready);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Start the pool on a job.
+ * @param job Entries, next set to 0.
+ * @param nthreads Thread count.
+ * @param tid Output, thread ids.
+ * @return Threads started, 0 if the caller has to do the work itself.
+ */
+static int bulk_start(bulk_job *job, int nthreads, pthread_t *tid) {
+    int i, started = 0;
+
+    for (i = 0; i < nthreads && i < job->count; i++) {
+        if (pthread_create(&tid[started], NULL, bulk_worker, job) == 0) {
+            started++;
+        }
+    }
+    return started;
+}
+
+/**
+ * Parse the options and names shared by bulkcat and bulkwrite.
+ * @param args Arguments, '-j threads', '-n count' to expand each name as a pattern with one
+ *             %d from 1 to count, and for bulkwrite '-s bytes', then the files.
+ * @param cmd Command name for messages.
+ * @param job Output, entries with their paths.
+ * @param nthreads Output, thread count.
+ * @param size Output, bytes per file, NULL for bulkcat.
+ * @return 0 on success, -1 on error.
+ */
+static int bulk_parse(char **args, const char *cmd, bulk_job *job, int *nthreads, unsigned long *size) {
+    char name[PATHLENGTH];
+    const char *p;
+    int i, k, count = 1, pattern = 0, names;
+
+    *nthreads = walk_threads();
+    for (args++; *args != NULL && (*args)[0] == '-' && args[1] != NULL; args += 2) {
+        if (!strcmp(args[0], "-j") && atoi(args[1]) > 0) {
+            *nthreads = atoi(args[1]) > WALK_MAX_THREADS ? WALK_MAX_THREADS : atoi(args[1]);
+        } else if (!strcmp(args[0], "-n") && atoi(args[1]) > 0) {
+            count = atoi(args[1]);
+            pattern = 1;
+        } else if (!strcmp(args[0], "-s") && size != NULL && atol(args[1]) >= 0) {
+            *size = (unsigned long) atol(args[1]);
+        } else {
+            fprintf(stderr, "%s: wrong argument %s %s\n", cmd, args[0], args[1]);
+            return -1;
+        }
+    }
+    for (names = 0; args[names] != NULL; names++) {
+        /**< A pattern holds exactly one %d and no other conversion. */
+        for (p = args[names], k = 0; pattern && (p = strchr(p, '%')) != NULL; p++, k++) {
+            if (p[1] != 'd') {
+                k = -1;
+                break;
+            }
+        }
+        if (pattern && k != 1) {
+            fprintf(stderr, "%s: %s: a pattern needs one %%d\n", cmd, args[names]);
+            return -1;
+        }
+    }
+    if (names == 0) {
+        fprintf(stderr, "%s: missing operand\n", cmd);
+        return -1;
+    }
+
+    memset(job, 0, sizeof(bulk_job));
+    if ((job->entries = (bulk_entry *) calloc(names * count, sizeof(bulk_entry))) == NULL) {
+        fprintf(stderr, "%s: allocation error\n", cmd);
+        return -1;
+    }
+    for (i = 0; i < names; i++) {
+        for (k = 1; k <= count; k++) {
+            if (pattern) {
+                snprintf(name, PATHLENGTH, args[i], k);
+            } else {
+                snprintf(name, PATHLENGTH, "%s", args[i]);
+            }
+            get_abspath(job->entries[job->count++].path, name);
+        }
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->ready, NULL);
+    return 0;
+}
+
+/**
+ * Free a job.
+ * @param job Job.
+ */
+static void bulk_free(bulk_job *job) {
+    int i;
+
+    for (i = 0; i < job->count; i++) {
+        free(job->entries[i].data);
+    }
+    free(job->entries);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->ready);
+}
+
+/**
+ * Print the throughput of a job.
+ * @param out Stream.
+ * @param cmd Command name.
+ * @param job Job.
+ * @param nthreads Threads used.
+ * @param begin Start time.
+ */
+static void bulk_report(FILE *out, const char *cmd, bulk_job *job, int nthreads, double begin) {
+    double elapsed = bulk_now() - begin;
+    unsigned long bytes = 0;
+    int i, files = 0;
+
+    for (i = 0; i < job->count; i++) {
+        if (job->entries[i].file != NULL) {
+            bytes += job->entries[i].size;
+            files++;
+        }
+    }
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+    fprintf(out, "%s: %d files, %lu bytes, %d errors, %d threads, %.2f ms, %.1f MB/s, %.0f files/s\n", cmd,
+            files, bytes, job->errors, nthreads, elapsed * 1000, bytes / elapsed / (1024 * 1024), files / elapsed);
+}
+
+/**
+ * Print many files, read in parallel.
+ * @param args '-j threads', '-n count' for patterns, '-q' to only read them, then the files.
+ * @return Always 1.
+ */
+int my_bulkcat(char **args) {
+    pthread_t tid[WALK_MAX_THREADS];
+    double begin = bulk_now();
+    int i, nthreads, started, quiet = 0;
+    bulk_job job;
+    bulk_entry *e;
+
+    if (args[1] != NULL && !strcmp(args[1], "-q")) {
+        quiet = 1;
+        args++;
+    }
+    if (bulk_parse(args, "bulkcat", &job, &nthreads, NULL) == -1) {
+        return 1;
+    }
+    for (i = 0; i < job.count; i++) {
+        e = &job.entries[i];
+        if ((e->file = find_fcb(e->path)) == NULL || e->file->attribute != 1) {
+            fprintf(stderr, "bulkcat: %s: No such file\n", e->path);
+            job.errors++;
+            e->file = NULL;
+            continue;
+        }
+        e->size = e->file->length;
+    }
+
+    if ((started = bulk_start(&job, nthreads, tid)) == 0) {
+        bulk_worker(&job);
+    }
+    /**< Out in the order given, each file as soon as it is read. */
+    for (i = 0; i < job.count; i++) {
+        e = &job.entries[i];
+        pthread_mutex_lock(&job.lock);
+        while (!e->done) {
+            pthread_cond_wait(&job.ready, &job.lock);
+        }
+        pthread_mutex_unlock(&job.lock);
+        if (e->data != NULL && !quiet) {
+            fwrite(e->data, 1, e->size, stdout);
+        }
+        free(e->data);
+        e->data = NULL;
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    /**< The files went to stdout, the figures go aside. */
+    fflush(stdout);
+    bulk_report(quiet ? stdout : stderr, "bulkcat", &job, started ? started : 1, begin);
+    bulk_free(&job);
+    return 1;
+}
+
+/**
+ * Create or replace many files, filled in parallel.
+ * Each file holds lines naming it and their offset, so it can be checked by reading it.
+ * @param args '-j threads', '-n count' for patterns, '-s bytes' per file, then the files.
+ * @return Always 1.
+ */
+int my_bulkwrite(char **args) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    pthread_t tid[WALK_MAX_THREADS];
+    double begin = bulk_now();
+    char parpath[PATHLENGTH], *end;
+    unsigned long size = BULK_SIZE;
+    int i, j, n, first = -1, parent, nthreads, started;
+    bulk_job job;
+    bulk_entry *e;
+    fcb *file, *old;
+
+    if (bulk_parse(args, "bulkwrite", &job, &nthreads, &size) == -1) {
+        return 1;
+    }
+    job.write = 1;
+
+    /**< Entries and blocks first, in this thread, nothing changes the image after. */
+    for (i = 0; i < job.count; i++) {
+        e = &job.entries[i];
+        end = strrchr(e->path, '/');
+        memset(parpath, '\0', PATHLENGTH);
+        strncpy(parpath, e->path, end == e->path ? 1 : end - e->path);
+        if ((file = find_fcb(parpath)) == NULL || file->attribute != 0 || end[1] == '\0') {
+            fprintf(stderr, "bulkwrite: cannot create %s: Parent folder not exists\n", e->path);
+            job.errors++;
+            continue;
+        }
+        parent = file->first;
+        if ((old = find_fcb(e->path)) != NULL) {
+            for (j = 0; j < i && job.entries[j].file != old; j++);
+            if (j < i) {
+                fprintf(stderr, "bulkwrite: %s given twice\n", e->path);
+                job.errors++;
+                continue;
+            }
+            if (old->attribute != 1 || tree_busy(e->path)) {
+                fprintf(stderr, "bulkwrite: cannot replace %s: Folder or open file\n", e->path);
+                job.errors++;
+                continue;
+            }
+        }
+
+        /**< Space first, a file being replaced keeps its data when there is none. */
+        n = (init_block->flags & FS_INLINE) && size <= (unsigned long) inline_size() ? 0 :
+            size ? (int) ((size + BLOCK_SIZE - 1) / BLOCK_SIZE) : 1;
+        if (n > 0 && (first = chain_alloc(n, ag_goal(parent, n))) == -1) {
+            fprintf(stderr, "bulkwrite: %s: No more space\n", e->path);
+            job.errors++;
+            continue;
+        }
+        if (old != NULL) {
+            do_rm(old);
+        }
+        if (do_create(parpath, end + 1) == -1 || (file = find_fcb(e->path)) == NULL) {
+            if (n > 0) {
+                set_free(first, 0, 1);
+            }
+            job.errors++;
+            continue;
+        }
+        if (n > 0) {
+            if (!(file->reserve[0] & FCB_INLINE)) {
+                set_free(file->first, 0, 1);
+            }
+            file->reserve[0] &= ~FCB_INLINE;
+            file->first = first;
+        }
+        file->length = size;
+        e->file = file;
+        e->size = size;
+    }
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+
+    if ((started = bulk_start(&job, nthreads, tid)) == 0) {
+        bulk_worker(&job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    bulk_report(stdout, "bulkwrite", &job, started ? started : 1, begin);
+    bulk_free(&job);
+    return 1;
+}
@@ -0,0 +1,217 @@
+/**
+ * @file    cat.c
+ * @brief   Stream whole files to stdout.
+ * @details The data of a plain file is handed to writev as a list of pointers into the
+ *          image, neighbour blocks merged into one vector and holes pointing at a zero
+ *          block, so nothing is copied on the way out. Only compressed files go through
+ *          a buffer, their data does not exist in the image as is.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "simplefs.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @brief Vectors waiting for writev.
+ */
+typedef struct CATOUT {
+    int fd;
+    int count;
+    struct iovec iov[IOV_MAX];
+} cat_out;
+
+static const unsigned char cat_zero[BLOCK_SIZE];
+
+/**
+ * Write every queued vector, resuming after short writes.
+ * @param out Queue, emptied.
+ * @return 0 on success, -1 on error.
+ */
+static int cat_flush(cat_out *out) {
+    struct iovec *iov = out->iov;
+    int n = out->count;
+    ssize_t done;
+
+    out->count = 0;
+    while (n > 0) {
+        done = writev(out->fd, iov, n);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (; n > 0 && (size_t) done >= iov->iov_len; iov++, n--) {
+            done -= iov->iov_len;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queue bytes, merged with the previous vector when they follow it in memory.
+ * @param out Queue.
+ * @param base Start of the bytes.
+ * @param len Byte count.
+ * @return 0 on success, -1 on error.
+ */
+static int cat_add(cat_out *out, const void *base, size_t len) {
+    struct iovec *last = out->count ? &out->iov[out->count - 1] : NULL;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (last != NULL && (const char *) last->iov_base + last->iov_len == (const char *) base) {
+        last->iov_len += len;
+        return 0;
+    }
+    if (out->count == IOV_MAX && cat_flush(out) == -1) {
+        return -1;
+    }
+    out->iov[out->count].iov_base = (void *) base;
+    out->iov[out->count].iov_len = len;
+    out->count++;
+    return 0;
+}
+
+/**
+ * Queue zeros for a hole.
+ * @param out Queue.
+ * @param len Byte count.
+ * @return 0 on success, -1 on error.
+ */
+static int cat_zeros(cat_out *out, unsigned long len) {
+    size_t n;
+
+    for (; len > 0; len -= n) {
+        n = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+        /**< Not merged, every vector of zeros restarts at the same block. */
+        if (out->count == IOV_MAX && cat_flush(out) == -1) {
+            return -1;
+        }
+        out->iov[out->count].iov_base = (void *) cat_zero;
+        out->iov[out->count].iov_len = n;
+        out->count++;
+    }
+    return 0;
+}
+
+/**
+ * Write the data of a file to a descriptor.
+ * @param entry Directory entry of the file.
+ * @param length Bytes to write, the file length.
+ * @param fd Output descriptor.
+ * @return 0 on success, -1 on error.
+ */
+int do_cat(fcb *entry, unsigned long length, int fd) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    cat_out *out;
+    unsigned char *buf;
+    unsigned long pos = 0, at;
+    int block = entry->first, n, ret = 0;
+
+    if (entry->reserve[0] & FCB_COMPRESS) {
+        /**< Compressed files are rewritten whole, the entry always has the length. */
+        length = entry->length;
+        if ((buf = (unsigned char *) malloc(length + 1)) == NULL || file_load(entry, buf) == -1) {
+            free(buf);
+            return -1;
+        }
+        for (at = 0; at < length && ret == 0; at += n) {
+            n = (int) write(fd, buf + at, length - at);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+            } else if (n < 0) {
+                ret = -1;
+            }
+        }
+        free(buf);
+        return ret;
+    }
+
+    if ((out = (cat_out *) malloc(sizeof(cat_out))) == NULL) {
+        return -1;
+    }
+    out->fd = fd;
+    out->count = 0;
+
+    if (entry->reserve[0] & FCB_INLINE) {
+        ret = cat_add(out, inline_data_of(entry), length);
+        pos = length;
+    }
+    while (ret == 0 && pos < length && block != END && block != FREE) {
+        n = length - pos < BLOCK_SIZE ? (int) (length - pos) : BLOCK_SIZE;
+        ret = cat_add(out, fs_head + BLOCK_SIZE * block, n);
+        pos += n;
+        if (fat0[block].id == END || fat0[block].id == FREE) {
+            break;
+        }
+        /**< Blocks skipped by a hole read as zeros. */
+        at = pos + (unsigned long) fat_gap(fat0[block].id) * BLOCK_SIZE;
+        if (ret == 0 && pos < length) {
+            ret = cat_zeros(out, (at < length ? at : length) - pos);
+        }
+        pos = at;
+        block = fat_next(fat0[block].id);
+    }
+    if (ret == 0 && pos < length) {
+        /**< Tail hole after the last block. */
+        ret = cat_zeros(out, length - pos);
+    }
+    if (ret == 0) {
+        ret = cat_flush(out);
+    }
+    free(out);
+    return ret;
+}
+
+/**
+ * Print files, binary safe.
+ * @param args 'path' one or more files to print.
+ * @return Always 1.
+ */
+int my_cat(char **args) {
+    unsigned long length;
+    int i, j;
+    fcb *file;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "cat: missing operand\n");
+        return 1;
+    }
+
+    /**< Bytes printed by the shell so far must come out first. */
+    fflush(stdout);
+    for (i = 1; args[i] != NULL; i++) {
+        if ((file = find_fcb(args[i])) == NULL) {
+            fprintf(stderr, "cat: %s: No such file\n", args[i]);
+            continue;
+        }
+        if (file->attribute == 0) {
+            fprintf(stderr, "cat: %s: Is a directory\n", args[i]);
+            continue;
+        }
+
+        /**< An open file may have grown past the length of its entry. */
+        length = file->length;
+        if ((j = get_openfile(file)) != -1) {
+            length = openfile_list[j].open_fcb.length;
+        }
+
+        if (do_cat(file, length, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "cat: %s: write error\n", args[i]);
+            break;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,545 @@
+/**
+ * @file    compress.c
+ * @brief   Transparent per-file compression.
+ * @details A compressed file (FCB_COMPRESS) stores its data as a stream of LZ_CHUNK sized
+ *          chunks, each a 4-byte header (original and stored length, equal when the chunk
+ *          did not shrink) followed by the lz data, packed in a plain chain of blocks.
+ *          The stored stream length lives in reserve[1..4], length stays the file size.
+ *          Reads decompress whole chunks into a small cache, writes recompress the chunks
+ *          they touch.
+ */
+
+#include "simplefs.h"
+
+#define ZHEAD_SIZE      4       /**< Chunk header, original then stored length. */
+
+/**
+ * @brief A decompressed chunk.
+ */
+typedef struct ZCACHE {
+    int first;                  /**< First block of the file, -1 if the slot is empty. */
+    int chunk;                  /**< Chunk index in the file. */
+    int len;                    /**< Bytes of data. */
+    unsigned long stamp;        /**< Last use, the oldest slot is replaced. */
+    unsigned char data[LZ_CHUNK];
+} zcache;
+
+static zcache zcache_slot[ZCACHE_SLOTS] = {[0 ... ZCACHE_SLOTS - 1] = {.first = -1}};
+static unsigned long zcache_clock = 0;
+static pthread_mutex_t zcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the length of the stored stream of a compressed file.
+ * @param file FCB of the file.
+ * @return Bytes in its chain.
+ */
+unsigned long file_stored(fcb *file) {
+    unsigned int stored;
+
+    if (!(file->reserve[0] & FCB_COMPRESS)) {
+        return file->length;
+    }
+    memcpy(&stored, file->reserve + 1, sizeof(stored));
+    return stored;
+}
+
+/**
+ * Set the length of the stored stream of a compressed file.
+ * @param file FCB of the file.
+ * @param stored Bytes in its chain.
+ */
+static void zfile_set_stored(fcb *file, unsigned long stored) {
+    unsigned int n = (unsigned int) stored;
+
+    memcpy(file->reserve + 1, &n, sizeof(n));
+}
+
+/**
+ * Read bytes from a chain, moving a cursor along it.
+ * @param block Current block, updated.
+ * @param off Offset in the current block, updated.
+ * @param buf Output, NULL to skip.
+ * @param n Bytes to read.
+ */
+static void zfile_copy(int *block, int *off, unsigned char *buf, int n) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int step;
+
+    while (n > 0) {
+        if (*off == BLOCK_SIZE) {
+            *block = fat_next(fat0[*block].id);
+            *off = 0;
+        }
+        step = BLOCK_SIZE - *off < n ? BLOCK_SIZE - *off : n;
+        if (buf != NULL) {
+            memcpy(buf, fs_head + BLOCK_SIZE * *block + *off, step);
+            buf += step;
+        }
+        *off += step;
+        n -= step;
+    }
+}
+
+/**
+ * Decode one chunk at a cursor.
+ * @param block Current block, updated.
+ * @param off Offset in the current block, updated.
+ * @param out Output of LZ_CHUNK bytes, NULL to skip the chunk.
+ * @return Original length of the chunk, -1 if corrupt.
+ */
+static int zfile_chunk(int *block, int *off, unsigned char *out) {
+    unsigned char head[ZHEAD_SIZE], packed[LZ_CHUNK];
+    int ulen, clen;
+
+    zfile_copy(block, off, head, ZHEAD_SIZE);
+    ulen = head[0] | (head[1] << 8);
+    clen = head[2] | (head[3] << 8);
+    if (ulen > LZ_CHUNK || clen > ulen) {
+        return -1;
+    }
+    if (out == NULL) {
+        zfile_copy(block, off, NULL, clen);
+    } else if (clen == ulen) {
+        zfile_copy(block, off, out, clen);
+    } else {
+        zfile_copy(block, off, packed, clen);
+        if (lz_decompress(packed, clen, out, LZ_CHUNK) != ulen) {
+            return -1;
+        }
+    }
+    return ulen;
+}
+
+/**
+ * Drop the cached chunks of a file whose first block is freed.
+ * @param block Block num.
+ */
+void zfile_forget(int block) {
+    int i;
+
+    pthread_mutex_lock(&zcache_lock);
+    for (i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache_slot[i].first == block) {
+            zcache_slot[i].first = -1;
+        }
+    }
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+/**
+ * Drop the cached chunks of a file from a chunk on, they were rewritten.
+ * @param first First block of the file.
+ * @param chunk First chunk rewritten.
+ */
+static void zcache_drop(int first, int chunk) {
+    int i;
+
+    pthread_mutex_lock(&zcache_lock);
+    for (i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache_slot[i].first == first && zcache_slot[i].chunk >= chunk) {
+            zcache_slot[i].first = -1;
+        }
+    }
+    pthread_mutex_unlock(&zcache_lock);
+}
+
+/**
+ * Read a compressed file through the chunk cache.
+ * @param file FCB of the file.
+ * @param pos Position to read from.
+ * @param len Bytes to read, within the file.
+ * @param text Output.
+ * @return Bytes read, -1 if the file is corrupt.
+ */
+int zfile_read(fcb *file, unsigned long pos, int len, char *text) {
+    zcache *slot, *victim;
+    int i, k, n, skip, block, off, done = 0;
+
+    pthread_mutex_lock(&zcache_lock);
+    while (done < len) {
+        k = (int) ((pos + done) / LZ_CHUNK);
+        victim = &zcache_slot[0];
+        slot = NULL;
+        for (i = 0; i < ZCACHE_SLOTS; i++) {
+            if (zcache_slot[i].first == file->first && zcache_slot[i].chunk == k) {
+                slot = &zcache_slot[i];
+                break;
+            }
+            if (zcache_slot[i].stamp < victim->stamp) {
+                victim = &zcache_slot[i];
+            }
+        }
+
+        /**< Miss, skip the chunks before it and decode it into the oldest slot. */
+        if (slot == NULL) {
+            slot = victim;
+            slot->first = -1;
+            block = file->first;
+            off = 0;
+            for (i = 0; i < k; i++) {
+                if (zfile_chunk(&block, &off, NULL) == -1) {
+                    pthread_mutex_unlock(&zcache_lock);
+                    return -1;
+                }
+            }
+            if ((slot->len = zfile_chunk(&block, &off, slot->data)) == -1) {
+                pthread_mutex_unlock(&zcache_lock);
+                return -1;
+            }
+            slot->first = file->first;
+            slot->chunk = k;
+        }
+        slot->stamp = ++zcache_clock;
+
+        skip = (int) ((pos + done) % LZ_CHUNK);
+        n = slot->len - skip < len - done ? slot->len - skip : len - done;
+        if (n <= 0) {
+            break;
+        }
+        memcpy(text + done, slot->data + skip, n);
+        done += n;
+    }
+    pthread_mutex_unlock(&zcache_lock);
+    return done;
+}
+
+/**
+ * Load the whole data of a file, holes read as zeros.
+ * Only reads the image, callers may run in parallel.
+ * @param file Directory entry of the file.
+ * @param buf Output of length bytes.
+ * @return 0 on success, -1 if the file is corrupt.
+ */
+int file_load(fcb *file, unsigned char *buf) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned long pos;
+    int block = file->first, off = 0, n, lblk = 0;
+
+    if (file->reserve[0] & FCB_INLINE) {
+        memcpy(buf, inline_data_of(file), file->length);
+        return 0;
+    }
+    if (file->reserve[0] & FCB_COMPRESS) {
+        for (pos = 0; pos < file->length; pos += n) {
+            if ((n = zfile_chunk(&block, &off, buf + pos)) <= 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    memset(buf, 0, file->length);
+    while (1) {
+        pos = (unsigned long) lblk * BLOCK_SIZE;
+        if (pos >= file->length) {
+            break;
+        }
+        n = file->length - pos < BLOCK_SIZE ? (int) (file->length - pos) : BLOCK_SIZE;
+        memcpy(buf + pos, fs_head + BLOCK_SIZE * block, n);
+        if (fat0[block].id == END || fat0[block].id == FREE) {
+            break;
+        }
+        lblk += 1 + fat_gap(fat0[block].id);
+        block = fat_next(fat0[block].id);
+    }
+    return 0;
+}
+
+/**
+ * Compress data chunk by chunk, keep a chunk as is when it does not shrink.
+ * @param data Data.
+ * @param len Length of data.
+ * @param stream Output, room for len plus a header per chunk.
+ * @return Bytes of the stream.
+ */
+static unsigned long zfile_pack(const unsigned char *data, unsigned long len, unsigned char *stream) {
+    unsigned long pos, stored = 0;
+    int n, clen;
+
+    for (pos = 0; pos < len; pos += n) {
+        n = len - pos < LZ_CHUNK ? (int) (len - pos) : LZ_CHUNK;
+        clen = lz_compress(data + pos, n, stream + stored + ZHEAD_SIZE, n - 1);
+        if (clen == -1) {
+            clen = n;
+            memcpy(stream + stored + ZHEAD_SIZE, data + pos, n);
+        }
+        stream[stored] = (unsigned char) (n & 0xff);
+        stream[stored + 1] = (unsigned char) (n >> 8);
+        stream[stored + 2] = (unsigned char) (clen & 0xff);
+        stream[stored + 3] = (unsigned char) (clen >> 8);
+        stored += ZHEAD_SIZE + clen;
+    }
+    return stored;
+}
+
+/**
+ * Allocate a chain and fill it with a stream.
+ * @param stream Bytes to store.
+ * @param stored Length of stream.
+ * @param goal Block to search from, see get_free_near.
+ * @return First block, -1 without space.
+ */
+static int zfile_put(const unsigned char *stream, unsigned long stored, int goal) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned long pos;
+    int n, first, blocks, block, off = 0;
+
+    blocks = stored ? (int) ((stored + BLOCK_SIZE - 1) / BLOCK_SIZE) : 1;
+    if ((first = chain_alloc(blocks, goal)) == -1) {
+        return -1;
+    }
+    block = first;
+    for (pos = 0; pos < stored; pos += n) {
+        if (off == BLOCK_SIZE) {
+            block = fat_next(fat0[block].id);
+            off = 0;
+        }
+        n = stored - pos < BLOCK_SIZE - off ? (int) (stored - pos) : BLOCK_SIZE - off;
+        memcpy(fs_head + BLOCK_SIZE * block + off, stream + pos, n);
+        off += n;
+    }
+    return first;
+}
+
+/**
+ * Replace the data of a file, compressed or not as its flag says.
+ * The new chain is allocated before the old one is released.
+ * @param file FCB of the file, first, length and the stored length are updated.
+ * @param data New data.
+ * @param len Length of data.
+ * @return 0 on success, -1 without space.
+ */
+static int zfile_store(fcb *file, const unsigned char *data, unsigned long len) {
+    unsigned char *stream = (unsigned char *) data;
+    unsigned long stored = len;
+    int first;
+
+    if (file->reserve[0] & FCB_COMPRESS) {
+        stream = (unsigned char *) malloc(len + (len / LZ_CHUNK + 1) * ZHEAD_SIZE);
+        if (stream == NULL) {
+            return -1;
+        }
+        stored = zfile_pack(data, len, stream);
+    }
+
+    if ((first = zfile_put(stream, stored, file->first)) == -1) {
+        if (stream != data) {
+            free(stream);
+        }
+        return -1;
+    }
+    set_free(file->first, 0, 1);
+    file->first = first;
+    file->length = len;
+    zfile_set_stored(file, (file->reserve[0] & FCB_COMPRESS) ? stored : 0);
+    if (stream != data) {
+        free(stream);
+    }
+    return 0;
+}
+
+/**
+ * Get the stream position of a cursor.
+ * @param chain Blocks of the stream in order.
+ * @param block Current block.
+ * @param off Offset in the current block.
+ * @return Bytes before the cursor.
+ */
+static unsigned long zfile_tell(const int *chain, int block, int off) {
+    int i;
+
+    for (i = 0; chain[i] != block; i++);
+    return (unsigned long) i * BLOCK_SIZE + off;
+}
+
+/**
+ * Write into a compressed file.
+ * Only the chunks the write touches are recompressed. The stream is rebuilt from the block
+ * holding the first of them, in a new chain taking the recompressed chunks and the later
+ * ones copied as they are, the blocks before it stay.
+ * @param file FCB of the file.
+ * @param offset Position to write at.
+ * @param content Data to write.
+ * @param len Length of content.
+ * @param truncate 1 to drop the old data first.
+ * @return Bytes written, -1 on error.
+ */
+int zfile_write(fcb *file, unsigned long offset, const char *content, size_t len, int truncate) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned long size = file->length, stored = file_stored(file), head, lead, seglen, tail, total;
+    unsigned char *seg, *stream;
+    int chain[BLOCK_NUM];
+    int i, nk, start, last, pb, count = 0, first, block, off = 0;
+
+    if (truncate) {
+        size = offset + len;
+        if ((seg = (unsigned char *) calloc(size ? size : 1, 1)) == NULL) {
+            return -1;
+        }
+        memcpy(seg + offset, content, len);
+        if (zfile_store(file, seg, size) == -1) {
+            free(seg);
+            return -1;
+        }
+        free(seg);
+        return (int) len;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (offset + len > size) {
+        size = offset + len;
+    }
+
+    /**< Chunks start to last are rebuilt, a partial last chunk is filled by a write past it. */
+    nk = (int) ((file->length + LZ_CHUNK - 1) / LZ_CHUNK);
+    start = (int) (offset / LZ_CHUNK);
+    last = (int) ((offset + len - 1) / LZ_CHUNK);
+    if (start >= nk) {
+        start = file->length % LZ_CHUNK ? nk - 1 : nk;
+    }
+    for (block = file->first; count < BLOCK_NUM; block = fat_next(fat0[block].id)) {
+        chain[count++] = block;
+        if (fat0[block].id == END || fat0[block].id == FREE) {
+            break;
+        }
+    }
+
+    /**< Decode only the chunks the write lands in. */
+    seglen = (size < (unsigned long) (last + 1) * LZ_CHUNK ? size : (unsigned long) (last + 1) * LZ_CHUNK) -
+             (unsigned long) start * LZ_CHUNK;
+    if ((seg = (unsigned char *) calloc(seglen, 1)) == NULL) {
+        return -1;
+    }
+    block = file->first;
+    for (i = 0; i < start; i++) {
+        if (zfile_chunk(&block, &off, NULL) == -1) {
+            free(seg);
+            return -1;
+        }
+    }
+    head = zfile_tell(chain, block, off);
+    for (i = start; i <= last && i < nk; i++) {
+        if (zfile_chunk(&block, &off, seg + (unsigned long) (i - start) * LZ_CHUNK) == -1) {
+            free(seg);
+            return -1;
+        }
+    }
+    tail = stored - zfile_tell(chain, block, off);
+    memcpy(seg + offset - (unsigned long) start * LZ_CHUNK, content, len);
+
+    /**< A block dedup shares cannot be relinked, start over from the first one then. */
+    pb = (int) (head / BLOCK_SIZE);
+    if (pb > 0 && block_shared(chain[pb - 1])) {
+        pb = 0;
+    }
+    lead = head - (unsigned long) pb * BLOCK_SIZE;
+    if ((stream = (unsigned char *) malloc(lead + seglen + (seglen / LZ_CHUNK + 1) * ZHEAD_SIZE + tail)) == NULL) {
+        free(seg);
+        return -1;
+    }
+    for (i = pb, total = 0; total < lead; i++, total += BLOCK_SIZE) {
+        memcpy(stream + total, fs_head + BLOCK_SIZE * chain[i], lead - total < BLOCK_SIZE ? lead - total : BLOCK_SIZE);
+    }
+    total = lead + zfile_pack(seg, seglen, stream + lead);
+    zfile_copy(&block, &off, stream + total, (int) tail);
+    total += tail;
+    free(seg);
+
+    if ((first = zfile_put(stream, total, pb < count ? chain[pb] : chain[pb - 1])) == -1) {
+        free(stream);
+        return -1;
+    }
+    free(stream);
+    if (pb == 0) {
+        set_free(file->first, 0, 1);
+        file->first = first;
+    } else {
+        extent_forget(chain[pb - 1]);
+        fat0[chain[pb - 1]].id = first;
+        if (pb < count) {
+            set_free(chain[pb], 0, 1);
+        }
+        zcache_drop(file->first, start);
+    }
+    file->length = size;
+    zfile_set_stored(file, (unsigned long) pb * BLOCK_SIZE + total);
+    return (int) len;
+}
+
+/**
+ * Switch a file between compressed and plain storage.
+ * @param file Directory entry of the file.
+ * @param on 1 to compress, 0 to decompress.
+ * @return 0 on success, -1 on error.
+ */
+static int zfile_convert(fcb *file, int on) {
+    unsigned char *buf;
+    unsigned char flags = file->reserve[0];
+    int ret;
+
+    if ((buf = (unsigned char *) malloc(file->length ? file->length : 1)) == NULL) {
+        return -1;
+    }
+    if (file_load(file, buf) == -1) {
+        free(buf);
+        return -1;
+    }
+    if (on) {
+        file->reserve[0] |= FCB_COMPRESS;
+    } else {
+        file->reserve[0] &= ~FCB_COMPRESS;
+    }
+    if ((ret = zfile_store(file, buf, file->length)) == -1) {
+        file->reserve[0] = flags;
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * Compress or decompress files.
+ * @param args '-d' to decompress, 'path' files to convert.
+ * @return Always 1.
+ */
+int my_compress(char **args) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    int i, on = 1;
+    unsigned long before;
+    fcb *file;
+
+    if (args[1] != NULL && !strcmp(args[1], "-d")) {
+        on = 0;
+        args++;
+    }
+    if (args[1] == NULL) {
+        fprintf(stderr, "compress: missing operand\n");
+        return 1;
+    }
+
+    for (i = 1; args[i] != NULL; i++) {
+        if ((file = find_fcb(args[i])) == NULL || file->attribute == 0) {
+            fprintf(stderr, "compress: cannot access %s: No such file\n", args[i]);
+            continue;
+        }
+        /**< Inline files are already stored in their entry. */
+        if ((file->reserve[0] & FCB_INLINE) || !(file->reserve[0] & FCB_COMPRESS) == !on) {
+            continue;
+        }
+        if (get_openfile(file) != -1) {
+            fprintf(stderr, "compress: %s: close it first\n", args[i]);
+            continue;
+        }
+
+        before = file_stored(file);
+        if (zfile_convert(file, on) == -1) {
+            fprintf(stderr, "compress: %s: No more space\n", args[i]);
+            continue;
+        }
+        printf("%s: %lu -> %lu bytes (%.1f%%)\n", args[i], before, file_stored(file),
+               before ? 100.0 * file_stored(file) / before : 100.0);
+    }
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+    return 1;
+}
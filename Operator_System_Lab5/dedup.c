@@ -0,0 +1,562 @@
+/**
+ * @file    dedup.c
+ * @brief   Content-hash deduplication of file blocks.
+ * @details A FAT entry has a single next block, so two chains can only share a block if
+ *          they also share everything after it. When a written file is closed, the hash
+ *          of every suffix of its chain is looked up in an in-memory index, the longest
+ *          suffix already on disk is linked in and the file's own copy released.
+ *          The reference table counts the extra chains running through each block.
+ */
+
+#include "simplefs.h"
+
+static short dedup_table[DEDUP_SLOTS];  /**< Open addressing index, a block num, -1 empty, -2 deleted. */
+static uint64_t dedup_key[BLOCK_NUM][2];        /**< Suffix hash indexed for each block. */
+static short dedup_pos[BLOCK_NUM];      /**< Index slot of each block, -1 if not indexed. */
+static int dedup_ready = 0;             /**< Index built for the current image. */
+static int dedup_deleted = 0;           /**< Deleted slots, the index is rebuilt when too many. */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;  /**< Protect the index while building. */
+
+/**
+ * @brief Work done by dedup since the program started.
+ */
+static struct {
+    unsigned long blocks;       /**< Blocks hashed. */
+    unsigned long bytes;        /**< Bytes hashed. */
+    unsigned long matches;      /**< Files linked to an existing suffix. */
+    unsigned long saved;        /**< Blocks released by those links. */
+    double cpu;                 /**< CPU seconds spent hashing, looking up and linking. */
+} dedup_stat;
+
+/**
+ * @brief Counters of the dedup ratio walk.
+ */
+typedef struct DEDUPCOUNT {
+    unsigned char map[BLOCK_NUM / 8];
+    int logical;                /**< Blocks of every file chain, shared ones counted per file. */
+    int physical;               /**< Distinct blocks of those chains. */
+    int files;
+} dedup_count;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * 128-bit MurmurHash3 (x64 variant, seed 0).
+ * @param key Data to hash.
+ * @param len Length of data.
+ * @param out Hash.
+ */
+void dedup_hash(const void *key, int len, uint64_t out[2]) {
+    const unsigned char *data = (const unsigned char *) key;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    unsigned char tail[16];
+    int i, rest = len & 15;
+
+    for (i = 0; i < len / 16; i++) {
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    /**< Tail bytes, zero padded. */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + len - rest, rest);
+    memcpy(&k1, tail, 8);
+    memcpy(&k2, tail + 8, 8);
+    if (rest > 8) {
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    if (rest > 0) {
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= (uint64_t) len;
+    h2 ^= (uint64_t) len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+/**
+ * CPU time of the process.
+ * @return Seconds.
+ */
+static double dedup_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Follow the chain of a file.
+ * @param first First block.
+ * @param length File length, bounds the bytes hashed in the last block.
+ * @param blocks Output, blocks in chain order.
+ * @param gaps Output, holes after each block.
+ * @return Block count, the used bytes of the last block in *last.
+ */
+static int dedup_chain(int first, unsigned long length, int *blocks, int *gaps, int *last) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned long pos = 0;
+    int n = 0, block = first;
+
+    while (n < BLOCK_NUM) {
+        blocks[n] = block;
+        gaps[n] = fat0[block].id == END ? 0 : fat_gap(fat0[block].id);
+        n++;
+        if (fat0[block].id == END || fat0[block].id == FREE) {
+            break;
+        }
+        pos += 1 + gaps[n - 1];
+        block = fat_next(fat0[block].id);
+    }
+
+    /**< Trailing holes are implied by the length, the last block may be full. */
+    if (length <= pos * BLOCK_SIZE) {
+        *last = 0;
+    } else if (length - pos * BLOCK_SIZE >= BLOCK_SIZE) {
+        *last = BLOCK_SIZE;
+    } else {
+        *last = (int) (length - pos * BLOCK_SIZE);
+    }
+    return n;
+}
+
+/**
+ * Hash every suffix of a chain, from the tail.
+ * A suffix hash covers the block data, the holes after it and the suffix hash of the rest.
+ * @param blocks Blocks in chain order.
+ * @param gaps Holes after each block.
+ * @param n Block count.
+ * @param last Used bytes of the last block.
+ * @param keys Output, suffix hash of each block.
+ */
+static void dedup_suffix(const int *blocks, const int *gaps, int n, int last, uint64_t (*keys)[2]) {
+    uint64_t buf[5];
+    int i, used;
+
+    for (i = n - 1; i >= 0; i--) {
+        used = i == n - 1 ? last : BLOCK_SIZE;
+        dedup_hash(fs_head + BLOCK_SIZE * blocks[i], used, buf);
+        buf[2] = i == n - 1 ? 0 : keys[i + 1][0];
+        buf[3] = i == n - 1 ? 0 : keys[i + 1][1];
+        buf[4] = ((uint64_t) gaps[i] << 32) | (uint64_t) used;
+        dedup_hash(buf, sizeof(buf), keys[i]);
+    }
+    __atomic_add_fetch(&dedup_stat.blocks, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dedup_stat.bytes, (unsigned long) (n - 1) * BLOCK_SIZE + last, __ATOMIC_RELAXED);
+}
+
+/**
+ * Remove a block from the index.
+ * @param block Block num.
+ */
+static void dedup_remove(int block) {
+    if (dedup_pos[block] >= 0) {
+        dedup_table[dedup_pos[block]] = -2;
+        dedup_pos[block] = -1;
+        dedup_deleted++;
+    }
+}
+
+/**
+ * Index a block under its suffix hash.
+ * @param block Block num.
+ * @param key Suffix hash starting at block.
+ */
+static void dedup_insert(int block, const uint64_t key[2]) {
+    int i, slot;
+
+    if (dedup_pos[block] >= 0 && !memcmp(dedup_key[block], key, sizeof(dedup_key[block]))) {
+        return;
+    }
+    dedup_remove(block);
+
+    /**< Too many deleted slots make probing long, reinsert what is left. */
+    if (dedup_deleted > DEDUP_SLOTS / 4) {
+        memset(dedup_table, -1, sizeof(dedup_table));
+        for (i = 0; i < BLOCK_NUM; i++) {
+            if (dedup_pos[i] >= 0) {
+                for (slot = (int) (dedup_key[i][0] % DEDUP_SLOTS); dedup_table[slot] != -1;
+                     slot = (slot + 1) % DEDUP_SLOTS);
+                dedup_table[slot] = (short) i;
+                dedup_pos[i] = (short) slot;
+            }
+        }
+        dedup_deleted = 0;
+    }
+
+    for (slot = (int) (key[0] % DEDUP_SLOTS); dedup_table[slot] >= 0; slot = (slot + 1) % DEDUP_SLOTS);
+    if (dedup_table[slot] == -2) {
+        dedup_deleted--;
+    }
+    dedup_table[slot] = (short) block;
+    dedup_pos[block] = (short) slot;
+    memcpy(dedup_key[block], key, sizeof(dedup_key[block]));
+}
+
+/**
+ * Check whether a chain starting at a block holds the same data as a suffix.
+ * @param block First block of the candidate.
+ * @param blocks Blocks of the suffix.
+ * @param gaps Holes after each block of the suffix.
+ * @param n Block count of the suffix.
+ * @param last Used bytes of the last block.
+ * @return 1 if equal and the candidate can take one more reference, else 0.
+ */
+static int dedup_same(int block, const int *blocks, const int *gaps, int n, int last) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char *refs = ref_table();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (fat0[block].id == FREE || refs[block] == MAX_REF || block == blocks[i] ||
+            memcmp(fs_head + BLOCK_SIZE * block, fs_head + BLOCK_SIZE * blocks[i],
+                   i == n - 1 ? last : BLOCK_SIZE)) {
+            return 0;
+        }
+        if (i == n - 1) {
+            return fat0[block].id == END;
+        }
+        if (fat0[block].id == END || fat_gap(fat0[block].id) != gaps[i]) {
+            return 0;
+        }
+        block = fat_next(fat0[block].id);
+    }
+    return 0;
+}
+
+/**
+ * Find an indexed chain holding a suffix.
+ * @param key Suffix hash.
+ * @param blocks Blocks of the suffix.
+ * @param gaps Holes after each block of the suffix.
+ * @param n Block count of the suffix.
+ * @param last Used bytes of the last block.
+ * @return First block of the chain, -1 if none.
+ */
+static int dedup_lookup(const uint64_t key[2], const int *blocks, const int *gaps, int n, int last) {
+    int slot, block;
+
+    for (slot = (int) (key[0] % DEDUP_SLOTS); dedup_table[slot] != -1; slot = (slot + 1) % DEDUP_SLOTS) {
+        block = dedup_table[slot];
+        if (block >= 0 && !memcmp(dedup_key[block], key, sizeof(dedup_key[block])) &&
+            dedup_same(block, blocks, gaps, n, last)) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Index the blocks of one directory's files, called by the walker threads.
+ * @param w Walker.
+ * @param first First block of the directory.
+ * @param path Absolute path of the directory.
+ */
+static void dedup_visit(walker *w, int first, const char *path) {
+    int blocks[BLOCK_NUM], gaps[BLOCK_NUM];
+    uint64_t keys[BLOCK_NUM][2];
+    int i = -1, j, n, last, block = first;
+    fcb *dir;
+
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 0 || (block == first && i < 2)) {
+            continue;
+        }
+        if (dir->attribute == 0) {
+            walk_push(w, dir->first, path);
+        } else if (!(dir->reserve[0] & FCB_INLINE) && dir->length > 0) {
+            n = dedup_chain(dir->first, file_stored(dir), blocks, gaps, &last);
+            dedup_suffix(blocks, gaps, n, last, keys);
+            pthread_mutex_lock(&dedup_lock);
+            for (j = 0; j < n; j++) {
+                dedup_insert(blocks[j], keys[j]);
+            }
+            pthread_mutex_unlock(&dedup_lock);
+        }
+    }
+}
+
+/**
+ * Build the index from every file on disk.
+ */
+static void dedup_build(void) {
+    double start = dedup_clock();
+
+    memset(dedup_table, -1, sizeof(dedup_table));
+    memset(dedup_pos, -1, sizeof(dedup_pos));
+    dedup_deleted = 0;
+    walk_tree(((block0 *) fs_head)->root, ROOT, dedup_visit, NULL, 0);
+    dedup_ready = 1;
+    dedup_stat.cpu += dedup_clock() - start;
+}
+
+/**
+ * Forget the index, the image changed under it.
+ */
+void dedup_reset(void) {
+    dedup_ready = 0;
+}
+
+/**
+ * Drop a block from the index, called when it is freed.
+ * @param block Block num.
+ */
+void dedup_forget(int block) {
+    if (dedup_ready) {
+        dedup_remove(block);
+    }
+}
+
+/**
+ * Deduplicate a file which was just written.
+ * The longest suffix of its chain already stored elsewhere replaces its own blocks.
+ * @param file FCB of the file, first is updated when the whole chain is shared.
+ * @return Blocks released.
+ */
+int dedup_file(fcb *file) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    unsigned char *refs = ref_table();
+    int blocks[BLOCK_NUM], gaps[BLOCK_NUM];
+    uint64_t keys[BLOCK_NUM][2];
+    int i, n, last, block = -1, saved = 0;
+    double start;
+
+    if (!(init_block->flags & FS_DEDUP) || refs == NULL || (file->reserve[0] & FCB_INLINE) ||
+        file->length == 0) {
+        return 0;
+    }
+    if (!dedup_ready) {
+        dedup_build();
+    }
+    start = dedup_clock();
+
+    n = dedup_chain(file->first, file_stored(file), blocks, gaps, &last);
+    for (i = 0; i < n; i++) {
+        if (refs[blocks[i]] > 0) {
+            /**< Already linked, it was not written since. */
+            dedup_stat.cpu += dedup_clock() - start;
+            return 0;
+        }
+    }
+    dedup_suffix(blocks, gaps, n, last, keys);
+
+    /**< The first match is the longest suffix. */
+    for (i = 0; i < n; i++) {
+        if ((block = dedup_lookup(keys[i], blocks + i, gaps + i, n - i, last)) != -1) {
+            break;
+        }
+    }
+
+    if (i < n) {
+        if (i == 0) {
+            file->first = block;
+        } else {
+            fat0[blocks[i - 1]].id = fat_link(block, gaps[i - 1]);
+        }
+        for (; block != END; block = fat0[block].id == END ? END : fat_next(fat0[block].id)) {
+            refs[block]++;
+        }
+        for (block = i; block < n; block++) {
+            extent_forget(blocks[block]);
+            fat0[blocks[block]].id = FREE;
+            dedup_remove(blocks[block]);
+            zfile_forget(blocks[block]);
+        }
+        memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+        saved = n - i;
+        dedup_stat.matches++;
+        dedup_stat.saved += saved;
+        n = i;
+    }
+    for (i = 0; i < n; i++) {
+        dedup_insert(blocks[i], keys[i]);
+    }
+
+    dedup_stat.cpu += dedup_clock() - start;
+    return saved;
+}
+
+/**
+ * Give a file its own copy of every shared block, before it is written.
+ * The copies keep pointing at the shared rest until it is copied too,
+ * so the chain stays valid if space runs out half way.
+ * Only FAT0 is changed, the caller mirrors it.
+ * @param file FCB of the file, first is updated when the first block was shared.
+ * @return 0 on success, -1 without space.
+ */
+int dedup_unshare(fcb *file) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char *refs = ref_table();
+    int block = file->first, prev = -1, fresh;
+    unsigned short id;
+
+    if (refs == NULL || (file->reserve[0] & FCB_INLINE)) {
+        return 0;
+    }
+    while (refs[block] == 0) {
+        if (fat0[block].id == END || fat0[block].id == FREE) {
+            return 0;
+        }
+        prev = block;
+        block = fat_next(fat0[block].id);
+    }
+
+    /**< Everything after the first shared block is shared too. */
+    extent_forget(block);
+    while (1) {
+        id = fat0[block].id;
+        if ((fresh = get_free(1)) == -1) {
+            return -1;
+        }
+        memcpy(fs_head + BLOCK_SIZE * fresh, fs_head + BLOCK_SIZE * block, BLOCK_SIZE);
+        fat0[fresh].id = id;
+        if (prev == -1) {
+            file->first = fresh;
+        } else {
+            fat0[prev].id = fat_link(fresh, fat_gap(fat0[prev].id));
+        }
+        refs[block]--;
+        prev = fresh;
+        if (id == END) {
+            return 0;
+        }
+        block = fat_next(id);
+    }
+}
+
+/**
+ * Count logical and physical blocks of one directory's files, called by the walker threads.
+ * @param w Walker, its arg is the counters.
+ * @param first First block of the directory.
+ * @param path Absolute path of the directory.
+ */
+static void dedup_count_visit(walker *w, int first, const char *path) {
+    dedup_count *count = (dedup_count *) w->arg;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int i = -1, block = first, b, logical, physical, files = 0;
+    unsigned char bit;
+    fcb *dir;
+
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 0 || (block == first && i < 2)) {
+            continue;
+        }
+        if (dir->attribute == 0) {
+            walk_push(w, dir->first, path);
+            continue;
+        }
+        files++;
+        if (dir->reserve[0] & FCB_INLINE) {
+            continue;
+        }
+        logical = physical = 0;
+        for (b = dir->first; logical < BLOCK_NUM; b = fat_next(fat0[b].id)) {
+            bit = (unsigned char) (1 << (b & 7));
+            logical++;
+            if (!(__atomic_fetch_or(&count->map[b >> 3], bit, __ATOMIC_RELAXED) & bit)) {
+                physical++;
+            }
+            if (fat0[b].id == END || fat0[b].id == FREE) {
+                break;
+            }
+        }
+        __atomic_add_fetch(&count->logical, logical, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&count->physical, physical, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&count->files, files, __ATOMIC_RELAXED);
+}
+
+/**
+ * Print the dedup ratio of the disk and the work dedup did.
+ */
+static void dedup_report(void) {
+    block0 *init_block = (block0 *) fs_head;
+    dedup_count count;
+
+    memset(&count, 0, sizeof(count));
+    walk_tree(init_block->root, ROOT, dedup_count_visit, &count, 0);
+    printf("dedup: %s, %d files, %d logical blocks, %d physical blocks, ratio %.2f\n",
+           init_block->flags & FS_DEDUP ? "on" : "off", count.files, count.logical, count.physical,
+           count.physical ? (double) count.logical / count.physical : 1.0);
+    printf("dedup: %lu blocks hashed (%.1f KB), %lu files linked, %lu blocks saved, cpu %.3f ms",
+           dedup_stat.blocks, dedup_stat.bytes / 1024.0, dedup_stat.matches, dedup_stat.saved,
+           dedup_stat.cpu * 1000);
+    if (dedup_stat.cpu > 0) {
+        printf(" (%.1f MB/s)", dedup_stat.bytes / dedup_stat.cpu / 1048576);
+    }
+    printf("\n");
+}
+
+/**
+ * Manage block deduplication.
+ * @param args 'on' to dedup files when they are closed after a write, 'off', nothing for statistics.
+ * @return Always 1.
+ */
+int my_dedup(char **args) {
+    block0 *init_block = (block0 *) fs_head;
+    int block;
+
+    if (args[1] == NULL) {
+        dedup_report();
+    } else if (!strcmp(args[1], "on")) {
+        /**< Reference table is created the first time. */
+        if (init_block->refs == 0) {
+            if ((block = get_free(1)) == -1) {
+                fprintf(stderr, "dedup: No more space\n");
+                return 1;
+            }
+            set_free(block, 1, 0);
+            memset(fs_head + BLOCK_SIZE * block, 0, BLOCK_SIZE);
+            init_block->refs = block;
+        }
+        init_block->flags |= FS_DEDUP;
+        dedup_build();
+    } else if (!strcmp(args[1], "off")) {
+        /**< Shared blocks stay shared, writes still unshare them. */
+        init_block->flags &= ~FS_DEDUP;
+    } else {
+        fprintf(stderr, "dedup: wrong argument\n");
+    }
+    return 1;
+}
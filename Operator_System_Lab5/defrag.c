@@ -0,0 +1,313 @@
+/**
+ * @file    defrag.c
+ * @brief   Online defragmenter of the FAT16 file system.
+ * @details Move the blocks of a fragmented file into one contiguous run, then rewrite
+ *          its chain and the first block in its directory entry.
+ */
+
+#include <sched.h>
+#include "simplefs.h"
+
+/**
+ * @brief Files picked for defragmentation.
+ */
+typedef struct DEFRAGLIST {
+    pthread_mutex_t lock;
+    fcb **files;
+    int count;
+    int capacity;
+} defrag_list;
+
+static pthread_t defrag_tid;
+static int defrag_started = 0;
+static volatile int defrag_running = 0;
+static volatile int defrag_quit = 0;
+
+/**
+ * Add a file entry to the list.
+ * @param list File list.
+ * @param file Directory entry of a file.
+ */
+static void defrag_add(defrag_list *list, fcb *file) {
+    pthread_mutex_lock(&list->lock);
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->files = (fcb **) realloc(list->files, list->capacity * sizeof(fcb *));
+        if (list->files == NULL) {
+            fprintf(stderr, "defrag: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->files[list->count++] = file;
+    pthread_mutex_unlock(&list->lock);
+}
+
+/**
+ * Collect the files of one directory, called by the walker threads.
+ * @param w Walker, its arg is the file list.
+ * @param first First block of the directory.
+ * @param path Absolute path of the directory.
+ */
+static void defrag_visit(walker *w, int first, const char *path) {
+    int i = -1, block = first;
+    char fullname[NAMELENGTH], child[PATHLENGTH];
+    fcb *dir;
+
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 0 || (block == first && i < 2)) {
+            continue;
+        }
+        if (dir->attribute == 1) {
+            /**< Inline files have no blocks to move. */
+            if (!(dir->reserve[0] & FCB_INLINE)) {
+                defrag_add((defrag_list *) w->arg, dir);
+            }
+        } else {
+            get_fullname(fullname, dir);
+            snprintf(child, PATHLENGTH, "%s%s%s", path, strcmp(path, ROOT) ? DELIM : "", fullname);
+            walk_push(w, dir->first, child);
+        }
+    }
+}
+
+/**
+ * Count blocks and non contiguous links of a chain.
+ * @param first First block of the chain.
+ * @param breaks Output, links whose next block is not the following block.
+ * @return Block count.
+ */
+int chain_frag(int first, int *breaks) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block = first, count = 1;
+
+    *breaks = 0;
+    while (fat0[block].id != END && fat0[block].id != FREE && count < BLOCK_NUM) {
+        if (fat_next(fat0[block].id) != block + 1) {
+            (*breaks)++;
+        }
+        block = fat_next(fat0[block].id);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Fragmentation score of a set of files.
+ * @param files File entries.
+ * @param count File count.
+ * @return Percentage of chain links which are not contiguous.
+ */
+static double defrag_score(fcb **files, int count) {
+    int i, breaks, links = 0, total = 0;
+
+    for (i = 0; i < count; i++) {
+        links += chain_frag(files[i]->first, &breaks) - 1;
+        total += breaks;
+    }
+    return links ? 100.0 * total / links : 0.0;
+}
+
+/**
+ * Move one file into a contiguous run.
+ * @param file Directory entry of the file.
+ * @return 1 if moved, 0 if already contiguous, -1 without enough contiguous space.
+ */
+int do_defrag(fcb *file) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    unsigned char gaps[BLOCK_NUM];
+    int i, n, breaks, block, target, old = file->first;
+    int dir = (int) (((unsigned char *) file - fs_head) / BLOCK_SIZE);
+
+    n = chain_frag(old, &breaks);
+    if (breaks == 0) {
+        return 0;
+    }
+
+    /**< Moving a chain dedup shares would give the file its own copy again. */
+    for (i = 0, block = old; i < n; i++, block = fat_next(fat0[block].id)) {
+        if (block_shared(block)) {
+            return 0;
+        }
+    }
+    /**< Into the group of its directory, next to the other files there. */
+    if ((target = get_free_near(n, ag_goal(dir, n))) == -1) {
+        return -1;
+    }
+
+    /**< Copy data in chain order, then swap chains keeping the holes. */
+    set_free(target, n, 0);
+    for (i = 0, block = old; i < n; i++, block = fat_next(fat0[block].id)) {
+        memcpy(fs_head + BLOCK_SIZE * (target + i), fs_head + BLOCK_SIZE * block, BLOCK_SIZE);
+        gaps[i] = (unsigned char) fat_gap(fat0[block].id);
+    }
+    for (i = 0; i < n - 1; i++) {
+        fat0[target + i].id = fat_link(target + i + 1, gaps[i]);
+        fat1[target + i].id = fat0[target + i].id;
+    }
+    set_free(old, 0, 1);
+    file->first = target;
+
+    /**< Open copies of the entry must follow. */
+    for (i = 0; i < MAX_OPENFILE; i++) {
+        if (openfile_list[i].free == 1 && openfile_list[i].open_fcb.first == old &&
+            !strcmp(openfile_list[i].open_fcb.filename, file->filename)) {
+            openfile_list[i].open_fcb.first = target;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Defragment a list of files.
+ * @param list File list.
+ * @param background 1 to take the file system lock per file.
+ */
+static void defrag_run(defrag_list *list, int background) {
+    int i, moved = 0, skipped = 0, first, ret;
+    double before, after;
+    fcb *file;
+
+    if (background) {
+        pthread_mutex_lock(&fs_lock);
+    }
+    before = defrag_score(list->files, list->count);
+    if (background) {
+        pthread_mutex_unlock(&fs_lock);
+    }
+
+    for (i = 0; i < list->count && !defrag_quit; i++) {
+        file = list->files[i];
+        first = file->first;
+        if (background) {
+            pthread_mutex_lock(&fs_lock);
+            /**< The entry may have been removed or rewritten meanwhile. */
+            if (file->free == 0 || file->attribute != 1 || file->first != first) {
+                pthread_mutex_unlock(&fs_lock);
+                continue;
+            }
+        }
+        ret = do_defrag(file);
+        if (ret > 0) {
+            moved++;
+        } else if (ret < 0) {
+            skipped++;
+        }
+        if (background) {
+            pthread_mutex_unlock(&fs_lock);
+            sched_yield();
+        }
+    }
+
+    if (background) {
+        pthread_mutex_lock(&fs_lock);
+    }
+    after = defrag_score(list->files, list->count);
+    if (background) {
+        pthread_mutex_unlock(&fs_lock);
+    }
+    printf("defrag: %d files, %d moved, %d without contiguous space, fragmentation %.1f%% -> %.1f%%\n",
+           list->count, moved, skipped, before, after);
+}
+
+/**
+ * Background defragment thread.
+ * @param arg File list, freed on exit.
+ */
+static void *defrag_thread(void *arg) {
+    defrag_list *list = (defrag_list *) arg;
+
+    defrag_run(list, 1);
+    free(list->files);
+    pthread_mutex_destroy(&list->lock);
+    free(list);
+    defrag_running = 0;
+    return NULL;
+}
+
+/**
+ * Stop the background defragment and wait for it.
+ * Called by the shell, which holds fs_lock.
+ */
+void defrag_stop(void) {
+    if (!defrag_started) {
+        return;
+    }
+    defrag_quit = 1;
+    /**< Let the thread finish the file it is moving. */
+    pthread_mutex_unlock(&fs_lock);
+    pthread_join(defrag_tid, NULL);
+    pthread_mutex_lock(&fs_lock);
+    defrag_quit = 0;
+    defrag_started = 0;
+}
+
+/**
+ * Defragment files.
+ * @param args '-b' to run in background, 'path' files to defragment, all files when empty.
+ * @return Always 1.
+ */
+int my_defrag(char **args) {
+    int i, background = 0, paths = 0;
+    defrag_list *list;
+    fcb *file;
+
+    if (defrag_running) {
+        fprintf(stderr, "defrag: already running\n");
+        return 1;
+    }
+    defrag_stop();
+
+    list = (defrag_list *) malloc(sizeof(defrag_list));
+    memset(list, 0, sizeof(defrag_list));
+    pthread_mutex_init(&list->lock, NULL);
+
+    for (i = 1; args[i] != NULL; i++) {
+        if (!strcmp(args[i], "-b")) {
+            background = 1;
+            continue;
+        }
+        if (args[i][0] == '-') {
+            fprintf(stderr, "defrag: wrong argument\n");
+            free(list->files);
+            free(list);
+            return 1;
+        }
+        paths++;
+        file = find_fcb(args[i]);
+        if (file == NULL || file->attribute == 0) {
+            fprintf(stderr, "defrag: cannot access %s: No such file\n", args[i]);
+            continue;
+        }
+        if (file->reserve[0] & FCB_INLINE) {
+            continue;
+        }
+        defrag_add(list, file);
+    }
+    /**< The whole file system only when no file was named, a bad name must not start it. */
+    if (paths == 0) {
+        walk_tree(((block0 *) fs_head)->root, ROOT, defrag_visit, list, 0);
+    }
+    if (paths > 0 && list->count == 0) {
+        free(list->files);
+        pthread_mutex_destroy(&list->lock);
+        free(list);
+        return 1;
+    }
+
+    if (background) {
+        defrag_running = 1;
+        if (pthread_create(&defrag_tid, NULL, defrag_thread, list) == 0) {
+            defrag_started = 1;
+            printf("defrag: running in background\n");
+            return 1;
+        }
+        defrag_running = 0;
+    }
+
+    defrag_run(list, 0);
+    free(list->files);
+    pthread_mutex_destroy(&list->lock);
+    free(list);
+    return 1;
+}
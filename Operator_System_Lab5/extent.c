@@ -0,0 +1,140 @@
+/**
+ * @file    extent.c
+ * @brief   Extent maps of large files for random access.
+ * @details A map lists the runs of a chain, logical blocks that sit on neighbour physical
+ *          blocks, in logical order, so the block of any offset is a binary search away
+ *          instead of a walk from the first block. Maps are derived from the FAT alone and
+ *          remember which blocks they cover. Whatever changes the FAT entry of a block (a
+ *          write allocating, defrag moving, a chain freed) calls extent_forget on it and
+ *          only the map of that file is dropped, it is built again on its next use.
+ */
+
+#include "simplefs.h"
+
+static extent_map extent_slot[EXTENT_SLOTS] = {[0 ... EXTENT_SLOTS - 1] = {.first = -1}};
+static unsigned long extent_clock = 0;
+
+/**
+ * Drop the map of the file a block belongs to.
+ * Called for every block whose FAT entry changes, before or after the change.
+ * @param block Block num.
+ */
+void extent_forget(int block) {
+    int i;
+
+    for (i = 0; i < EXTENT_SLOTS; i++) {
+        if (extent_slot[i].first != -1 && (extent_slot[i].blocks[block >> 3] & (1 << (block & 7)))) {
+            extent_slot[i].first = -1;
+        }
+    }
+}
+
+/**
+ * Drop every map, the whole FAT was replaced.
+ */
+void extent_reset(void) {
+    int i;
+
+    for (i = 0; i < EXTENT_SLOTS; i++) {
+        extent_slot[i].first = -1;
+    }
+}
+
+/**
+ * Build the map of a chain in the least recently used slot.
+ * @param first First block of the file.
+ * @return Map, NULL on allocation failure.
+ */
+static extent_map *extent_build(int first) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    extent_map *map = NULL;
+    extent *runs, *run;
+    unsigned short next;
+    int i, block = first, pos = 0, n;
+
+    for (i = 0; i < EXTENT_SLOTS; i++) {
+        if (map == NULL || extent_slot[i].stamp < map->stamp) {
+            map = &extent_slot[i];
+        }
+    }
+    map->first = -1;
+    map->count = 0;
+    memset(map->blocks, 0, sizeof(map->blocks));
+
+    for (n = 0; n < BLOCK_NUM; n++) {
+        run = map->count ? &map->runs[map->count - 1] : NULL;
+        if (run != NULL && run->lstart + run->len == pos && run->pstart + run->len == block) {
+            run->len++;
+        } else {
+            if (map->count == map->capacity) {
+                /**< A chain has at most BLOCK_NUM runs, grown as needed and kept for reuse. */
+                if ((runs = (extent *) realloc(map->runs, (map->capacity ? 2 * map->capacity : 16) * sizeof(extent))) == NULL) {
+                    return NULL;
+                }
+                map->runs = runs;
+                map->capacity = map->capacity ? 2 * map->capacity : 16;
+            }
+            run = &map->runs[map->count++];
+            run->lstart = pos;
+            run->pstart = block;
+            run->len = 1;
+        }
+        map->blocks[block >> 3] |= 1 << (block & 7);
+
+        next = fat0[block].id;
+        if (next == END || next == FREE) {
+            break;
+        }
+        pos += 1 + fat_gap(next);
+        block = fat_next(next);
+    }
+    map->first = first;
+    return map;
+}
+
+/**
+ * Get the map of a file, building it if it is not loaded.
+ * Called with fs_lock held, the map is valid until a block of the chain changes.
+ * @param first First block of the file.
+ * @return Map, NULL on allocation failure.
+ */
+extent_map *extent_get(int first) {
+    extent_map *map = NULL;
+    int i;
+
+    for (i = 0; i < EXTENT_SLOTS; i++) {
+        if (extent_slot[i].first == first) {
+            map = &extent_slot[i];
+            break;
+        }
+    }
+    if (map == NULL && (map = extent_build(first)) == NULL) {
+        return NULL;
+    }
+    map->stamp = ++extent_clock;
+    return map;
+}
+
+/**
+ * Find the block holding a logical block through a map.
+ * @param map Map of the file.
+ * @param lblk Logical block num.
+ * @return Physical block num, -1 if the logical block is a hole or past the end.
+ */
+int extent_find(extent_map *map, int lblk) {
+    int lo = 0, hi = map->count - 1, mid;
+
+    /**< Last run starting at or before lblk. */
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (map->runs[mid].lstart <= lblk) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (map->count == 0 || lblk < map->runs[lo].lstart || lblk >= map->runs[lo].lstart + map->runs[lo].len) {
+        return -1;
+    }
+    return map->runs[lo].pstart + lblk - map->runs[lo].lstart;
+}
@@ -0,0 +1,275 @@
+/**
+ * @file    find.c
+ * @brief   List and size whole sub trees, on top of the parallel walker.
+ * @details Each visitor scans a snapshot of its directory, so it never follows a slot
+ *          pointer into the image while other threads read the same blocks.
+ */
+
+#include <fnmatch.h>
+#include "simplefs.h"
+
+/**
+ * @brief Shared state of find.
+ */
+typedef struct FINDCTX {
+    pthread_mutex_t lock;
+    const char *pattern;        /**< Shell pattern the name must match, NULL for all. */
+    char **paths;               /**< Matches, sorted before printing. */
+    int count;
+    int capacity;
+} find_ctx;
+
+/**
+ * @brief Shared state of du.
+ */
+typedef struct DUCTX {
+    pthread_mutex_t lock;
+    du_count total;
+} du_ctx;
+
+/**
+ * Count the blocks of a chain.
+ * @param first First block.
+ * @return Block count, holes excluded.
+ */
+static int chain_blocks(int first) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block = first, n = 0;
+
+    while (block != END && block != FREE && n < BLOCK_NUM) {
+        n++;
+        block = fat_next(fat0[block].id);
+    }
+    return n;
+}
+
+/**
+ * Record a match.
+ * @param ctx Find state.
+ * @param path Absolute path.
+ * @param name Name compared to the pattern.
+ */
+static void find_add(find_ctx *ctx, const char *path, const char *name) {
+    if (ctx->pattern != NULL && fnmatch(ctx->pattern, name, 0)) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->count == ctx->capacity) {
+        ctx->capacity = ctx->capacity ? ctx->capacity * 2 : 64;
+        ctx->paths = (char **) realloc(ctx->paths, ctx->capacity * sizeof(char *));
+        if (ctx->paths == NULL) {
+            fprintf(stderr, "find: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ctx->paths[ctx->count++] = strdup(path);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Scan one directory for find, called by the walker threads.
+ * @param w Walker, its arg is the find state.
+ * @param first First block of the directory.
+ * @param path Absolute path of the directory.
+ */
+static void find_visit(walker *w, int first, const char *path) {
+    find_ctx *ctx = (find_ctx *) w->arg;
+    char fullname[NAMELENGTH], child[PATHLENGTH];
+    fcb *entries;
+    int i, n;
+
+    if ((n = walk_snapshot(first, &entries)) < 0) {
+        fprintf(stderr, "find: %s: allocation error\n", path);
+        return;
+    }
+    for (i = 2; i < n; i++) {
+        if (entries[i].free == 0) {
+            continue;
+        }
+        get_fullname(fullname, &entries[i]);
+        snprintf(child, PATHLENGTH, "%s%s%s", path, strcmp(path, ROOT) ? DELIM : "", fullname);
+        find_add(ctx, child, fullname);
+        if (entries[i].attribute == 0) {
+            walk_push(w, entries[i].first, child);
+        }
+    }
+    free(entries);
+}
+
+/**
+ * Compare two paths for qsort.
+ */
+static int find_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Print every path below a folder, itself included.
+ * @param args 'path' to search, '-name pattern' to keep matching names only, '-j n' to use n threads.
+ * @return Always 1.
+ */
+int my_find(char **args) {
+    find_ctx ctx;
+    char path[PATHLENGTH], *name;
+    const char *top = NULL;
+    int i, nthreads = 0;
+    fcb *entry;
+
+    memset(&ctx, 0, sizeof(ctx));
+    for (i = 1; args[i] != NULL; i++) {
+        if (!strcmp(args[i], "-name") && args[i + 1] != NULL) {
+            ctx.pattern = args[++i];
+        } else if (!strcmp(args[i], "-j") && args[i + 1] != NULL) {
+            nthreads = atoi(args[++i]);
+        } else if (top == NULL && args[i][0] != '-') {
+            top = args[i];
+        } else {
+            fprintf(stderr, "find: wrong argument\n");
+            return 1;
+        }
+    }
+
+    get_abspath(path, top != NULL ? top : current_dir);
+    if ((entry = find_fcb(path)) == NULL) {
+        fprintf(stderr, "find: %s: No such file or folder\n", path);
+        return 1;
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    name = strrchr(path, '/');
+    find_add(&ctx, path, name[1] != '\0' ? name + 1 : path);
+    if (entry->attribute == 0) {
+        walk_tree(entry->first, path, find_visit, &ctx, nthreads);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+
+    /**< Threads finish in any order, sort for a stable listing. */
+    qsort(ctx.paths, ctx.count, sizeof(char *), find_cmp);
+    for (i = 0; i < ctx.count; i++) {
+        printf("%s\n", ctx.paths[i]);
+        free(ctx.paths[i]);
+    }
+    free(ctx.paths);
+    return 1;
+}
+
+/**
+ * Size one directory for du, called by the walker threads.
+ * @param w Walker, its arg is the du state.
+ * @param first First block of the directory.
+ * @param path Absolute path of the directory.
+ */
+static void du_visit(walker *w, int first, const char *path) {
+    du_ctx *ctx = (du_ctx *) w->arg;
+    du_count local;
+    char fullname[NAMELENGTH], child[PATHLENGTH];
+    fcb *entries;
+    int i, n;
+
+    if ((n = walk_snapshot(first, &entries)) < 0) {
+        fprintf(stderr, "du: %s: allocation error\n", path);
+        return;
+    }
+    memset(&local, 0, sizeof(local));
+    local.dirs = 1;
+    local.blocks = chain_blocks(first);
+    for (i = 2; i < n; i++) {
+        if (entries[i].free == 0) {
+            continue;
+        }
+        if (entries[i].attribute == 0) {
+            get_fullname(fullname, &entries[i]);
+            snprintf(child, PATHLENGTH, "%s%s%s", path, strcmp(path, ROOT) ? DELIM : "", fullname);
+            walk_push(w, entries[i].first, child);
+            continue;
+        }
+        local.files++;
+        local.bytes += entries[i].length;
+        if (!(entries[i].reserve[0] & FCB_INLINE)) {
+            local.blocks += chain_blocks(entries[i].first);
+        }
+    }
+    free(entries);
+
+    /**< Merge once per directory, not once per entry. */
+    pthread_mutex_lock(&ctx->lock);
+    ctx->total.dirs += local.dirs;
+    ctx->total.files += local.files;
+    ctx->total.bytes += local.bytes;
+    ctx->total.blocks += local.blocks;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Size a file or a whole folder.
+ * @param entry Directory entry of the file or folder.
+ * @param path Absolute path.
+ * @param nthreads Thread count, 0 for the default.
+ * @param total Output.
+ * @return Directories stolen between walker threads.
+ */
+int do_du(fcb *entry, const char *path, int nthreads, du_count *total) {
+    du_ctx ctx;
+    int steals = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (entry->attribute == 0) {
+        pthread_mutex_init(&ctx.lock, NULL);
+        steals = walk_tree(entry->first, path, du_visit, &ctx, nthreads);
+        pthread_mutex_destroy(&ctx.lock);
+    } else {
+        ctx.total.files = 1;
+        ctx.total.bytes = entry->length;
+        ctx.total.blocks = entry->reserve[0] & FCB_INLINE ? 0 : chain_blocks(entry->first);
+    }
+    *total = ctx.total;
+    return steals;
+}
+
+/**
+ * Print the size of one file or folder.
+ * @param relpath Path of the file or folder.
+ * @param nthreads Thread count, 0 for the default.
+ */
+static void du_show(const char *relpath, int nthreads) {
+    char path[PATHLENGTH];
+    du_count total;
+    fcb *entry;
+
+    get_abspath(path, relpath);
+    if ((entry = find_fcb(path)) == NULL) {
+        fprintf(stderr, "du: %s: No such file or folder\n", relpath);
+        return;
+    }
+    do_du(entry, path, nthreads, &total);
+    printf("%lu bytes\t%d blocks\t%d dirs\t%d files\t%s\n",
+           total.bytes, total.blocks, total.dirs, total.files, path);
+}
+
+/**
+ * Show the size of files and folders.
+ * @param args 'path' one or more to size, the current folder if none, '-j n' to use n threads.
+ * @return Always 1.
+ */
+int my_du(char **args) {
+    int i, nthreads = 0, shown = 0;
+
+    for (i = 1; args[i] != NULL; i++) {
+        if (!strcmp(args[i], "-j") && args[i + 1] != NULL) {
+            nthreads = atoi(args[++i]);
+        }
+    }
+    for (i = 1; args[i] != NULL; i++) {
+        if (!strcmp(args[i], "-j")) {
+            i++;
+            continue;
+        }
+        du_show(args[i], nthreads);
+        shown++;
+    }
+    if (shown == 0) {
+        du_show(current_dir, nthreads);
+    }
+    return 1;
+}
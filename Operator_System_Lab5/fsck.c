@@ -0,0 +1,369 @@
+/**
+ * @file    fsck.c
+ * @brief   Consistency checker of the FAT16 file system.
+ * @details Walk the directory tree from the root, validate every FAT chain and build
+ *          a reachability bitmap. Anything allocated in FAT but unreachable is an orphan.
+ */
+
+#include "simplefs.h"
+
+static const char *fsck_msg[] = {
+        "broken chain",
+        "cycle in chain",
+        "cross-linked block",
+        "invalid first block",
+        "orphan block",
+        "FAT1 differs from FAT0",
+        "directory index out of date"
+};
+
+/**
+ * Record a problem.
+ * @param ctx Checker state.
+ * @param type FSCK_* problem type.
+ * @param block Block to fix, the last good block of a chain or the orphan itself.
+ * @param entry Directory entry owning the chain, NULL if none.
+ * @param path Path of the owner.
+ */
+static void fsck_report(fsck_ctx *ctx, int type, int block, fcb *entry, const char *path) {
+    fsck_issue *issue;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->count == ctx->capacity) {
+        ctx->capacity = ctx->capacity ? ctx->capacity * 2 : 32;
+        ctx->issues = (fsck_issue *) realloc(ctx->issues, ctx->capacity * sizeof(fsck_issue));
+        if (ctx->issues == NULL) {
+            fprintf(stderr, "fsck: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    issue = &ctx->issues[ctx->count++];
+    issue->type = type;
+    issue->block = block;
+    issue->entry = entry;
+    strncpy(issue->path, path, PATHLENGTH - 1);
+    issue->path[PATHLENGTH - 1] = '\0';
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/**
+ * Follow a FAT chain and claim its blocks in the reachability bitmap.
+ * @param ctx Checker state.
+ * @param first First block of the chain.
+ * @param entry Directory entry owning the chain, NULL for snapshot chains.
+ * @param path Path of the owner.
+ * @param blocks Optional output of the claimed blocks in chain order.
+ * @param owned 1 if the first block was already claimed by the caller.
+ * @return Count of blocks claimed.
+ */
+static int fsck_chain(fsck_ctx *ctx, int first, fcb *entry, const char *path, int *blocks, int owned) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char seen[BLOCK_NUM / 8];
+    unsigned char old, bit;
+    int prev = -1, cur = first, count = 0;
+
+    memset(seen, 0, sizeof(seen));
+    while (1) {
+        if (cur < ctx->low || cur >= BLOCK_NUM) {
+            fsck_report(ctx, prev < 0 ? FSCK_BADFIRST : FSCK_BROKEN, prev, entry, path);
+            break;
+        }
+        bit = (unsigned char) (1 << (cur & 7));
+        if (seen[cur >> 3] & bit) {
+            fsck_report(ctx, FSCK_CYCLE, prev, entry, path);
+            break;
+        }
+        seen[cur >> 3] |= bit;
+
+        old = (owned && prev < 0) ? 0 : __atomic_fetch_or(&ctx->map[cur >> 3], bit, __ATOMIC_RELAXED);
+        if ((old & bit) && block_shared(cur) && entry != NULL && entry->attribute == 1) {
+            /**< Linked by dedup, the rest of the chain is claimed by its other owner. */
+            break;
+        }
+        if (old & bit) {
+            fsck_report(ctx, FSCK_CROSS, prev, entry, path);
+            break;
+        }
+        if (blocks != NULL) {
+            blocks[count] = cur;
+        }
+        count++;
+
+        if (fat0[cur].id == END) {
+            break;
+        }
+        if (fat0[cur].id == FREE) {
+            fsck_report(ctx, FSCK_BROKEN, cur, entry, path);
+            break;
+        }
+        prev = cur;
+        cur = fat_next(fat0[cur].id);
+    }
+
+    return count;
+}
+
+/**
+ * Check one directory, called by the walker threads.
+ * @param w Walker, its arg is the checker state.
+ * @param first First block of the directory, already claimed by its parent.
+ * @param path Absolute path of the directory.
+ */
+static void fsck_visit(walker *w, int first, const char *path) {
+    fsck_ctx *ctx = (fsck_ctx *) w->arg;
+    int blocks[BLOCK_NUM];
+    int i, j, n, files = 0, dirs = 0;
+    char fullname[NAMELENGTH], child[PATHLENGTH];
+    fcb *dir;
+
+    n = fsck_chain(ctx, first, dir_slot(first, 0), path, blocks, 1);
+    for (i = 0; i < n; i++) {
+        if (!dir_head_ok(blocks[i])) {
+            fsck_report(ctx, FSCK_DIRHEAD, blocks[i], NULL, path);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < dir_slots(); j++) {
+            dir = dir_slot(blocks[i], j);
+            if (dir->free == 0 || (i == 0 && j < 2)) {
+                continue;
+            }
+
+            get_fullname(fullname, dir);
+            snprintf(child, PATHLENGTH, "%s%s%s", path, strcmp(path, ROOT) ? DELIM : "", fullname);
+            if (dir->attribute == 0) {
+                dirs++;
+                if (dir->first < ctx->low || dir->first >= BLOCK_NUM) {
+                    fsck_report(ctx, FSCK_BADFIRST, -1, dir, child);
+                } else if (__atomic_fetch_or(&ctx->map[dir->first >> 3], 1 << (dir->first & 7),
+                                             __ATOMIC_RELAXED) & (1 << (dir->first & 7))) {
+                    /**< Points into a chain already seen, also catches directory loops. */
+                    fsck_report(ctx, FSCK_CROSS, -1, dir, child);
+                } else {
+                    walk_push(w, dir->first, child);
+                }
+            } else {
+                files++;
+                if (!(dir->reserve[0] & FCB_INLINE)) {
+                    fsck_chain(ctx, dir->first, dir, child, NULL, 0);
+                }
+            }
+        }
+    }
+
+    __atomic_add_fetch(&ctx->dirs, dirs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->files, files, __ATOMIC_RELAXED);
+}
+
+/**
+ * Apply the fixes collected by a check.
+ * @param ctx Checker state.
+ * @return Count of problems repaired.
+ */
+static int fsck_repair(fsck_ctx *ctx) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    fsck_issue *issue;
+    int i, repaired = 0;
+
+    for (i = 0; i < ctx->count; i++) {
+        issue = &ctx->issues[i];
+        switch (issue->type) {
+            case FSCK_BROKEN:
+            case FSCK_CYCLE:
+            case FSCK_CROSS:
+            case FSCK_BADFIRST:
+                if (issue->block >= 0) {
+                    /**< Cut the chain after the last good block. */
+                    fat0[issue->block].id = END;
+                } else if (issue->entry != NULL) {
+                    /**< Nothing of the chain is usable, drop the entry. */
+                    issue->entry->free = 0;
+                    dir_touch(issue->entry);
+                }
+                break;
+            case FSCK_ORPHAN:
+                fat0[issue->block].id = FREE;
+                break;
+            case FSCK_DIRHEAD:
+                dir_head_sync(issue->block);
+                break;
+            default:
+                break;
+        }
+        repaired++;
+    }
+
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+    dedup_reset();
+    bloom_reset();
+    extent_reset();
+    lsview_reset();
+    return repaired;
+}
+
+/**
+ * Walk everything reachable and record what is wrong, orphans last.
+ * @param ctx Checker state, cleared here.
+ * @param nthreads Thread count, 0 for the default.
+ * @return Blocks in use.
+ */
+static int fsck_scan(fsck_ctx *ctx, int nthreads) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    block0 *init_block = (block0 *) fs_head;
+    snapshot *table = snapshot_table();
+    char path[PATHLENGTH];
+    int i, used = 0;
+
+    memset(ctx->map, 0, sizeof(ctx->map));
+    ctx->dirs = 0;
+    ctx->files = 0;
+    ctx->count = 0;
+    ctx->low = 1 + 2 * (int) ((BLOCK_NUM * sizeof(fat) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    /**< Boot block and both FATs are reserved, the root is claimed before the walk. */
+    for (i = 0; i < ctx->low; i++) {
+        ctx->map[i >> 3] |= 1 << (i & 7);
+    }
+    ctx->map[init_block->root >> 3] |= 1 << (init_block->root & 7);
+
+    if (init_block->refs) {
+        ctx->map[init_block->refs >> 3] |= 1 << (init_block->refs & 7);
+    }
+    for (i = 0; init_block->gens && i < GEN_BLOCKS; i++) {
+        ctx->map[(init_block->gens + i) >> 3] |= 1 << ((init_block->gens + i) & 7);
+    }
+
+    /**< Snapshot tables and the chains snapshots own, not part of a mounted view. */
+    if (table != NULL && !snapshot_mounted()) {
+        ctx->map[init_block->snap >> 3] |= 1 << (init_block->snap & 7);
+        ctx->map[init_block->hold >> 3] |= 1 << (init_block->hold & 7);
+        for (i = 0; i < MAX_SNAPSHOT; i++) {
+            if (table[i].used) {
+                snprintf(path, PATHLENGTH, "snapshot %s", table[i].name);
+                fsck_chain(ctx, table[i].fat, NULL, path, NULL, 0);
+            }
+        }
+    }
+
+    walk_tree(init_block->root, ROOT, fsck_visit, ctx, nthreads);
+
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (ctx->map[i >> 3] & (1 << (i & 7))) {
+            used++;
+        } else if (fat0[i].id != FREE) {
+            fsck_report(ctx, FSCK_ORPHAN, i, NULL, "-");
+        }
+    }
+    /**< A mounted snapshot keeps the live FAT in FAT1. */
+    if (!snapshot_mounted() && memcmp(fat0, fat1, BLOCK_NUM * sizeof(fat)) != 0) {
+        fsck_report(ctx, FSCK_MIRROR, -1, NULL, "-");
+    }
+    return used;
+}
+
+/**
+ * Print the problems recorded by a scan.
+ * @param ctx Checker state.
+ * @param type FSCK_ORPHAN to print only orphans, -1 for everything.
+ * @return Count printed.
+ */
+static int fsck_print(fsck_ctx *ctx, int type) {
+    int i, n = 0;
+
+    for (i = 0; i < ctx->count; i++) {
+        if (type != -1 && ctx->issues[i].type != type) {
+            continue;
+        }
+        if (ctx->issues[i].type == FSCK_ORPHAN) {
+            printf("fsck: %s %d\n", fsck_msg[FSCK_ORPHAN], ctx->issues[i].block);
+        } else if (ctx->issues[i].type == FSCK_MIRROR) {
+            printf("fsck: %s\n", fsck_msg[FSCK_MIRROR]);
+        } else {
+            printf("fsck: %s: %s\n", ctx->issues[i].path, fsck_msg[ctx->issues[i].type]);
+        }
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Check the file system.
+ * @param repair 1 to fix what is found, else only report.
+ * @param nthreads Thread count, 0 for the default.
+ * @return Count of problems found.
+ */
+int do_fsck(int repair, int nthreads) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    fsck_ctx ctx;
+    int i, used, repaired = 0, found;
+
+    memset(&ctx, 0, sizeof(ctx));
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    used = fsck_scan(&ctx, nthreads);
+    found = fsck_print(&ctx, -1);
+    if (repair && found) {
+        repaired = fsck_repair(&ctx);
+
+        /**< Cut tails and the chains of dropped entries only became unreachable now. */
+        used = fsck_scan(&ctx, nthreads);
+        found += fsck_print(&ctx, FSCK_ORPHAN);
+        for (i = 0; i < ctx.count; i++) {
+            if (ctx.issues[i].type == FSCK_ORPHAN) {
+                fat0[ctx.issues[i].block].id = FREE;
+                fat1[ctx.issues[i].block].id = FREE;
+                repaired++;
+            }
+        }
+    }
+    printf("fsck: %d directories, %d files, %d blocks in use, %d problems", ctx.dirs + 1, ctx.files, used, found);
+    if (repair) {
+        printf(" (%d repaired)", repaired);
+    }
+    printf("\n");
+
+    free(ctx.issues);
+    pthread_mutex_destroy(&ctx.lock);
+    return found;
+}
+
+/**
+ * Check file system consistency.
+ * @param args '-r' to repair, '-j n' to use n threads.
+ * @return Always 1.
+ */
+int my_fsck(char **args) {
+    int i, repair = 0, nthreads = 0;
+
+    for (i = 1; args[i] != NULL; i++) {
+        if (!strcmp(args[i], "-r")) {
+            repair = 1;
+        } else if (!strcmp(args[i], "-j") && args[i + 1] != NULL) {
+            nthreads = atoi(args[++i]);
+        } else {
+            fprintf(stderr, "fsck: wrong argument\n");
+            return 1;
+        }
+    }
+
+    /**< Repair rewrites entries and chains, open files would keep stale copies. */
+    if (repair) {
+        if (fs_readonly) {
+            fprintf(stderr, "fsck: Read-only file system\n");
+            return 1;
+        }
+        for (i = 0; i < MAX_OPENFILE; i++) {
+            if (openfile_list[i].free == 1 && openfile_list[i].open_fcb.attribute == 1) {
+                fprintf(stderr, "fsck: cannot repair while files are open\n");
+                return 1;
+            }
+        }
+    }
+
+    do_fsck(repair, nthreads);
+    return 1;
+}
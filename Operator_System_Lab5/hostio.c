@@ -0,0 +1,481 @@
+/**
+ * @file    hostio.c
+ * @brief   Copy directory trees between the host file system and the virtual disk.
+ * @details Host files are read or written by a pool of threads while the disk is only
+ *          changed by the calling thread. Imported files get their blocks carved out of
+ *          large contiguous runs and the image is flushed once at the end.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "simplefs.h"
+
+#define HOST_PATH       512     /**< Longest host path handled. */
+
+/**
+ * @brief A file or directory being copied.
+ */
+typedef struct HOSTENTRY {
+    char host[HOST_PATH];       /**< Path on the host. */
+    char name[NAMELENGTH];      /**< Name on the virtual disk. */
+    int parent;                 /**< Index of the parent directory, -1 for the top. */
+    int is_dir;
+    unsigned long size;
+    unsigned char *data;        /**< Content read from the host. */
+    fcb *file;                  /**< Entry on the virtual disk, export only. */
+    int first;                  /**< First block of an imported directory. */
+    int ok;                     /**< 0 once skipped, children of a skipped directory are skipped too. */
+} host_entry;
+
+/**
+ * @brief Entries shared by the copying threads.
+ */
+typedef struct HOSTJOB {
+    host_entry *entries;
+    int count;
+    int capacity;
+    int next;                   /**< Next entry to take. */
+    int export;                 /**< 1 to write host files, 0 to read them. */
+    int errors;
+} host_job;
+
+/**
+ * Wall clock.
+ * @return Seconds.
+ */
+static double host_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Append an entry.
+ * @param job Entry list.
+ * @return New entry, zeroed.
+ */
+static host_entry *host_add(host_job *job) {
+    if (job->count == job->capacity) {
+        job->capacity = job->capacity ? job->capacity * 2 : 64;
+        job->entries = (host_entry *) realloc(job->entries, job->capacity * sizeof(host_entry));
+        if (job->entries == NULL) {
+            fprintf(stderr, "import: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(&job->entries[job->count], 0, sizeof(host_entry));
+    job->entries[job->count].ok = 1;
+    return &job->entries[job->count++];
+}
+
+/**
+ * Check that a host name fits in an FCB, 7 characters and a 2 character extension.
+ * @param name Host name.
+ * @param is_dir 1 for a directory, which has no extension.
+ * @return 1 if it fits, else 0.
+ */
+static int host_name_ok(const char *name, int is_dir) {
+    const char *dot = strchr(name, '.');
+
+    if (name[0] == '.' || strlen(name) >= NAMELENGTH) {
+        return 0;
+    }
+    if (is_dir) {
+        return dot == NULL && strlen(name) <= 7;
+    }
+    if (dot == NULL) {
+        return strlen(name) <= 7;
+    }
+    return dot - name <= 7 && strchr(dot + 1, '.') == NULL && strlen(dot + 1) <= 2;
+}
+
+/**
+ * Collect a host directory tree, parents before their children.
+ * @param job Entry list.
+ * @param path Host directory.
+ * @param parent Index of its entry, -1 for the top.
+ */
+static void host_scan(host_job *job, const char *path, int parent) {
+    DIR *dp;
+    struct dirent *ent;
+    struct stat st;
+    host_entry *e;
+    char child[HOST_PATH];
+    int is_dir;
+
+    if ((dp = opendir(path)) == NULL) {
+        fprintf(stderr, "import: cannot open %s: %s\n", path, strerror(errno));
+        job->errors++;
+        return;
+    }
+    while ((ent = readdir(dp)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        snprintf(child, HOST_PATH, "%s/%s", path, ent->d_name);
+        if (lstat(child, &st) == -1 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            continue;
+        }
+        is_dir = S_ISDIR(st.st_mode);
+        if (!host_name_ok(ent->d_name, is_dir) || st.st_size > DISK_SIZE) {
+            fprintf(stderr, "import: skip %s: name or size does not fit\n", child);
+            job->errors++;
+            continue;
+        }
+
+        e = host_add(job);
+        strcpy(e->host, child);
+        strcpy(e->name, ent->d_name);
+        e->parent = parent;
+        e->is_dir = is_dir;
+        e->size = (unsigned long) st.st_size;
+        if (is_dir) {
+            host_scan(job, child, job->count - 1);
+        }
+    }
+    closedir(dp);
+}
+
+/**
+ * Thread body, read or write host files until none is left.
+ * Only touches the image through file_load when exporting, which reads it.
+ * @param arg Job shared by all threads.
+ */
+static void *host_worker(void *arg) {
+    host_job *job = (host_job *) arg;
+    host_entry *e;
+    FILE *fp;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+        e = &job->entries[i];
+        if (e->is_dir || !e->ok) {
+            continue;
+        }
+        e->data = (unsigned char *) malloc(e->size ? e->size : 1);
+        if (job->export) {
+            if (e->data == NULL || file_load(e->file, e->data) == -1 ||
+                (fp = fopen(e->host, "wb")) == NULL) {
+                fprintf(stderr, "export: cannot write %s\n", e->host);
+                __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+            } else {
+                fwrite(e->data, 1, e->size, fp);
+                fclose(fp);
+            }
+            free(e->data);
+            e->data = NULL;
+        } else if (e->data == NULL || (fp = fopen(e->host, "rb")) == NULL) {
+            fprintf(stderr, "import: cannot read %s\n", e->host);
+            __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+            e->ok = 0;
+        } else {
+            e->size = fread(e->data, 1, e->size, fp);
+            fclose(fp);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Copy the files of a job with a pool of threads.
+ * @param job Entry list.
+ */
+static void host_run(host_job *job) {
+    pthread_t tid[WALK_MAX_THREADS];
+    int i, started = 0, nthreads = walk_threads();
+
+    job->next = 0;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid[started], NULL, host_worker, job) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        host_worker(job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+}
+
+/**
+ * Take blocks for one file out of the current contiguous run.
+ * A run serves the files of one allocation goal. A new run starts at the goal and is as
+ * large as everything still to place, no larger than the free blocks of the goal's group
+ * when the file fits there, else halved until it fits.
+ * @param n Blocks needed.
+ * @param goal Goal block of the file, see ag_goal.
+ * @param start First block left in the run, updated.
+ * @param left Blocks left in the run, updated.
+ * @param from Goal the run was taken for, updated.
+ * @param want Blocks still to place, this file included.
+ * @param runs Runs allocated, updated.
+ * @return First block of a chain of n blocks, -1 without space.
+ */
+static int host_carve(int n, int goal, int *start, int *left, int *from, int want, int *runs) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    int first, size, room;
+
+    if (*left < n || *from != goal) {
+        /**< The rest of the run is still one chain, give it back. */
+        if (*left > 0) {
+            set_free(*start, 0, 1);
+        }
+        *left = 0;
+        room = ag_free(goal / AG_BLOCKS);
+        size = room >= n && room < want ? room : want;
+        for (; (first = get_free_near(size, goal)) == -1 && size > n; size = size / 2 > n ? size / 2 : n);
+        if (first == -1) {
+            return chain_alloc(n, goal);
+        }
+        set_free(first, size, 0);
+        *start = first;
+        *left = size;
+        *from = goal;
+        (*runs)++;
+    }
+
+    first = *start;
+    fat0[first + n - 1].id = END;
+    fat1[first + n - 1].id = END;
+    *start += n;
+    *left -= n;
+    return first;
+}
+
+/**
+ * Import a host directory tree.
+ * @param args 'hostdir' to copy from, 'path' directory to copy into, created if needed.
+ * @return Always 1.
+ */
+int my_import(char **args) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    host_job job;
+    host_entry *e;
+    char path[PATHLENGTH], parpath[PATHLENGTH], fname[NAMELENGTH], *dot, *end;
+    int i, n, top, parent, first, want = 0, start = 0, left = 0, from = -1, runs = 0, dirs = 0, files = 0, blocks = 0;
+    unsigned long pos, bytes = 0;
+    double begin = host_now();
+    fcb *target, *slot;
+
+    if (args[1] == NULL || args[2] == NULL) {
+        fprintf(stderr, "import: missing operand\n");
+        return 1;
+    }
+
+    /**< Target directory, created when missing. */
+    get_abspath(path, args[2]);
+    if ((target = find_fcb(path)) == NULL) {
+        end = strrchr(path, '/');
+        memset(parpath, '\0', PATHLENGTH);
+        if (end == path) {
+            strcpy(parpath, ROOT);
+        } else {
+            strncpy(parpath, path, end - path);
+        }
+        if (find_fcb(parpath) == NULL || strlen(end + 1) > 7 || do_mkdir(parpath, end + 1) == -1) {
+            fprintf(stderr, "import: cannot create %s\n", args[2]);
+            return 1;
+        }
+        target = find_fcb(path);
+    }
+    if (target->attribute != 0) {
+        fprintf(stderr, "import: %s: Not a directory\n", args[2]);
+        return 1;
+    }
+    top = target->first;
+
+    memset(&job, 0, sizeof(job));
+    host_scan(&job, args[1], -1);
+    host_run(&job);
+
+    /**< Directories first, each one resolved once and kept by index. */
+    for (i = 0; i < job.count; i++) {
+        e = &job.entries[i];
+        if (e->parent != -1 && !job.entries[e->parent].ok) {
+            e->ok = 0;
+            continue;
+        }
+        if (!e->is_dir) {
+            if (e->ok) {
+                want += (init_block->flags & FS_INLINE) && e->size <= (unsigned long) inline_size() ? 0 :
+                        e->size ? (int) ((e->size + BLOCK_SIZE - 1) / BLOCK_SIZE) : 1;
+            }
+            continue;
+        }
+        parent = e->parent == -1 ? top : job.entries[e->parent].first;
+        if ((slot = dir_lookup(parent, e->name)) != NULL) {
+            /**< Merge into an existing directory. */
+            e->first = slot->first;
+            if (slot->attribute != 0) {
+                fprintf(stderr, "import: %s: File exists\n", e->host);
+                job.errors++;
+                e->ok = 0;
+            }
+            continue;
+        }
+        if ((slot = dir_free_slot(parent)) == NULL || (first = get_free_near(1, ag_goal_dir(parent))) == -1) {
+            fprintf(stderr, "import: %s: No more space\n", e->host);
+            e->ok = 0;
+            continue;
+        }
+        set_free(first, 1, 0);
+        set_fcb(slot, e->name, "di", 0, first, BLOCK_SIZE, 1);
+        init_folder(parent, first);
+        e->first = first;
+        dirs++;
+    }
+
+    /**< Then files, their blocks carved out of contiguous runs. */
+    for (i = 0; i < job.count; i++) {
+        e = &job.entries[i];
+        if (e->is_dir || !e->ok) {
+            continue;
+        }
+        parent = e->parent == -1 ? top : job.entries[e->parent].first;
+        memset(fname, '\0', NAMELENGTH);
+        strcpy(fname, e->name);
+        if ((dot = strchr(fname, '.')) != NULL) {
+            *dot++ = '\0';
+        }
+        snprintf(path, PATHLENGTH, "%s.%s", fname, dot != NULL && *dot ? dot : "d");
+
+        n = (init_block->flags & FS_INLINE) && e->size <= (unsigned long) inline_size() ? 0 :
+            e->size ? (int) ((e->size + BLOCK_SIZE - 1) / BLOCK_SIZE) : 1;
+        want -= n;
+        if (dir_lookup(parent, path) != NULL) {
+            fprintf(stderr, "import: %s: File exists\n", e->host);
+            job.errors++;
+            continue;
+        }
+        if ((slot = dir_free_slot(parent)) == NULL ||
+            (n > 0 && (first = host_carve(n, ag_goal(parent, n), &start, &left, &from, want + n, &runs)) == -1)) {
+            fprintf(stderr, "import: %s: No more space\n", e->host);
+            job.errors++;
+            continue;
+        }
+
+        if (n == 0) {
+            set_fcb(slot, fname, dot != NULL && *dot ? dot : "d", 1, 0, e->size, 1);
+            slot->reserve[0] |= FCB_INLINE;
+            memset(inline_data_of(slot), 0, inline_size());
+            memcpy(inline_data_of(slot), e->data, e->size);
+        } else {
+            set_fcb(slot, fname, dot != NULL && *dot ? dot : "d", 1, first, e->size, 1);
+            for (pos = 0; first != END; pos += BLOCK_SIZE, first = fat_next(fat0[first].id)) {
+                memset(fs_head + BLOCK_SIZE * first, 0, BLOCK_SIZE);
+                if (pos < e->size) {
+                    memcpy(fs_head + BLOCK_SIZE * first, e->data + pos,
+                           e->size - pos < BLOCK_SIZE ? e->size - pos : BLOCK_SIZE);
+                }
+            }
+            blocks += n;
+        }
+        files++;
+        bytes += e->size;
+    }
+    if (left > 0) {
+        set_free(start, 0, 1);
+    }
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+
+    for (i = 0; i < job.count; i++) {
+        free(job.entries[i].data);
+    }
+    free(job.entries);
+
+    flush_sys();
+    printf("import: %d directories, %d files, %lu bytes, %d blocks in %d runs, %d errors, %.2f ms\n",
+           dirs, files, bytes, blocks, runs, job.errors, (host_now() - begin) * 1000);
+    return 1;
+}
+
+/**
+ * Collect a directory tree of the virtual disk and create it on the host.
+ * @param job Entry list.
+ * @param first First block of the directory.
+ * @param host Host directory, created if needed.
+ */
+static void host_collect(host_job *job, int first, const char *host) {
+    int i = -1, block = first;
+    char fullname[NAMELENGTH], child[HOST_PATH];
+    host_entry *e;
+    fcb *dir;
+
+    if (mkdir(host, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "export: cannot create %s: %s\n", host, strerror(errno));
+        job->errors++;
+        return;
+    }
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 0 || (block == first && i < 2)) {
+            continue;
+        }
+        get_fullname(fullname, dir);
+        snprintf(child, HOST_PATH, "%s/%s", host, fullname);
+        if (dir->attribute == 0) {
+            host_collect(job, dir->first, child);
+            continue;
+        }
+        e = host_add(job);
+        strcpy(e->host, child);
+        strcpy(e->name, fullname);
+        e->size = dir->length;
+        e->file = dir;
+    }
+}
+
+/**
+ * Export a directory tree, or a single file, to the host.
+ * @param args 'path' to copy from, 'hostdir' directory to copy into.
+ * @return Always 1.
+ */
+int my_export(char **args) {
+    host_job job;
+    char child[HOST_PATH], fullname[NAMELENGTH];
+    unsigned long bytes = 0;
+    double begin = host_now();
+    host_entry *e;
+    fcb *src;
+    int i;
+
+    if (args[1] == NULL || args[2] == NULL) {
+        fprintf(stderr, "export: missing operand\n");
+        return 1;
+    }
+    if ((src = find_fcb(args[1])) == NULL) {
+        fprintf(stderr, "export: cannot access %s: No such file or folder\n", args[1]);
+        return 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.export = 1;
+    if (src->attribute == 0) {
+        host_collect(&job, src->first, args[2]);
+    } else if (mkdir(args[2], 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "export: cannot create %s: %s\n", args[2], strerror(errno));
+        return 1;
+    } else {
+        get_fullname(fullname, src);
+        snprintf(child, HOST_PATH, "%s/%s", args[2], fullname);
+        e = host_add(&job);
+        strcpy(e->host, child);
+        strcpy(e->name, fullname);
+        e->size = src->length;
+        e->file = src;
+    }
+    host_run(&job);
+
+    for (i = 0; i < job.count; i++) {
+        bytes += job.entries[i].size;
+    }
+    printf("export: %d files, %lu bytes, %d errors, %.2f ms\n", job.count, bytes, job.errors,
+           (host_now() - begin) * 1000);
+    free(job.entries);
+    return 1;
+}
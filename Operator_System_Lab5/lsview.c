@@ -0,0 +1,163 @@
+/**
+ * @file    lsview.c
+ * @brief   Sorted views of directories for ls.
+ * @details A view is the list of used slots of one directory in sort order. It remembers
+ *          the blocks of the directory, dir_touch calls lsview_forget on every slot change
+ *          (an entry created or removed, a close updating a length or a time) as does a
+ *          directory growing or shrinking, the view of that directory is dropped and sorted
+ *          again on its next use.
+ */
+
+#include "simplefs.h"
+
+/**
+ * @brief A sorted directory.
+ */
+typedef struct LSVIEW {
+    int first;                  /**< First block of the directory, -1 if the slot is empty. */
+    char key;                   /**< Sort key, see ls_view. */
+    unsigned char blocks[BLOCK_NUM / 8];    /**< Chain of the directory when sorted. */
+    fcb **order;                /**< Used slots in sort order. */
+    int count;
+    unsigned long stamp;        /**< Last use, the oldest slot is replaced. */
+} lsview;
+
+static lsview lsview_slot[LSVIEW_SLOTS] = {[0 ... LSVIEW_SLOTS - 1] = {.first = -1}};
+static unsigned long lsview_clock = 0;
+
+/**
+ * Compare two entries by name, then extension.
+ */
+static int ls_cmp_name(const void *a, const void *b) {
+    const fcb *x = *(fcb *const *) a, *y = *(fcb *const *) b;
+    int r = strncmp(x->filename, y->filename, sizeof(x->filename));
+
+    return r ? r : strncmp(x->exname, y->exname, sizeof(x->exname));
+}
+
+/**
+ * Compare two entries by size, largest first.
+ */
+static int ls_cmp_size(const void *a, const void *b) {
+    const fcb *x = *(fcb *const *) a, *y = *(fcb *const *) b;
+
+    if (x->length != y->length) {
+        return x->length < y->length ? 1 : -1;
+    }
+    return ls_cmp_name(a, b);
+}
+
+/**
+ * Compare two entries by modification time, newest first.
+ */
+static int ls_cmp_time(const void *a, const void *b) {
+    const fcb *x = *(fcb *const *) a, *y = *(fcb *const *) b;
+
+    if (x->date != y->date) {
+        return x->date < y->date ? 1 : -1;
+    }
+    if (x->time != y->time) {
+        return x->time < y->time ? 1 : -1;
+    }
+    return ls_cmp_name(a, b);
+}
+
+/**
+ * Drop the view of the directory a block belongs to.
+ * Called for every slot change and every block a directory gains or loses.
+ * @param block Block num.
+ */
+void lsview_forget(int block) {
+    int i;
+
+    for (i = 0; i < LSVIEW_SLOTS; i++) {
+        if (lsview_slot[i].first != -1 && (lsview_slot[i].blocks[block >> 3] & (1 << (block & 7)))) {
+            lsview_slot[i].first = -1;
+        }
+    }
+}
+
+/**
+ * Drop every view, the whole image was replaced.
+ */
+void lsview_reset(void) {
+    int i;
+
+    for (i = 0; i < LSVIEW_SLOTS; i++) {
+        lsview_slot[i].first = -1;
+    }
+}
+
+/**
+ * Rebuild a view from its directory.
+ * @param v View, first and key set.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int lsview_build(lsview *v) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block, i, n = 0;
+    fcb *dir;
+
+    for (block = v->first; block != END && block != FREE && n < BLOCK_NUM; block = fat_next(fat0[block].id)) {
+        n++;
+    }
+    free(v->order);
+    v->count = 0;
+    memset(v->blocks, 0, sizeof(v->blocks));
+    if ((v->order = (fcb **) malloc(n * dir_slots() * sizeof(fcb *))) == NULL) {
+        v->first = -1;
+        return -1;
+    }
+
+    for (block = v->first; n > 0; n--, block = fat_next(fat0[block].id)) {
+        v->blocks[block >> 3] |= 1 << (block & 7);
+        for (i = 0; i < dir_slots(); i++) {
+            dir = dir_slot(block, i);
+            if (dir->free == 1) {
+                v->order[v->count++] = dir;
+            }
+        }
+    }
+
+    if (v->key == 'n') {
+        qsort(v->order, v->count, sizeof(fcb *), ls_cmp_name);
+    } else if (v->key == 's') {
+        qsort(v->order, v->count, sizeof(fcb *), ls_cmp_size);
+    } else if (v->key == 't') {
+        qsort(v->order, v->count, sizeof(fcb *), ls_cmp_time);
+    }
+    return 0;
+}
+
+/**
+ * Get the used slots of a directory in sort order, sorting only when it changed.
+ * @param first First block of the directory.
+ * @param key 'n' by name, 's' by size, 't' by time, 'u' unsorted.
+ * @param count Output, entry count.
+ * @return Slots in the image, valid until the directory changes, NULL on failure.
+ */
+fcb **ls_view(int first, char key, int *count) {
+    lsview *v = NULL;
+    int i;
+
+    for (i = 0; i < LSVIEW_SLOTS; i++) {
+        if (lsview_slot[i].first == first && lsview_slot[i].key == key) {
+            v = &lsview_slot[i];
+            break;
+        }
+        if (v == NULL || lsview_slot[i].stamp < v->stamp) {
+            v = &lsview_slot[i];
+        }
+    }
+
+    v->stamp = ++lsview_clock;
+    if (v->first != first || v->key != key) {
+        v->first = first;
+        v->key = key;
+        if (lsview_build(v) == -1) {
+            return NULL;
+        }
+    }
+    *count = v->count;
+    return v->order;
+}
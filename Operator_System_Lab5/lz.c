@@ -0,0 +1,157 @@
+/**
+ * @file    lz.c
+ * @brief   Small LZ77 codec in the style of LZ4.
+ * @details A stream of sequences, each a token byte (literal count in the high nibble,
+ *          match length minus LZ_MIN_MATCH in the low one, 15 means more bytes follow),
+ *          the literals, then a 2-byte little endian offset back into the output.
+ *          The last sequence has literals only.
+ */
+
+#include "simplefs.h"
+
+#define LZ_HASH_BITS    12
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_OFFSET   65535
+
+/**
+ * Worst case compressed size.
+ * @param n Input length.
+ * @return Output size always big enough.
+ */
+int lz_bound(int n) {
+    return n + n / 255 + 16;
+}
+
+/**
+ * Write a length continuation, 255 means another byte follows.
+ * @param dst Output.
+ * @param len Length above 15.
+ * @return Bytes written.
+ */
+static int lz_put_len(unsigned char *dst, int len) {
+    int n = 0;
+
+    for (; len >= 255; len -= 255) {
+        dst[n++] = 255;
+    }
+    dst[n++] = (unsigned char) len;
+    return n;
+}
+
+/**
+ * Compress a buffer.
+ * @param src Input.
+ * @param n Input length, below LZ_MAX_OFFSET so every position fits the hash table.
+ * @param dst Output.
+ * @param cap Output capacity.
+ * @return Compressed length, -1 if it does not fit in cap.
+ */
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    unsigned short table[1 << LZ_HASH_BITS];
+    unsigned int seq, h;
+    int ip = 0, anchor = 0, op = 0, ref, lit, len;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= n) {
+        memcpy(&seq, src + ip, sizeof(seq));
+        h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        ref = table[h] - 1;
+        table[h] = (unsigned short) (ip + 1);
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + ip, LZ_MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+
+        for (len = LZ_MIN_MATCH; ip + len < n && src[ref + len] == src[ip + len]; len++);
+        lit = ip - anchor;
+        if (op + 1 + lit / 255 + 1 + lit + 2 + (len - LZ_MIN_MATCH) / 255 + 1 > cap) {
+            return -1;
+        }
+        dst[op++] = (unsigned char) (((lit < 15 ? lit : 15) << 4) |
+                                     (len - LZ_MIN_MATCH < 15 ? len - LZ_MIN_MATCH : 15));
+        if (lit >= 15) {
+            op += lz_put_len(dst + op, lit - 15);
+        }
+        memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        dst[op++] = (unsigned char) ((ip - ref) & 0xff);
+        dst[op++] = (unsigned char) ((ip - ref) >> 8);
+        if (len - LZ_MIN_MATCH >= 15) {
+            op += lz_put_len(dst + op, len - LZ_MIN_MATCH - 15);
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    /**< Trailing literals. */
+    lit = n - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > cap) {
+        return -1;
+    }
+    dst[op++] = (unsigned char) ((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) {
+        op += lz_put_len(dst + op, lit - 15);
+    }
+    memcpy(dst + op, src + anchor, lit);
+    return op + lit;
+}
+
+/**
+ * Decompress a buffer.
+ * @param src Compressed input.
+ * @param n Input length.
+ * @param dst Output.
+ * @param cap Output capacity.
+ * @return Decompressed length, -1 if the input is corrupt or does not fit in cap.
+ */
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int ip = 0, op = 0, token, lit, len, offset;
+    unsigned char b;
+
+    while (ip < n) {
+        token = src[ip++];
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= n) {
+                    return -1;
+                }
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (ip + lit > n || op + lit > cap) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip >= n) {
+            break;
+        }
+
+        if (ip + 2 > n) {
+            return -1;
+        }
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip >= n) {
+                    return -1;
+                }
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > op || op + len > cap) {
+            return -1;
+        }
+        /**< Byte by byte, the match may overlap what it produces. */
+        for (; len > 0; len--, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op;
+}
@@ -28,7 +28,27 @@ char *builtin_str[] = {
         "exit",
         "open",
         "close",
-        "pwd"
+        "pwd",
+        "fsck",
+        "defrag",
+        "snapshot",
+        "dedup",
+        "compress",
+        "bench",
+        "import",
+        "export",
+        "find",
+        "du",
+        "cat",
+        "fsync",
+        "batch",
+        "sync",
+        "volume",
+        "send",
+        "receive",
+        "publish",
+        "bulkcat",
+        "bulkwrite"
 };
 
 int (*builtin_func[])(char **) = {
@@ -44,7 +64,64 @@ int (*builtin_func[])(char **) = {
         &my_exit_sys,
         &my_open,
         &my_close,
-        &my_pwd
+        &my_pwd,
+        &my_fsck,
+        &my_defrag,
+        &my_snapshot,
+        &my_dedup,
+        &my_compress,
+        &my_bench,
+        &my_import,
+        &my_export,
+        &my_find,
+        &my_du,
+        &my_cat,
+        &my_fsync,
+        &my_batch,
+        &my_sync,
+        &my_volume,
+        &my_send,
+        &my_receive,
+        &my_publish,
+        &my_bulkcat,
+        &my_bulkwrite
+};
+
+/** 1 if the builtin changes the disk and must be refused on a read-only file system. */
+int builtin_write[] = {
+        1,      /**< format */
+        0,      /**< cd */
+        1,      /**< mkdir */
+        1,      /**< rmdir */
+        0,      /**< ls */
+        1,      /**< create */
+        1,      /**< rm */
+        1,      /**< write */
+        0,      /**< read */
+        0,      /**< exit */
+        0,      /**< open */
+        0,      /**< close */
+        0,      /**< pwd */
+        0,      /**< fsck */
+        1,      /**< defrag */
+        0,      /**< snapshot */
+        1,      /**< dedup */
+        1,      /**< compress */
+        0,      /**< bench */
+        1,      /**< import */
+        0,      /**< export */
+        0,      /**< find */
+        0,      /**< du */
+        0,      /**< cat */
+        1,      /**< fsync */
+        1,      /**< batch */
+        0,      /**< sync */
+        1,      /**< volume */
+        1,      /**< send */
+        1,      /**< receive */
+        1,      /**< publish */
+        0,      /**< bulkcat */
+        1       /**< bulkwrite */
 };
 
 int csh_num_builtins(void) {
@@ -87,7 +164,7 @@ int csh_launch(char **args)
  */
 int csh_execute(char **args)
 {
-    int i;
+    int i, status;
     if (args[0] == NULL) {
         // An empty command was entered
         return 1;
@@ -95,7 +172,26 @@ int csh_execute(char **args)
 
     for (i = 0; i < csh_num_builtins(); i++) {
         if (strcmp(args[0], builtin_str[i]) == 0) {
-            return (*builtin_func[i])(args);
+            if (fs_readonly && builtin_write[i]) {
+                fprintf(stderr, "%s: Read-only file system\n", args[0]);
+                return 1;
+            }
+            /**< Background jobs only touch the disk between commands. */
+            pthread_mutex_lock(&fs_lock);
+            /**< A shared reader moves to the newest published image between commands. */
+            if (fs_shared) {
+                pub_refresh();
+            }
+            /**< Anything but another write looks at the image, buffered writes go there first. */
+            if (builtin_func[i] != &my_write) {
+                wb_flush_all();
+            }
+            stamp_begin();
+            status = (*builtin_func[i])(args);
+            stamp_end();
+            sync_request();
+            pthread_mutex_unlock(&fs_lock);
+            return status;
         }
     }
 
@@ -104,14 +200,16 @@ int csh_execute(char **args)
 
 /*
  * @brief Read a line of input from stdin.
- * @return The line from stdin.
+ * @param line Buffer kept between calls, grown by getline when a line does not fit.
+ * @param bufsize Size of the buffer.
+ * @return The line from stdin, NULL at the end of input.
  */
-char *csh_read_line(void)
+char *csh_read_line(char **line, size_t *bufsize)
 {
-    char *line = NULL;
-    ssize_t bufsize = 0;
-    getline(&line, &bufsize, stdin);
-    return line;
+    if (getline(line, bufsize, stdin) == -1) {
+        return NULL;
+    }
+    return *line;
 }
 
 #define CSH_TOK_BUFSIZE 64
@@ -119,37 +217,40 @@ char *csh_read_line(void)
 /*
  * @brief Split a line into tokens.
  * @param line The line.
+ * @param tokens Buffer kept between calls, grown when a line has more tokens than it holds.
+ * @param bufsize Entries of the buffer.
  * @return Null-terminated array of tokens.
  */
-char **csh_split_line(char *line)
+char **csh_split_line(char *line, char ***tokens, int *bufsize)
 {
-    int bufsize = CSH_TOK_BUFSIZE, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
+    int position = 0;
     char *token;
 
-    if (!tokens) {
-        fprintf(stderr, "csh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-
     token = strtok(line, CSH_TOK_DELIM);
     while (token != NULL) {
-        tokens[position] = token;
-        position++;
-
-        if (position >= bufsize) {
-            bufsize += CSH_TOK_BUFSIZE;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
+        if (position + 1 >= *bufsize) {
+            *bufsize += CSH_TOK_BUFSIZE;
+            *tokens = realloc(*tokens, *bufsize * sizeof(char*));
+            if (!*tokens) {
                 fprintf(stderr, "csh: allocation error\n");
                 exit(EXIT_FAILURE);
             }
         }
+        (*tokens)[position] = token;
+        position++;
 
         token = strtok(NULL, CSH_TOK_DELIM);
     }
-    tokens[position] = NULL;
-    return tokens;
+    if (*tokens == NULL) {
+        *bufsize = CSH_TOK_BUFSIZE;
+        *tokens = malloc(*bufsize * sizeof(char*));
+        if (!*tokens) {
+            fprintf(stderr, "csh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*tokens)[position] = NULL;
+    return *tokens;
 }
 
 /*
@@ -157,30 +258,42 @@ char **csh_split_line(char *line)
  */
 void csh_loop(void)
 {
-    char *line;
-    char **args;
-    int status;
+    char *line = NULL;
+    char **tokens = NULL;
+    char *eof_args[] = {"exit", NULL};
+    size_t bufsize = 0;
+    int tokbufsize = 0;
+    int status = 1;
 
+    /**< The line buffer and the tokens are reused and only grow, a command costs no allocation. */
     do {
         printf("\n\e[1mleslie\e[0m@leslie-PC \e[1m%s\e[0m\n", current_dir);
         printf("> \e[032m$\e[0m ");
-        line = csh_read_line();
-        args = csh_split_line(line);
-        status = csh_execute(args);
-
-        free(line);
-        free(args);
+        if (csh_read_line(&line, &bufsize) == NULL) {
+            /**< End of input, leave as 'exit' does so the image is saved. */
+            csh_execute(eof_args);
+            break;
+        }
+        status = csh_execute(csh_split_line(line, &tokens, &tokbufsize));
     } while (status);
+    free(line);
+    free(tokens);
 }
 
 /*
  * @brief Main entry point.
  * @param argc Argument count.
- * @param argv Argument vector.
+ * @param argv Argument vector, '-r' to mount the image a writer published, shared and read-only.
  * @return status code.
  */
 int main(int argc, char **argv)
 {
+    if (argc > 1 && !strcmp(argv[1], "-r")) {
+        fs_shared = 1;
+    } else if (argc > 1) {
+        fprintf(stderr, "usage: %s [-r]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
     start_sys();
     csh_loop();
 
@@ -0,0 +1,154 @@
+/**
+ * @file    publish.c
+ * @brief   Published images for shared read-only mounts.
+ * @details A writer publishes its committed image as one whole file, written aside and
+ *          renamed over the previous one, so a published image never changes once it is
+ *          visible. Readers started with -r map it shared and read-only instead of loading a
+ *          private copy, all of them use the same pages of the page cache. Before each
+ *          command a reader looks for a newer image and maps it over the old one at the same
+ *          address, so a command always sees exactly one generation.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "simplefs.h"
+
+static dev_t pub_dev;           /**< Image mapped by a reader. */
+static ino_t pub_ino;
+
+/**
+ * Publish an image, readers see either the previous one or all of this one.
+ * @param image Committed image, DISK_SIZE bytes.
+ * @return 0 on success, -1 on error.
+ */
+int pub_write(const unsigned char *image) {
+    FILE *fp;
+    int ret = 0;
+
+    if ((fp = fopen(PUB_PATH ".tmp", "wb")) == NULL) {
+        fprintf(stderr, "publish: cannot write %s\n", PUB_PATH ".tmp");
+        return -1;
+    }
+    if (fwrite(image, 1, DISK_SIZE, fp) != DISK_SIZE) {
+        ret = -1;
+    }
+    if (fclose(fp) != 0 || ret == -1 || rename(PUB_PATH ".tmp", PUB_PATH) == -1) {
+        fprintf(stderr, "publish: cannot write %s\n", PUB_PATH);
+        unlink(PUB_PATH ".tmp");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Map the published image.
+ * @param at Address of the current image to replace, NULL for the first one.
+ * @return Image, NULL if there is no valid published image.
+ */
+static unsigned char *pub_attach(unsigned char *at) {
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(PUB_PATH, O_RDONLY)) == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size != DISK_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    /**< MAP_FIXED swaps the pages in place, pointers into the image stay valid. */
+    p = mmap(at, DISK_SIZE, PROT_READ, MAP_SHARED | (at != NULL ? MAP_FIXED : 0), fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    pub_dev = st.st_dev;
+    pub_ino = st.st_ino;
+    return (unsigned char *) p;
+}
+
+/**
+ * Start a shared reader on the published image.
+ * @return 0 on success, -1 if nothing was published.
+ */
+int pub_map(void) {
+    if ((fs_head = pub_attach(NULL)) == NULL) {
+        fprintf(stderr, "mount: no image published at %s, run publish in the writer first\n", PUB_PATH);
+        return -1;
+    }
+    fs_readonly = 1;
+    return 0;
+}
+
+/**
+ * Move a shared reader to the newest published image.
+ * Called by the shell before each command, with fs_lock held. Waits while files are open,
+ * their entries point into the current image.
+ */
+void pub_refresh(void) {
+    char path[PATHLENGTH];
+    char *args[] = {"cd", path, NULL};
+    struct stat st;
+    int i;
+
+    if (stat(PUB_PATH, &st) == -1 || (st.st_dev == pub_dev && st.st_ino == pub_ino)) {
+        return;
+    }
+    for (i = 1; i < MAX_OPENFILE; i++) {
+        if (openfile_list[i].free == 1 && openfile_list[i].open_fcb.attribute == 1) {
+            return;
+        }
+    }
+    if (pub_attach(fs_head) == NULL) {
+        return;
+    }
+
+    /**< Caches that do not check the image against themselves. */
+    bloom_reset();
+    dedup_reset();
+    extent_reset();
+    lsview_reset();
+    for (i = 0; i < BLOCK_NUM; i++) {
+        zfile_forget(i);
+    }
+
+    /**< Open folders as well, then find the current directory again if it is still there. */
+    strcpy(path, current_dir);
+    for (i = 1; i < MAX_OPENFILE; i++) {
+        do_close(i);
+    }
+    fcb_cpy(&openfile_list[0].open_fcb, dir_slot(((block0 *) fs_head)->root, 0));
+    strcpy(openfile_list[0].dir, ROOT);
+    openfile_list[0].count = 0;
+    openfile_list[0].fcb_state = 0;
+    do_chdir(0);
+    if (strcmp(path, ROOT) && find_fcb(path) != NULL) {
+        my_cd(args);
+    }
+}
+
+/**
+ * Stop a shared reader.
+ */
+void pub_unmap(void) {
+    munmap(fs_head, DISK_SIZE);
+}
+
+/**
+ * Publish the image for shared readers, after every commit from now on.
+ * @param args 'off' to stop publishing.
+ * @return Always 1.
+ */
+int my_publish(char **args) {
+    if (args[1] != NULL && strcmp(args[1], "off")) {
+        fprintf(stderr, "publish: wrong argument %s\n", args[1]);
+        return 1;
+    }
+    if (sync_publish(args[1] == NULL) == 0 && args[1] == NULL) {
+        printf("publish: %s, readers start with -r\n", PUB_PATH);
+    }
+    return 1;
+}
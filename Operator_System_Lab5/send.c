@@ -0,0 +1,362 @@
+/**
+ * @file    send.c
+ * @brief   Incremental replication streams.
+ * @details Once generations are on, every commit that writes blocks is a new generation
+ *          and the generation table records, for each block, the last one that changed it.
+ *          A stream holds the used blocks newer than a base generation, each compressed
+ *          when that makes it smaller. Boot block, FAT and the table itself change with
+ *          every commit, so a stream always carries them and the replica ends up with the
+ *          same table and generation as the sender.
+ */
+
+#include "simplefs.h"
+
+#define SEND_MAGIC      "SFS1"
+
+/**
+ * @brief Start of a stream.
+ */
+typedef struct SENDHEAD {
+    char magic[4];
+    uint32_t block_size;
+    uint32_t block_num;
+    uint32_t from;              /**< Base generation, 0 for a full stream. */
+    uint32_t to;                /**< Generation of the sender once applied. */
+    uint32_t count;             /**< Blocks that follow. */
+} send_head;
+
+/**
+ * @brief Start of one block in a stream, the data follows.
+ */
+typedef struct SENDBLOCK {
+    uint16_t block;
+    uint16_t len;               /**< Stored bytes, BLOCK_SIZE if not compressed. */
+} send_block;
+
+static int gen_hold = 0;        /**< 1 while a received stream is committed as is. */
+
+/**
+ * Get the generation table, one generation per block.
+ * @return Table, NULL until generations are on.
+ */
+uint32_t *gen_table(void) {
+    block0 *init_block = (block0 *) fs_head;
+
+    return init_block->gens ? (uint32_t *) (fs_head + BLOCK_SIZE * init_block->gens) : NULL;
+}
+
+/**
+ * Start a generation for the blocks a commit is about to write.
+ * Called by the commit with fs_lock held.
+ * @param marks Bitmap of the blocks to write, the boot block and the table are added.
+ */
+void gen_commit(unsigned char *marks) {
+    block0 *init_block = (block0 *) fs_head;
+    uint32_t *gens = gen_table();
+    int i;
+
+    if (gens == NULL || gen_hold) {
+        return;
+    }
+    init_block->gen++;
+    marks[0] |= 1;
+    for (i = 0; i < GEN_BLOCKS; i++) {
+        marks[(init_block->gens + i) >> 3] |= 1 << ((init_block->gens + i) & 7);
+    }
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (marks[i >> 3] & (1 << (i & 7))) {
+            gens[i] = init_block->gen;
+        }
+    }
+}
+
+/**
+ * Create the generation table, every used block starting at generation 1.
+ * @return 0 on success, -1 without space.
+ */
+static int gen_enable(void) {
+    block0 *init_block = (block0 *) fs_head;
+    uint32_t *gens;
+    int i, first;
+
+    if ((first = get_free(GEN_BLOCKS)) == -1) {
+        return -1;
+    }
+    set_free(first, GEN_BLOCKS, 0);
+    init_block->gens = first;
+    init_block->gen = 1;
+    gens = gen_table();
+    for (i = 0; i < BLOCK_NUM; i++) {
+        gens[i] = 1;
+    }
+    return 0;
+}
+
+/**
+ * Fold bytes into a running FNV-1a checksum.
+ * @param sum Checksum so far.
+ * @param p Bytes.
+ * @param n Byte count.
+ * @return New checksum.
+ */
+static uint64_t send_sum(uint64_t sum, const void *p, size_t n) {
+    const unsigned char *c = (const unsigned char *) p;
+
+    while (n--) {
+        sum = (sum ^ *c++) * 1099511628211ull;
+    }
+    return sum;
+}
+
+/**
+ * Write the blocks newer than a generation to a host file.
+ * @param since Base generation, 0 for every used block.
+ * @param path Host file.
+ * @return 0 on success, -1 on error.
+ */
+static int do_send(uint32_t since, const char *path) {
+    block0 *init_block = (block0 *) fs_head;
+    unsigned char out[BLOCK_SIZE];
+    uint64_t sum = 14695981039346656037ull;
+    uint32_t *gens;
+    send_head head;
+    send_block blk;
+    unsigned long bytes = 0;
+    const unsigned char *data;
+    int i, n, ret = 0;
+    FILE *fp;
+
+    if (gen_table() == NULL && gen_enable() == -1) {
+        fprintf(stderr, "send: No more space\n");
+        return -1;
+    }
+    /**< Everything changed so far becomes a generation of its own. */
+    if (flush_sys() == -1) {
+        return -1;
+    }
+    gens = gen_table();
+    if (since > init_block->gen) {
+        fprintf(stderr, "send: generation %u is in the future, now at %u\n", since, init_block->gen);
+        return -1;
+    }
+
+    memcpy(head.magic, SEND_MAGIC, 4);
+    head.block_size = BLOCK_SIZE;
+    head.block_num = BLOCK_NUM;
+    head.from = since;
+    head.to = init_block->gen;
+    head.count = 0;
+    for (i = 0; i < BLOCK_NUM; i++) {
+        head.count += block_used(i) && gens[i] > since;
+    }
+
+    if ((fp = fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "send: cannot write %s\n", path);
+        return -1;
+    }
+    fwrite(&head, sizeof(head), 1, fp);
+    sum = send_sum(sum, &head, sizeof(head));
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (!block_used(i) || gens[i] <= since) {
+            continue;
+        }
+        /**< Stored as is when compressing does not make it smaller. */
+        data = fs_head + BLOCK_SIZE * i;
+        if ((n = lz_compress(data, BLOCK_SIZE, out, BLOCK_SIZE - 1)) > 0) {
+            data = out;
+        }
+        blk.block = (uint16_t) i;
+        blk.len = (uint16_t) (n > 0 ? n : BLOCK_SIZE);
+        fwrite(&blk, sizeof(blk), 1, fp);
+        fwrite(data, 1, blk.len, fp);
+        sum = send_sum(send_sum(sum, &blk, sizeof(blk)), data, blk.len);
+        bytes += sizeof(blk) + blk.len;
+    }
+    fwrite(&sum, sizeof(sum), 1, fp);
+    if (ferror(fp)) {
+        ret = -1;
+    }
+    if (fclose(fp) != 0 || ret == -1) {
+        fprintf(stderr, "send: cannot write %s\n", path);
+        ret = -1;
+    }
+    if (ret == 0) {
+        printf("send: generation %u to %u, %u blocks, %lu bytes\n", since, head.to, head.count,
+               bytes + sizeof(head) + sizeof(sum));
+    }
+    return ret;
+}
+
+/**
+ * Read a whole stream and check it before anything is applied.
+ * @param path Host file.
+ * @param size Output, byte count.
+ * @return Stream, NULL on error.
+ */
+static unsigned char *receive_load(const char *path, long *size) {
+    unsigned char *buf;
+    uint64_t sum;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "receive: cannot read %s\n", path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+    if (*size < (long) (sizeof(send_head) + sizeof(sum)) || (buf = (unsigned char *) malloc(*size)) == NULL) {
+        fprintf(stderr, "receive: %s is not a stream\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(buf, 1, *size, fp) != (size_t) *size) {
+        fprintf(stderr, "receive: cannot read %s\n", path);
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
+    fclose(fp);
+
+    memcpy(&sum, buf + *size - sizeof(sum), sizeof(sum));
+    if (memcmp(buf, SEND_MAGIC, 4) || send_sum(14695981039346656037ull, buf, *size - sizeof(sum)) != sum) {
+        fprintf(stderr, "receive: %s is not a stream or is damaged\n", path);
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * Apply a stream to the image.
+ * @param path Host file written by send.
+ * @return 0 on success, -1 with the image unchanged.
+ */
+static int do_receive(const char *path) {
+    block0 *init_block = (block0 *) fs_head;
+    unsigned char *buf, *p, *end, (*blocks)[BLOCK_SIZE];
+    send_head head;
+    send_block blk;
+    uint32_t i;
+    int ret = -1;
+    long size;
+
+    if ((buf = receive_load(path, &size)) == NULL) {
+        return -1;
+    }
+    memcpy(&head, buf, sizeof(head));
+    if (head.block_size != BLOCK_SIZE || head.block_num != BLOCK_NUM || head.count > BLOCK_NUM) {
+        fprintf(stderr, "receive: %s is for another disk geometry\n", path);
+        free(buf);
+        return -1;
+    }
+    if (head.from != 0 && (gen_table() == NULL || init_block->gen != head.from)) {
+        fprintf(stderr, "receive: stream starts at generation %u, this disk is at %u\n", head.from,
+               gen_table() != NULL ? init_block->gen : 0);
+        free(buf);
+        return -1;
+    }
+
+    /**< Unpack every block aside first, a bad stream must not leave half of it applied. */
+    if ((blocks = (unsigned char (*)[BLOCK_SIZE]) malloc((size_t) head.count * BLOCK_SIZE + 1)) == NULL) {
+        fprintf(stderr, "receive: allocation error\n");
+        free(buf);
+        return -1;
+    }
+    p = buf + sizeof(head);
+    end = buf + size - sizeof(uint64_t);
+    for (i = 0; i < head.count; i++) {
+        if (p + sizeof(blk) > end) {
+            break;
+        }
+        memcpy(&blk, p, sizeof(blk));
+        p += sizeof(blk);
+        if (blk.block >= BLOCK_NUM || blk.len > BLOCK_SIZE || p + blk.len > end) {
+            break;
+        }
+        if (blk.len == BLOCK_SIZE) {
+            memcpy(blocks[i], p, BLOCK_SIZE);
+        } else if (lz_decompress(p, blk.len, blocks[i], BLOCK_SIZE) != BLOCK_SIZE) {
+            break;
+        }
+        p += blk.len;
+    }
+    if (i < head.count || p != end) {
+        fprintf(stderr, "receive: %s is damaged\n", path);
+    } else {
+        for (i = 0, p = buf + sizeof(head); i < head.count; i++) {
+            memcpy(&blk, p, sizeof(blk));
+            p += sizeof(blk) + blk.len;
+            memcpy(fs_head + BLOCK_SIZE * blk.block, blocks[i], BLOCK_SIZE);
+            zfile_forget(blk.block);
+        }
+        dedup_reset();
+        bloom_reset();
+        extent_reset();
+        lsview_reset();
+
+        /**< The replica keeps the generation of the sender. */
+        gen_hold = 1;
+        ret = flush_sys();
+        gen_hold = 0;
+        printf("receive: generation %u to %u, %u blocks\n", head.from, head.to, head.count);
+    }
+
+    free(blocks);
+    free(buf);
+    return ret;
+}
+
+/**
+ * Write a replication stream.
+ * @param args '--since gen' to send only what changed after that generation, 'file' host file.
+ * @return Always 1.
+ */
+int my_send(char **args) {
+    uint32_t since = 0;
+    char *end;
+
+    if (args[1] != NULL && !strcmp(args[1], "--since") && args[2] != NULL) {
+        since = (uint32_t) strtoul(args[2], &end, 10);
+        if (*end != '\0') {
+            fprintf(stderr, "send: wrong generation %s\n", args[2]);
+            return 1;
+        }
+        args += 2;
+    }
+    if (args[1] == NULL) {
+        fprintf(stderr, "send: missing operand\n");
+        return 1;
+    }
+    do_send(since, args[1]);
+    return 1;
+}
+
+/**
+ * Apply a replication stream written by send.
+ * @param args 'file' host file.
+ * @return Always 1.
+ */
+int my_receive(char **args) {
+    int i;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "receive: missing operand\n");
+        return 1;
+    }
+    for (i = 1; i < MAX_OPENFILE; i++) {
+        if (openfile_list[i].free == 1) {
+            fprintf(stderr, "receive: close %s first\n", openfile_list[i].dir);
+            return 1;
+        }
+    }
+    if (do_receive(args[1]) == 0) {
+        /**< The tree may have changed under the current directory. */
+        fcb_cpy(&openfile_list[0].open_fcb, dir_slot(((block0 *) fs_head)->root, 0));
+        strcpy(openfile_list[0].dir, ROOT);
+        openfile_list[0].count = 0;
+        openfile_list[0].fcb_state = 0;
+        do_chdir(0);
+    }
+    return 1;
+}
@@ -8,6 +8,14 @@
 
 #include "simplefs.h"
 
+static unsigned char block_stale[BLOCK_NUM / 8];     /**< Blocks left over from before a format. */
+static int stamp_valid = 0;                         /**< 1 inside a batch, see stamp_begin. */
+static unsigned short stamp_time, stamp_date;
+
+static void stamp_take(unsigned short *ftime, unsigned short *fdate);
+
+static void dir_upgrade(void);
+
 
 /* Definition of functions */
 /**
@@ -15,23 +23,29 @@
  * @author Leslie Van
  */
 int start_sys(void) {
-    fs_head = (unsigned char *) malloc(DISK_SIZE);
-    memset(fs_head, 0, DISK_SIZE);
-    FILE *fp;
     int i;
 
-    if ((fp = fopen(SYS_PATH, "r")) != NULL) {
-        fread(fs_head, DISK_SIZE, 1, fp);
-        fclose(fp);
+    /**< A shared reader maps the published image, nothing is loaded. */
+    if (fs_shared) {
+        if (pub_map() == -1) {
+            exit(EXIT_FAILURE);
+        }
     } else {
-        printf("System is not initialized, now install it and create system file.\n");
-        printf("Please don't leave program.\n");
-        printf("Initialed success!\n");
-        do_format();
+        fs_head = (unsigned char *) malloc(DISK_SIZE);
+        memset(fs_head, 0, DISK_SIZE);
+        if (vol_open() && vol_read(fs_head) == 0) {
+            sync_loaded();
+            dir_upgrade();
+        } else {
+            printf("System is not initialized, now install it and create system file.\n");
+            printf("Please don't leave program.\n");
+            printf("Initialed success!\n");
+            do_format(0);
+        }
     }
 
     /**< Init the first openfile entry. */
-    fcb_cpy(&openfile_list[0].open_fcb, ((fcb *) (fs_head + 5 * BLOCK_SIZE)));
+    fcb_cpy(&openfile_list[0].open_fcb, dir_slot(((block0 *) fs_head)->root, 0));
     strcpy(openfile_list[0].dir, ROOT);
     openfile_list[0].count = 0;
     openfile_list[0].fcb_state = 0;
@@ -39,10 +53,10 @@ int start_sys(void) {
     curdir = 0;
 
     /**< Init the other openfile entry. */
-    fcb *empty = (fcb *) malloc(sizeof(fcb));
-    set_fcb(empty, "\0", "\0", 0, 0, 0, 0);
+    fcb empty;
+    set_fcb(&empty, "\0", "\0", 0, 0, 0, 0);
     for (i = 1; i < MAX_OPENFILE; i++) {
-        fcb_cpy(&openfile_list[i].open_fcb, empty);
+        fcb_cpy(&openfile_list[i].open_fcb, &empty);
         strcpy(openfile_list[i].dir, "\0");
         openfile_list[i].free = 0;
         openfile_list[i].count = 0;
@@ -50,9 +64,9 @@ int start_sys(void) {
     }
 
     /**< Init global variables. */
+    pthread_mutex_init(&fs_lock, NULL);
     strcpy(current_dir, openfile_list[curdir].dir);
     start = ((block0 *) fs_head)->start_block;
-    free(empty);
     return 0;
 }
 
@@ -61,47 +75,49 @@ int start_sys(void) {
  * @author Leslie Van
  */
 int my_format(char **args) {
-    unsigned char *ptr;
-    FILE *fp;
-    int i;
+    int i, zero = 0, flags = 0;
 
     /**< Check argument count. */
     for (i = 0; args[i] != NULL; i++);
-    if (i > 2) {
+    if (i > 3) {
         fprintf(stderr, "format: expected argument to \"format\"\n");
         return 1;
     }
 
     /**< Check argument value. */
-    if (args[1] != NULL) {
-        /**< Fill with 0. */
-        if (!strcmp(args[1], "-x")) {
-            ptr = (unsigned char *) malloc(DISK_SIZE);
-            memset(ptr, 0, DISK_SIZE);
-            fp = fopen(SYS_PATH, "w");
-            fwrite(ptr, DISK_SIZE, 1, fp);
-            free(ptr);
-            fclose(fp);
+    for (i = 1; args[i] != NULL; i++) {
+        if (!strcmp(args[i], "-x")) {
+            zero = 1;
+        } else if (!strcmp(args[i], "-i")) {
+            flags |= FS_INLINE;
         } else {
             fprintf(stderr, "format: expected argument to \"format\"\n");
             return 1;
         }
     }
-    do_format();
+
+    /**< Clear every block now instead of on first allocation. */
+    if (zero) {
+        memset(fs_head, 0, DISK_SIZE);
+    }
+    do_format(flags);
 
     return 1;
 }
 
 /**
  * Fast format file system.
- * Create boot block, file allocation tables and root directory.
+ * Create boot block, file allocation tables and root directory, nothing else is written.
+ * Data blocks are cleared when they are allocated, the system file gets holes for them.
+ * @param flags FS_INLINE to keep small files inside their directory entry.
  * @author Leslie Van
  */
-int do_format(void) {
+int do_format(int flags) {
     unsigned char *ptr = fs_head;
-    int i;
+    int i, j;
     int first, second;
-    FILE *fp;
+
+    memset(fs_head, 0, BLOCK_SIZE * 5);
 
     /**< Init the boot block(block0). */
     block0 *init_block = (block0 *) ptr;
@@ -109,6 +125,16 @@ int do_format(void) {
            "Disk Size = 1MB, Block Size = 1KB, Block0 in 0, FAT0/1 in 1/3, Root Directory in 5");
     init_block->root = 5;
     init_block->start_block = (unsigned char *) (init_block + BLOCK_SIZE * 7);
+    init_block->flags = (unsigned char) (flags | FS_DIR2);
+    init_block->slot = (flags & FS_INLINE) ? INLINE_SLOT_SIZE : sizeof(fcb);
+    init_block->snap = 0;
+    init_block->hold = 0;
+    init_block->refs = 0;
+    init_block->gens = 0;
+    init_block->gen = 0;
+    dedup_reset();
+    bloom_reset();
+    lsview_reset();
     ptr += BLOCK_SIZE;
 
     /**< Init FAT0/1. */
@@ -121,24 +147,29 @@ int do_format(void) {
 
     ptr += BLOCK_SIZE * 4;
 
+    /**< Everything after the FATs is stale until allocated. */
+    memset(block_stale, 0, sizeof(block_stale));
+    for (i = 5; i < BLOCK_NUM; i++) {
+        block_stale[i >> 3] |= 1 << (i & 7);
+    }
+
     /**< 2 blocks to root directory. */
-    fcb *root = (fcb *) ptr;
     first = get_free(ROOT_BLOCK_NUM);
     set_free(first, ROOT_BLOCK_NUM, 0);
-    set_fcb(root, ".", "di", 0, first, BLOCK_SIZE * 2, 1);
-    root++;
-    set_fcb(root, "..", "di", 0, first, BLOCK_SIZE * 2, 1);
-    root++;
-
-    for (i = 2; i < BLOCK_SIZE * 2 / sizeof(fcb); i++, root++) {
-        root->free = 0;
+    for (i = 0; i < ROOT_BLOCK_NUM; i++) {
+        for (j = 0; j < dir_slots(); j++) {
+            dir_slot(first + i, j)->free = 0;
+        }
+    }
+    set_fcb(dir_slot(first, 0), ".", "di", 0, first, BLOCK_SIZE * 2, 1);
+    set_fcb(dir_slot(first, 1), "..", "di", 0, first, BLOCK_SIZE * 2, 1);
+    for (i = 0; i < ROOT_BLOCK_NUM; i++) {
+        dir_head_sync(first + i);
     }
 
     memset(fs_head + BLOCK_SIZE * 7, 'a', 15);
     /**< Write back. */
-    fp = fopen(SYS_PATH, "w");
-    fwrite(fs_head, DISK_SIZE, 1, fp);
-    fclose(fp);
+    return sys_write(1);
 }
 
 /**
@@ -245,6 +276,7 @@ int my_mkdir(char **args) {
             strcpy(dirname, path + 1);
         } else {
             strncpy(parpath, path, end - path);
+            parpath[end - path] = '\0';
             strcpy(dirname, end + 1);
         }
 
@@ -270,24 +302,18 @@ int my_mkdir(char **args) {
  * @return Error with -1, else return 0.
  */
 int do_mkdir(const char *parpath, const char *dirname) {
-    int second = get_free(1);
-    int i, flag = 0, first = find_fcb(parpath)->first;
-    fcb *dir = (fcb *) (fs_head + BLOCK_SIZE * first);
+    int first = find_fcb(parpath)->first, second;
+    fcb *dir = dir_free_slot(first);
 
     /**< Check for free fcb. */
-    for (i = 0; i < BLOCK_SIZE / sizeof(fcb); i++, dir++) {
-        if (dir->free == 0) {
-            flag = 1;
-            break;
-        }
-    }
-    if (!flag) {
+    if (dir == NULL) {
         fprintf(stderr, "mkdir: Cannot create more file in %s\n", parpath);
         return -1;
     }
 
-    /**< Check for free space. */
-    if (second == -1) {
+    /**< Check for free space, after the slot since a full parent grows by a block. */
+    if ((second = get_free_near(1, ag_goal_dir(first))) == -1) {
+        dir_unslot(first, dir);
         fprintf(stderr, "mkdir: No more space\n");
         return -1;
     }
@@ -301,12 +327,18 @@ int do_mkdir(const char *parpath, const char *dirname) {
 
 /**
  * Remove folder one or more once.
- * @param args Folders name you want remove.
+ * @param args '-r' to remove folders with everything in them, folders name you want remove.
  */
 int my_rmdir(char **args) {
-    int i, j;
+    int i, recursive = 0, removed = 0;
+    char path[PATHLENGTH];
     fcb *dir;
 
+    if (args[1] != NULL && !strcmp(args[1], "-r")) {
+        recursive = 1;
+        args++;
+    }
+
     /**< Check argument count. */
     if (args[1] == NULL) {
         fprintf(stderr, "rmdir: missing operand\n");
@@ -317,40 +349,44 @@ int my_rmdir(char **args) {
     for (i = 1; args[i] != NULL; i++) {
         if (!strcmp(args[i], ".") || !strcmp(args[i], "..")) {
             fprintf(stderr, "rmdir: cannot remove %s: '.' or '..' is read only \n", args[i]);
-            return 1;
+            break;
         }
 
-        if (!strcmp(args[i], "/")) {
+        get_abspath(path, args[i]);
+        if (!strcmp(path, ROOT)) {
             fprintf(stderr, "rmdir:  Permission denied\n");
-            return 1;
+            break;
         }
 
-        dir = find_fcb(args[i]);
+        dir = find_fcb(path);
         if (dir == NULL) {
             fprintf(stderr, "rmdir: cannot remove %s: No such folder\n", args[i]);
-            return 1;
+            break;
         }
 
         if (dir->attribute == 1) {
-            fprintf(stderr, "rmdir: cannot remove %s: Is a directory\n", args[i]);
-            return 1;
+            fprintf(stderr, "rmdir: cannot remove %s: Not a directory\n", args[i]);
+            break;
         }
 
-        /**< Check if the folder fcb exist in openfile_list. */
-        for (j = 0; j < MAX_OPENFILE; j++) {
-            if (openfile_list[j].free == 0) {
-                continue;
-            }
+        /**< Nothing below the folder may be open, the current directory included. */
+        if (tree_busy(path)) {
+            fprintf(stderr, "rmdir: cannot remove %s: File is open\n", args[i]);
+            break;
+        }
 
-            if (!strcmp(dir->filename, openfile_list[j].open_fcb.filename) &&
-                dir->first == openfile_list[j].open_fcb.first) {
-                /**< Folder is open. */
-                fprintf(stderr, "rmdir: cannot remove %s: File is open\n", args[i]);
-                return 1;
-            }
+        if (!recursive && !dir_empty(dir->first)) {
+            fprintf(stderr, "rmdir: cannot remove %s: Directory not empty\n", args[i]);
+            break;
         }
 
-        do_rmdir(dir);
+        do_rmtree(dir);
+        removed++;
+    }
+
+    /**< All blocks went back in one batch per folder, write the image once. */
+    if (removed) {
+        flush_sys();
     }
     return 1;
 }
@@ -359,90 +395,218 @@ int my_rmdir(char **args) {
  * Just do remove directory.
  */
 void do_rmdir(fcb *dir) {
-    int first = dir->first;
+    do_rmtree(dir);
+}
 
-    dir->free = 0;
-    dir = (fcb *) (fs_head + BLOCK_SIZE * first);
-    dir->free = 0;
-    dir++;
-    dir->free = 0;
+/**
+ * Check if a directory has no entries but '.' and '..'.
+ * @param first First block of the directory.
+ * @return 1 if empty, else 0.
+ */
+int dir_empty(int first) {
+    int i = -1, block = first;
+    fcb *dir;
 
-    set_free(first, 1, 1);
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 1 && !(block == first && i < 2)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 /**
- * Show all thing in folder.
- * @param args Empty to show current folder. '-l' to show by a long format. 'path' to show a specific folder.
- * @return Always 1.
+ * Check if a path or anything below it is open or the current directory.
+ * @param path Absolute path.
+ * @return 1 if busy, else 0.
  */
-int my_ls(char **args) {
-    int first = openfile_list[curdir].open_fcb.first;
-    int i, mode = 'n';
-    int flag[3];
+int tree_busy(const char *path) {
+    size_t len = strlen(path);
+    const char *dir;
+    int j;
+
+    for (j = -1; j < MAX_OPENFILE; j++) {
+        if (j >= 0 && openfile_list[j].free == 0) {
+            continue;
+        }
+        dir = j < 0 ? current_dir : openfile_list[j].dir;
+        if (!strncmp(dir, path, len) && (dir[len] == '\0' || dir[len] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Collect the chains of a directory and everything below it.
+ * @param first First block of the directory.
+ * @param chains First blocks, grown as needed.
+ * @param count Chain count, updated.
+ * @param capacity Size of chains, updated.
+ */
+static void rmtree_collect(int first, int **chains, int *count, int *capacity) {
+    int i = -1, block = first;
     fcb *dir;
 
-    /**< Check argument count. */
-    for (i = 0; args[i] != NULL; i++) {
-        flag[i] = 0;
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        if ((*chains = (int *) realloc(*chains, *capacity * sizeof(int))) == NULL) {
+            fprintf(stderr, "rm: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
     }
-    if (i > 3) {
-        fprintf(stderr, "ls: expected argument\n");
-        return 1;
+    (*chains)[(*count)++] = first;
+
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 0 || (block == first && i < 2)) {
+            continue;
+        }
+        if (dir->attribute == 0) {
+            rmtree_collect(dir->first, chains, count, capacity);
+        } else if (!(dir->reserve[0] & FCB_INLINE)) {
+            /**< A file chain is collected like a directory without entries. */
+            if (*count == *capacity) {
+                *capacity *= 2;
+                if ((*chains = (int *) realloc(*chains, *capacity * sizeof(int))) == NULL) {
+                    fprintf(stderr, "rm: allocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            (*chains)[(*count)++] = dir->first;
+        }
     }
+}
 
-    flag[0] = 1;
-    for (i = 1; args[i] != NULL; i++) {
-        if (args[i][0] == '-') {
-            flag[i] = 1;
-            if (!strcmp(args[i], "-l")) {
-                mode = 'l';
+/**
+ * Remove a file or a directory with everything below it.
+ * The subtree is walked once, then all its blocks go back to FAT0 in one pass
+ * and FAT1 is mirrored once. Blocks dedup shares only lose a reference.
+ * @param entry Directory entry of the file or directory.
+ */
+void do_rmtree(fcb *entry) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    unsigned char map[BLOCK_NUM / 8];
+    int *chains = NULL, count = 0, capacity = 0;
+    int i, n, block;
+
+    if (entry->attribute == 0) {
+        rmtree_collect(entry->first, &chains, &count, &capacity);
+    } else if (!(entry->reserve[0] & FCB_INLINE)) {
+        chains = (int *) malloc(sizeof(int));
+        chains[count++] = entry->first;
+    }
+
+    memset(map, 0, sizeof(map));
+    for (i = 0; i < count; i++) {
+        for (block = chains[i], n = 0; n < BLOCK_NUM; n++) {
+            if (!block_unref(block)) {
+                map[block >> 3] |= 1 << (block & 7);
+            }
+            if (fat0[block].id == END || fat0[block].id == FREE) {
                 break;
-            } else {
-                fprintf(stderr, "ls: wrong operand\n");
-                return 1;
             }
+            block = fat_next(fat0[block].id);
         }
     }
 
+    entry->free = 0;
+    dir_touch(entry);
+    if (entry->attribute == 0) {
+        dir_slot(entry->first, 0)->free = 0;
+        dir_slot(entry->first, 1)->free = 0;
+    }
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (map[i >> 3] & (1 << (i & 7))) {
+            extent_forget(i);
+            fat0[i].id = FREE;
+        }
+    }
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+    free(chains);
+}
+
+/**
+ * Show all thing in folder.
+ * @param args Empty to show current folder. '-l' to show by a long format. '-S' to sort by size,
+ *             '-t' by time, '-U' not to sort, by name else. '-r' to reverse the order.
+ *             '-o n' to skip n entries, '-n n' to show at most n. 'path' to show a specific folder.
+ * @return Always 1.
+ */
+int my_ls(char **args) {
+    int first = openfile_list[curdir].open_fcb.first;
+    int i, mode = 'n', key = 'n', reverse = 0, offset = 0, limit = -1;
+    const char *path = NULL;
+    fcb *dir;
+
     for (i = 1; args[i] != NULL; i++) {
-        if (flag[i] == 0) {
-            dir = find_fcb(args[i]);
-            if (dir != NULL && dir->attribute == 0) {
-                first = dir->first;
-            } else {
-                fprintf(stderr, "ls: cannot access '%s': No such file or directory\n", args[i]);
-                return 1;
-            }
-            break;
+        if (!strcmp(args[i], "-l")) {
+            mode = 'l';
+        } else if (!strcmp(args[i], "-S")) {
+            key = 's';
+        } else if (!strcmp(args[i], "-t")) {
+            key = 't';
+        } else if (!strcmp(args[i], "-U")) {
+            key = 'u';
+        } else if (!strcmp(args[i], "-r")) {
+            reverse = 1;
+        } else if (!strcmp(args[i], "-o") && args[i + 1] != NULL) {
+            offset = atoi(args[++i]);
+        } else if (!strcmp(args[i], "-n") && args[i + 1] != NULL) {
+            limit = atoi(args[++i]);
+        } else if (args[i][0] == '-') {
+            fprintf(stderr, "ls: wrong operand\n");
+            return 1;
+        } else if (path == NULL) {
+            path = args[i];
+        } else {
+            fprintf(stderr, "ls: expected argument\n");
+            return 1;
+        }
+    }
+
+    if (path != NULL) {
+        dir = find_fcb(path);
+        if (dir != NULL && dir->attribute == 0) {
+            first = dir->first;
+        } else {
+            fprintf(stderr, "ls: cannot access '%s': No such file or directory\n", path);
+            return 1;
         }
     }
 
-    do_ls(first, mode);
+    do_ls(first, mode, key, reverse, offset, limit);
 
     return 1;
 }
 
 /**
  * Just do ls.
+ * Entries come from a cached sorted view of the folder, only the shown page is formatted.
  * @param first First block of folder you want to show.
  * @param mode 'n' to normal format, and 'l' to long format.
+ * @param key 'n' by name, 's' by size, 't' by time, 'u' unsorted.
+ * @param reverse 1 to reverse the order.
+ * @param offset Entries to skip.
+ * @param limit Entries to show at most, -1 for all.
  */
-void do_ls(int first, char mode) {
-    int i, count, length = BLOCK_SIZE;
+void do_ls(int first, char mode, char key, int reverse, int offset, int limit) {
+    int i, n, count, end;
     char fullname[NAMELENGTH], date[16], time[16];
-    fcb *root = (fcb *) (fs_head + BLOCK_SIZE * first);
-    block0 *init_block = (block0 *) fs_head;
-    if (first == init_block->root) {
-        length = ROOT_BLOCK_NUM * BLOCK_SIZE;
-    }
+    fcb **order, *root;
 
-    if (mode == 'n') {
-        for (i = 0, count = 1; i < length / sizeof(fcb); i++, root++) {
-            /**< Check if the fcb is used. */
-            if (root->free == 0) {
-                continue;
-            }
+    if ((order = ls_view(first, key, &count)) == NULL) {
+        fprintf(stderr, "ls: allocation error\n");
+        return;
+    }
+    if (offset < 0) {
+        offset = 0;
+    }
+    end = limit < 0 || offset + limit > count ? count : offset + limit;
 
+    for (i = offset, n = 1; i < end; i++, n++) {
+        root = order[reverse ? count - 1 - i : i];
+        if (mode == 'n') {
             if (root->attribute == 0) {
                 printf("%s", FOLDER_COLOR);
                 printf("%s\t", root->filename);
@@ -451,18 +615,10 @@ void do_ls(int first, char mode) {
                 get_fullname(fullname, root);
                 printf("%s\t", fullname);
             }
-            if (count % 5 == 0) {
+            if (n % 5 == 0) {
                 printf("\n");
             }
-            count++;
-        }
-    } else if (mode == 'l') {
-        for (i = 0, count = 1; i < length / sizeof(fcb); i++, root++) {
-            /**< Check if the fcb is used. */
-            if (root->free == 0) {
-                continue;
-            }
-
+        } else if (mode == 'l') {
             trans_date(date, root->date);
             trans_time(time, root->time);
             get_fullname(fullname, root);
@@ -474,7 +630,6 @@ void do_ls(int first, char mode) {
             } else {
                 printf("%s\n", fullname);
             }
-            count++;
         }
     }
     printf("\n");
@@ -537,28 +692,25 @@ int my_create(char **args) {
 int do_create(const char *parpath, const char *filename) {
     char fullname[NAMELENGTH], fname[16], exname[8];
     char *token;
-    int first = get_free(1);
-    int i, flag = 0;
-    fcb *dir = (fcb *) (fs_head + BLOCK_SIZE * find_fcb(parpath)->first);
+    int first = 0, parent = find_fcb(parpath)->first;
+    int inline_data = ((block0 *) fs_head)->flags & FS_INLINE;
+    fcb *dir = dir_free_slot(parent);
 
     /**< Check for free fcb. */
-    for (i = 0; i < BLOCK_SIZE / sizeof(fcb); i++, dir++) {
-        if (dir->free == 0) {
-            flag = 1;
-            break;
-        }
-    }
-    if (!flag) {
+    if (dir == NULL) {
         fprintf(stderr, "create: Cannot create more file in %s\n", parpath);
         return -1;
     }
 
-    /**< Check for free space. */
-    if (first == -1) {
-        fprintf(stderr, "create: No more space\n");
-        return -1;
+    /**< Check for free space, an inline file needs no block until it outgrows its entry. */
+    if (!inline_data) {
+        if ((first = get_free_near(1, ag_goal(parent, 1))) == -1) {
+            dir_unslot(parent, dir);
+            fprintf(stderr, "create: No more space\n");
+            return -1;
+        }
+        set_free(first, 1, 0);
     }
-    set_free(first, 1, 0);
 
     /**< Split name and initial variables. */
     memset(fullname, '\0', NAMELENGTH);
@@ -576,19 +728,29 @@ int do_create(const char *parpath, const char *filename) {
 
     /**< Set fcb. */
     set_fcb(dir, fname, exname, 1, first, 0, 1);
+    if (inline_data) {
+        dir->reserve[0] |= FCB_INLINE;
+        memset(inline_data_of(dir), 0, inline_size());
+    }
 
     return 0;
 }
 
 /**
  * Remove files.
- * @param args Filename you want to remove.
+ * @param args '-r' to remove folders with everything in them too, filename you want to remove.
  * @return Always return 1.
  */
 int my_rm(char **args) {
-    int i, j;
+    int i, recursive = 0, trees = 0;
+    char path[PATHLENGTH];
     fcb *file;
 
+    if (args[1] != NULL && !strcmp(args[1], "-r")) {
+        recursive = 1;
+        args++;
+    }
+
     /**< Check argument count. */
     if (args[1] == NULL) {
         fprintf(stderr, "rm: missing operand\n");
@@ -600,31 +762,41 @@ int my_rm(char **args) {
         file = find_fcb(args[i]);
         if (file == NULL) {
             fprintf(stderr, "rm: cannot remove %s: No such file\n", args[i]);
-            return 1;
+            break;
         }
 
         if (file->attribute == 0) {
-            fprintf(stderr, "rm: cannot remove %s: Is a directory\n", args[i]);
-            return 1;
-        }
-
-        /**< Check if the file exist in openfile_list. */
-        for (j = 0; j < MAX_OPENFILE; j++) {
-            if (openfile_list[j].free == 0) {
-                continue;
+            if (!recursive) {
+                fprintf(stderr, "rm: cannot remove %s: Is a directory\n", args[i]);
+                break;
             }
-
-            if (!strcmp(file->filename, openfile_list[j].open_fcb.filename) &&
-                file->first == openfile_list[j].open_fcb.first) {
-                /**< Folder is open. */
+            get_abspath(path, args[i]);
+            if (!strcmp(path, ROOT) || !strcmp(args[i], ".") || !strcmp(args[i], "..")) {
+                fprintf(stderr, "rm: cannot remove %s: Permission denied\n", args[i]);
+                break;
+            }
+            if (tree_busy(path)) {
                 fprintf(stderr, "rm: cannot remove %s: File is open\n", args[i]);
-                return 1;
+                break;
             }
+            do_rmtree(file);
+            trees++;
+            continue;
+        }
+
+        /**< Check if the file exist in openfile_list. */
+        if (get_openfile(file) != -1) {
+            fprintf(stderr, "rm: cannot remove %s: File is open\n", args[i]);
+            return 1;
         }
 
         do_rm(file);
     }
 
+    /**< Whole trees went back in one batch each, write the image once. */
+    if (trees) {
+        flush_sys();
+    }
     return 1;
 }
 
@@ -636,7 +808,10 @@ void do_rm(fcb *file) {
     int first = file->first;
 
     file->free = 0;
-    set_free(first, 0, 1);
+    dir_touch(file);
+    if (!(file->reserve[0] & FCB_INLINE)) {
+        set_free(first, 0, 1);
+    }
 }
 
 /**
@@ -645,7 +820,7 @@ void do_rm(fcb *file) {
  * @return Always 1.
  */
 int my_open(char **args) {
-    int i, j;
+    int i;
     fcb *file;
     char path[PATHLENGTH];
 
@@ -682,17 +857,9 @@ int my_open(char **args) {
         }
 
         /**< Check if the file exist in openfile_list. */
-        for (j = 0; j < MAX_OPENFILE; j++) {
-            if (openfile_list[j].free == 0) {
-                continue;
-            }
-
-            if (!strcmp(file->filename, openfile_list[j].open_fcb.filename) &&
-                file->first == openfile_list[j].open_fcb.first) {
-                /**< file is open. */
-                fprintf(stderr, "open: cannot open %s: File or folder is open\n", args[i]);
-                continue;
-            }
+        if (get_openfile(file) != -1) {
+            fprintf(stderr, "open: cannot open %s: File or folder is open\n", args[i]);
+            continue;
         }
 
         do_open(get_abspath(path, args[i]));
@@ -715,6 +882,7 @@ int do_open(char *path) {
     }
     fcb_cpy(&openfile_list[fd].open_fcb, file);
     openfile_list[fd].free = 1;
+    openfile_list[fd].wb_len = 0;
     openfile_list[fd].count = 0;
     memset(openfile_list[fd].dir, '\0', 80);
     strcpy(openfile_list[fd].dir, path);
@@ -742,7 +910,7 @@ int my_close(char **args) {
                 if (i == curdir) {
                     continue;
                 }
-                openfile_list[i].free = 0;
+                do_close(i);
             }
             return 1;
         } else {
@@ -761,16 +929,8 @@ int my_close(char **args) {
         }
 
         /**< Check if the file exist in openfile_list. */
-        for (j = 0; j < MAX_OPENFILE; j++) {
-            if (openfile_list[j].free == 0) {
-                continue;
-            }
-
-            if (!strcmp(file->filename, openfile_list[j].open_fcb.filename) &&
-                file->first == openfile_list[j].open_fcb.first) {
-                /**< File is open. */
-                do_close(j);
-            }
+        if ((j = get_openfile(file)) != -1) {
+            do_close(j);
         }
     }
     return 1;
@@ -781,9 +941,16 @@ int my_close(char **args) {
  * @param fd File descriptor.
  */
 void do_close(int fd) {
-    if (openfile_list[fd].fcb_state == 1) {
-        fcb_cpy(find_fcb(openfile_list[fd].dir), &openfile_list[fd].open_fcb);
+    fcb *file;
+
+    wb_flush(fd);
+    if (openfile_list[fd].free == 1 && openfile_list[fd].fcb_state == 1 &&
+        (file = find_fcb(openfile_list[fd].dir)) != NULL) {
+        dedup_file(&openfile_list[fd].open_fcb);
+        fcb_cpy(file, &openfile_list[fd].open_fcb);
+        sync_close();
     }
+    openfile_list[fd].fcb_state = 0;
     openfile_list[fd].free = 0;
 }
 
@@ -840,8 +1007,7 @@ int my_write(char **args) {
             continue;
         }
 
-        if (!strcmp(file->filename, openfile_list[i].open_fcb.filename) &&
-            file->first == openfile_list[i].open_fcb.first) {
+        if (find_fcb(openfile_list[i].dir) == file) {
             /**< File is open. */
             if (mode == 'c') {
                 printf("Please input location: ");
@@ -860,9 +1026,9 @@ int my_write(char **args) {
             }
 
             if (mode == 'c') {
-                do_write(i, str, j - 1, mode);
+                wb_write(i, str, j - 1, mode);
             } else {
-                do_write(i, str, j + 1, mode);
+                wb_write(i, str, j, mode);
             }
 
             return 1;
@@ -874,151 +1040,367 @@ int my_write(char **args) {
 }
 
 /**
+ * Write file, only the blocks the data lands in are allocated.
+ * Skipped ranges stay holes which read back as zeros.
  * @param fd File descriptor.
- * @param wstyle Write style.
- * @return Bytes write
+ * @param content Data to write.
+ * @param len Length of content.
+ * @param wstyle Write style, 'w' truncate, 'c' at the read/write pointer, 'a' at the end.
+ * @return Bytes write, -1 on error.
  */
 int do_write(int fd, char *content, size_t len, int wstyle) {
-    //fat1表
-
-    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE);
-    fat *fat2 = (fat *) (fs_head + 3*BLOCK_SIZE);
-
-    //定义输入字符串数组，初始化
-    char text[WRITE_SIZE] = {0};
-
-    int write = openfile_list[fd].count;
-    openfile_list[fd].count = 0;
-    do_read(fd, openfile_list[fd].open_fcb.length, text);  //读取
-    openfile_list[fd].count = write;
-
-    int i = openfile_list[fd].open_fcb.first;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    fcb *file = &openfile_list[fd].open_fcb;
+    fcb *entry;
+    unsigned long offset, end;
+    int lblk, block, n, done = 0;
 
-    char input[WRITE_SIZE] = {0};
-    strncpy(input, content, len);
-    //文件处理：截断写、覆盖写、追加写
     if (wstyle == 'w') {
-        memset(text, 0, WRITE_SIZE);
-        memcpy(text, input, len);
-//        strncpy(text, input, len);
-    } else if (wstyle == 'c') {
-        memcpy(text + openfile_list[fd].count, input, len);
-//        strncpy(&text[openfile_list[fd].count], input, len);
+        offset = 0;
     } else if (wstyle == 'a') {
-        memcpy(text + openfile_list[fd].count, input, len);
-//        strncpy(&text[openfile_list[fd].open_fcb.length], input, len);
-    }
-    //写入文件系统
-    int length = strlen(text); //需要写入的长度
-    int num = length / BLOCK_SIZE + 1;
-    int static_num = num;
-
-    while (num) {
-        char buf[BLOCK_SIZE] = {0};
-        memcpy(buf, &text[(static_num - num) * BLOCK_SIZE], BLOCK_SIZE);
-        unsigned char *p = fs_head + i * BLOCK_SIZE;
-        memcpy(p, buf, BLOCK_SIZE);
-        num = num - 1;
-        if (num > 0) // 是否还有下一次循环
-        {
-            fat *fat_cur = fat1 + i;
-
-            if (fat_cur->id == END)  //需要申请索引块
-            {
-                int next = get_free(1);
-                fat_cur->id = next;
-                fat_cur = fat1 + next;
-                fat_cur->id = END;
+        offset = file->length;
+    } else {
+        offset = openfile_list[fd].count;
+    }
+    end = offset + len;
+
+    /**< Compressed file, the chunks are rebuilt. */
+    if (file->reserve[0] & FCB_COMPRESS) {
+        if ((done = zfile_write(file, offset, content, len, wstyle == 'w')) == -1) {
+            fprintf(stderr, "write: No more space\n");
+            return -1;
+        }
+        memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+        entry = find_fcb(openfile_list[fd].dir);
+        entry->first = file->first;
+        memcpy(entry->reserve, file->reserve, sizeof(file->reserve));
+        openfile_list[fd].fcb_state = 1;
+        return done;
+    }
+
+    /**< Inline file, keep it in the directory entry while it fits. */
+    if (file->reserve[0] & FCB_INLINE) {
+        entry = find_fcb(openfile_list[fd].dir);
+        if (wstyle == 'w') {
+            memset(inline_data_of(entry), 0, inline_size());
+            file->length = 0;
+        }
+        if (end <= inline_size()) {
+            memcpy(inline_data_of(entry) + offset, content, len);
+            if (end > file->length) {
+                file->length = end;
+            }
+            openfile_list[fd].fcb_state = 1;
+            return (int) len;
+        }
+
+        /**< Outgrown, spill to a chain of blocks in the group of its directory. */
+        if ((block = get_free_near(1, ag_goal((int) (((unsigned char *) entry - fs_head) / BLOCK_SIZE), 1))) == -1) {
+            fprintf(stderr, "write: No more space\n");
+            return -1;
+        }
+        set_free(block, 1, 0);
+        memset(fs_head + BLOCK_SIZE * block, 0, BLOCK_SIZE);
+        memcpy(fs_head + BLOCK_SIZE * block, inline_data_of(entry), file->length);
+        file->first = block;
+        file->reserve[0] &= ~FCB_INLINE;
+        entry->first = block;
+        entry->reserve[0] &= ~FCB_INLINE;
+    } else if (wstyle == 'w' && block_shared(file->first)) {
+        /**< Truncate a chain dedup shares, start over in a private block. */
+        if ((block = get_free_near(1, file->first)) == -1) {
+            fprintf(stderr, "write: No more space\n");
+            return -1;
+        }
+        set_free(file->first, 0, 1);
+        set_free(block, 1, 0);
+        memset(fs_head + BLOCK_SIZE * block, 0, BLOCK_SIZE);
+        file->first = block;
+        find_fcb(openfile_list[fd].dir)->first = block;
+        file->length = 0;
+    } else if (wstyle == 'w') {
+        /**< Truncate, keep only the first block. */
+        if (fat0[file->first].id != END) {
+            set_free(fat_next(fat0[file->first].id), 0, 1);
+            extent_forget(file->first);
+            fat0[file->first].id = END;
+        }
+        if (block_held(file->first)) {
+            if ((block = file_cow(file, 0, file->first)) == -1) {
+                fprintf(stderr, "write: No more space\n");
+                return -1;
             }
-            i = (fat1 + i)->id;
+            find_fcb(openfile_list[fd].dir)->first = block;
+        }
+        memset(fs_head + BLOCK_SIZE * file->first, 0, BLOCK_SIZE);
+        file->length = 0;
+    } else {
+        /**< Blocks dedup shares are copied before any of them changes. */
+        block = dedup_unshare(file);
+        find_fcb(openfile_list[fd].dir)->first = file->first;
+        if (block == -1) {
+            memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+            fprintf(stderr, "write: No more space\n");
+            return -1;
         }
     }
-    //这时的i是刚写完的最后一个磁盘块，剩下的磁盘块可以free掉
 
-    if (fat1[i].id != END) {
-        int j = fat1[i].id;
-        fat1[i].id = END;
-        i = j;
-        while (fat1[i].id != END) {
-            int m = fat1[i].id;
-            fat1[i].id = FREE;
-            i = m;
+    /**< Write block by block, allocating inside holes and copying blocks kept by a snapshot. */
+    while (offset + done < end) {
+        lblk = (int) ((offset + done) / BLOCK_SIZE);
+        if ((block = file_block(file->first, lblk)) == -1) {
+            block = file_alloc(file->first, lblk);
+        } else if (block_held(block)) {
+            block = file_cow(file, lblk, block);
+            if (block != -1 && lblk == 0) {
+                find_fcb(openfile_list[fd].dir)->first = block;
+            }
+        }
+        if (block == -1) {
+            fprintf(stderr, "write: No more space\n");
+            break;
         }
-        fat1[i].id = FREE;
+        n = BLOCK_SIZE - (int) ((offset + done) % BLOCK_SIZE);
+        if (n > end - offset - done) {
+            n = (int) (end - offset - done);
+        }
+        memcpy(fs_head + BLOCK_SIZE * block + (offset + done) % BLOCK_SIZE, content + done, n);
+        done += n;
     }
 
-    memcpy(fat2, fat1, 2*BLOCK_SIZE);
-    openfile_list[fd].open_fcb.length = length;
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+    if (offset + done > file->length) {
+        file->length = offset + done;
+    }
     openfile_list[fd].fcb_state = 1;
-    return (strlen(input));
+    return done;
+}
 
+/**
+ * Write bytes at wb_offset straight to the image.
+ * @param fd File descriptor.
+ * @param content Data to write.
+ * @param len Length of content.
+ * @return Bytes write, -1 on error.
+ */
+static int wb_put(int fd, char *content, size_t len) {
+    int count = openfile_list[fd].count, done;
 
+    openfile_list[fd].count = (int) openfile_list[fd].wb_offset;
+    done = do_write(fd, content, len, 'c');
+    openfile_list[fd].count = count;
+    return done;
 }
 
 /**
- * Read file.
- * @param args [-s|-a] select|all, 'path' path of file.
- * @return Bytes read.
+ * Write file through its write-back buffer.
+ * Writes continuing the buffered range are only copied, the buffer reaches the image in one
+ * do_write when a write lands elsewhere, the buffer is full, on close, on fsync, or when
+ * all open files together buffer more than WB_BUDGET.
+ * @param fd File descriptor.
+ * @param content Data to write.
+ * @param len Length of content.
+ * @param wstyle Write style, 'w' truncate, 'c' at the read/write pointer, 'a' at the end.
+ * @return Bytes write, -1 on error.
  */
-int my_read(char **args) {
-    int i, flag = 0;
-    int length;
-    int mode = 'a';
-    char path[PATHLENGTH];
-    char str[WRITE_SIZE];
-    fcb *file;
+int wb_write(int fd, char *content, size_t len, int wstyle) {
+    useropen *file = &openfile_list[fd];
+    unsigned long offset;
+    int i, largest;
 
-    /**< Check for arguments count. */
-    for (i = 1; args[i] != NULL; i++) {
-        if (args[i][0] == '-') {
-            if (!strcmp(args[i], "-s")) {
-                mode = 's';
-            } else if (!strcmp(args[i], "-a")) {
-                mode = 'a';
-            } else {
-                fprintf(stderr, "read: wrong argument\n");
-                return 1;
-            }
-        } else {
-            flag += 1 << i;
+    if (wstyle == 'w') {
+        /**< Truncate now, what the buffer held is gone with the old data. */
+        file->wb_len = 0;
+        if (do_write(fd, content, 0, 'w') == -1) {
+            return -1;
         }
-    }
-    if ((flag == 0) || (flag > 4) || i > 3) {
-        fprintf(stderr, "read: wrong argument\n");
-        return 1;
+        offset = 0;
+    } else if (wstyle == 'a') {
+        offset = file->open_fcb.length;
+        if (file->wb_len > 0 && file->wb_offset + file->wb_len > offset) {
+            offset = file->wb_offset + file->wb_len;
+        }
+    } else {
+        offset = file->count;
     }
 
-    /**< Check if it's a file or folder. */
-    strcpy(path, args[flag >> 1]);
-    if ((file = find_fcb(path)) == NULL) {
-        fprintf(stderr, "read: File not exists\n");
-        return 1;
+    if (file->wb_len > 0 && (offset != file->wb_offset + file->wb_len || file->wb_len + len > WB_SIZE) &&
+        wb_flush(fd) == -1) {
+        return -1;
     }
-    if (file->attribute == 0) {
-        fprintf(stderr, "read: cannot access a folder\n");
-        return 1;
+    if (len >= WB_SIZE) {
+        /**< Already big enough, write through. */
+        file->wb_offset = offset;
+        return wb_put(fd, content, len);
     }
 
-    memset(str, '\0', WRITE_SIZE);
-    /**< Check if it's open. */
-    for (i = 0; i < MAX_OPENFILE; i++) {
-        if (openfile_list[i].free == 0) {
-            continue;
-        }
+    if (file->wb_len == 0) {
+        file->wb_offset = offset;
+    }
+    memcpy(file->wbuf + file->wb_len, content, len);
+    file->wb_len += (int) len;
+    file->fcb_state = 1;
 
-        if (!strcmp(file->filename, openfile_list[i].open_fcb.filename) &&
-            file->first == openfile_list[i].open_fcb.first) {
-            /**< File is open. */
-            if (mode == 'a') {
-                openfile_list[i].count = 0;
-                length = UINT16_MAX;
+    /**< Memory pressure, flush the biggest buffers until all fit the budget. */
+    while (1) {
+        for (i = 0, largest = -1, offset = 0; i < MAX_OPENFILE; i++) {
+            if (openfile_list[i].free == 1) {
+                offset += openfile_list[i].wb_len;
+                if (largest == -1 || openfile_list[i].wb_len > openfile_list[largest].wb_len) {
+                    largest = i;
+                }
             }
-            if (mode == 's') {
-                printf("Please input location: ");
-                scanf("%d", &openfile_list[i].count);
-                printf("Please input length: ");
-                scanf("%d", &length);
-                printf("-----------------------\n");
+        }
+        if (offset <= WB_BUDGET || wb_flush(largest) == -1) {
+            break;
+        }
+    }
+    return (int) len;
+}
+
+/**
+ * Move the write-back buffer of an open file to the image.
+ * @param fd File descriptor.
+ * @return 0 on success, -1 on error.
+ */
+int wb_flush(int fd) {
+    useropen *file = &openfile_list[fd];
+    int len = file->wb_len, done;
+
+    if (file->free == 0 || len == 0) {
+        return 0;
+    }
+    file->wb_len = 0;
+    done = wb_put(fd, file->wbuf, len);
+    return done == len ? 0 : -1;
+}
+
+/**
+ * Move the write-back buffers of all open files to the image.
+ */
+void wb_flush_all(void) {
+    int i;
+
+    for (i = 0; i < MAX_OPENFILE; i++) {
+        wb_flush(i);
+    }
+}
+
+/**
+ * Write open files back to the disk.
+ * @param args 'path' one or more open files, all open files if none.
+ * @return Always 1.
+ */
+int my_fsync(char **args) {
+    char path[PATHLENGTH];
+    int i, j, found;
+    fcb *entry;
+
+    for (i = 1; args[i] != NULL; i++) {
+        get_abspath(path, args[i]);
+        for (j = 0, found = 0; j < MAX_OPENFILE; j++) {
+            if (openfile_list[j].free == 1 && !strcmp(openfile_list[j].dir, path)) {
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "fsync: %s: file is not open\n", args[i]);
+            return 1;
+        }
+    }
+
+    for (j = 0; j < MAX_OPENFILE; j++) {
+        if (openfile_list[j].free == 0 || openfile_list[j].open_fcb.attribute == 0) {
+            continue;
+        }
+        if (args[1] != NULL) {
+            for (i = 1; args[i] != NULL; i++) {
+                get_abspath(path, args[i]);
+                if (!strcmp(openfile_list[j].dir, path)) {
+                    break;
+                }
+            }
+            if (args[i] == NULL) {
+                continue;
+            }
+        }
+        if (wb_flush(j) == -1) {
+            fprintf(stderr, "fsync: %s: write error\n", openfile_list[j].dir);
+        }
+        /**< The entry catches up now, dedup still waits for close. */
+        if (openfile_list[j].fcb_state == 1 && (entry = find_fcb(openfile_list[j].dir)) != NULL) {
+            fcb_cpy(entry, &openfile_list[j].open_fcb);
+        }
+    }
+    flush_sys();
+    return 1;
+}
+
+/**
+ * Read file.
+ * @param args [-s|-a] select|all, 'path' path of file.
+ * @return Bytes read.
+ */
+int my_read(char **args) {
+    int i, flag = 0;
+    int length;
+    int mode = 'a';
+    char path[PATHLENGTH];
+    char str[WRITE_SIZE];
+    fcb *file;
+
+    /**< Check for arguments count. */
+    for (i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-') {
+            if (!strcmp(args[i], "-s")) {
+                mode = 's';
+            } else if (!strcmp(args[i], "-a")) {
+                mode = 'a';
+            } else {
+                fprintf(stderr, "read: wrong argument\n");
+                return 1;
+            }
+        } else {
+            flag += 1 << i;
+        }
+    }
+    if ((flag == 0) || (flag > 4) || i > 3) {
+        fprintf(stderr, "read: wrong argument\n");
+        return 1;
+    }
+
+    /**< Check if it's a file or folder. */
+    strcpy(path, args[flag >> 1]);
+    if ((file = find_fcb(path)) == NULL) {
+        fprintf(stderr, "read: File not exists\n");
+        return 1;
+    }
+    if (file->attribute == 0) {
+        fprintf(stderr, "read: cannot access a folder\n");
+        return 1;
+    }
+
+    memset(str, '\0', WRITE_SIZE);
+    /**< Check if it's open. */
+    for (i = 0; i < MAX_OPENFILE; i++) {
+        if (openfile_list[i].free == 0) {
+            continue;
+        }
+
+        if (find_fcb(openfile_list[i].dir) == file) {
+            /**< File is open. */
+            if (mode == 'a') {
+                openfile_list[i].count = 0;
+                length = WRITE_SIZE - 1;
+            }
+            if (mode == 's') {
+                printf("Please input location: ");
+                scanf("%d", &openfile_list[i].count);
+                printf("Please input length: ");
+                scanf("%d", &length);
+                printf("-----------------------\n");
             }
             do_read(i, length, str);
             fputs(str, stdout);
@@ -1031,58 +1413,87 @@ int my_read(char **args) {
 }
 
 /**
+ * Read file from the read/write pointer, holes read as zeros.
  * @param fd File descriptor.
  * @param len Length of text.
- * @param text Read file into text.
- * @return
+ * @param text Read file into text, a buffer of WRITE_SIZE.
+ * @return Bytes read.
  */
 int do_read(int fd, int len, char *text) {
-    memset(text, '\0', BLOCK_SIZE * 20);
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fcb *file = &openfile_list[fd].open_fcb;
+    int count = openfile_list[fd].count;
+    int block, pos, lblk, off, n, location = 0;
+    unsigned short next;
+    extent_map *map = NULL;
+
+    memset(text, '\0', WRITE_SIZE);
 
-    if (len <= 0) //想要读取0个字符
-    {
+    if (len > WRITE_SIZE - 1) {
+        len = WRITE_SIZE - 1;
+    }
+    if (count >= file->length || len <= 0) {
         return 0;
     }
+    if (len > file->length - count) {
+        len = (int) (file->length - count);
+    }
 
-    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE); //FAT1表
-    int location = 0;//text的写入位置
-    int length;
-    int count = openfile_list[fd].count; //读写指针位置
-    //排除了id出现end的情况
-    if ((openfile_list[fd].open_fcb.length - count) >= len) //可以读取的字符多于想要读取的字符
-    {
-        length = len;  //想要读取的字符
-    } else {
-        length = openfile_list[fd].open_fcb.length - count; //只能读取这些字符
-    }
-    while (length) //需要读取的字符串个数
-    {
-        char *buf = (char *) malloc(BLOCK_SIZE); //申请空闲缓冲区
-        int count = openfile_list[fd].count; //读写指针位置
-        int logic_block_num = count / BLOCK_SIZE;//逻辑块号（起始为0）
-        int off = count % BLOCK_SIZE;//块内偏移量
-        int physics_block_num = openfile_list[fd].open_fcb.first;//文件起始物理块号（引导块号为0）
-
-        for (int i = 0; i < logic_block_num; i++)  //物理块号
-        {
-            physics_block_num = (fat1 + physics_block_num)->id; //FAT第一项为0，若为1则physics_block_num-1
-        }
-        unsigned char *p = fs_head + BLOCK_SIZE * physics_block_num; //该物理块起始地址
-        memcpy(buf, p, BLOCK_SIZE);
-
-        if ((off + length) <= BLOCK_SIZE) {
-            memcpy(&text[location], &buf[off], length);
-            openfile_list[fd].count = openfile_list[fd].count + length;
-            location += length;  //下一次写的位置
-            length = length - length;  //lenght = 0 将退出循环
-        } else {
-            memcpy(&text[location], &buf[off], BLOCK_SIZE - off);
-            openfile_list[fd].count += BLOCK_SIZE - off;
-            location += BLOCK_SIZE - off;
-            length = length - BLOCK_SIZE - off; //还剩下的想要读取的字节数
+    /**< Inline file, data is in the directory entry. */
+    if (file->reserve[0] & FCB_INLINE) {
+        memcpy(text, inline_data_of(find_fcb(openfile_list[fd].dir)) + count, len);
+        openfile_list[fd].count += len;
+        return len;
+    }
+
+    /**< Compressed file, served from the chunk cache. */
+    if (file->reserve[0] & FCB_COMPRESS) {
+        if ((location = zfile_read(file, count, len, text)) == -1) {
+            fprintf(stderr, "read: corrupt compressed data\n");
+            return -1;
+        }
+        openfile_list[fd].count += location;
+        return location;
+    }
+
+    /**< Far into a file, blocks are found through its extents. Else walk the chain once,
+     *   block is the allocated block at logical pos. */
+    if ((count + len) / BLOCK_SIZE >= EXTENT_MIN_BLOCKS) {
+        map = extent_get(file->first);
+    }
+    block = file->first;
+    pos = 0;
+    while (location < len) {
+        lblk = (count + location) / BLOCK_SIZE;
+        off = (count + location) % BLOCK_SIZE;
+        n = BLOCK_SIZE - off;
+        if (n > len - location) {
+            n = len - location;
+        }
+
+        if (map != NULL) {
+            block = extent_find(map, lblk);
+            pos = lblk;
+            if (block == -1) {
+                block = END;
+            }
+        }
+        while (block != END && pos < lblk) {
+            next = fat0[block].id;
+            if (next == END || next == FREE) {
+                block = END;
+                break;
+            }
+            pos += 1 + fat_gap(next);
+            block = fat_next(next);
+        }
+        if (block != END && pos == lblk) {
+            memcpy(text + location, fs_head + BLOCK_SIZE * block + off, n);
         }
+        location += n;
     }
 
+    openfile_list[fd].count += location;
     return location;
 }
 
@@ -1092,53 +1503,148 @@ int do_read(int fd, int len, char *text) {
  */
 int my_exit_sys(void) {
     int i;
-    FILE *fp;
 
+    defrag_stop();
+    sync_stop();
     for (i = 0; i < MAX_OPENFILE; i++) {
         do_close(i);
     }
+    snapshot_umount();
 
-    fp = fopen(SYS_PATH, "w");
-    fwrite(fs_head, DISK_SIZE, 1, fp);
-    free(fs_head);
-    fclose(fp);
+    flush_sys();
+    if (fs_shared) {
+        pub_unmap();
+    } else {
+        free(fs_head);
+    }
     return 0;
 }
 
+/**
+ * Write the blocks changed since the last commit back to the system file.
+ * @return 0 on success, -1 on error.
+ */
+int flush_sys(void) {
+    return sync_flush();
+}
+
+/**
+ * Write the used blocks of the virtual disk to the volume.
+ * Free blocks are skipped, in a new or truncated member they stay holes. Blocks a
+ * snapshot holds are not free, see block_used.
+ * @param truncate 1 to drop the old content of the members first.
+ * @return 0 on success, -1 on error.
+ */
+int sys_write(int truncate) {
+    int ret;
+
+    sync_rewrite_begin();
+    ret = vol_write_used(truncate ? VOL_TRUNC : 0);
+    sync_rewrite_end(ret == 0 ? truncate : -1);
+    if (ret == -1) {
+        fprintf(stderr, "csh: cannot write the volume\n");
+    }
+    return ret;
+}
+
 /**
  * Detect free blocks in FAT.
  * @param count Count of needed blocks.
- * @return 0 without enough space, else return the first block number.
+ * @return -1 without enough space, else return the first block number.
  * @author Leslie Van
  */
 int get_free(int count) {
-    unsigned char *ptr = fs_head;
-    fat *fat0 = (fat *) (ptr + BLOCK_SIZE);
-    int i, j, flag = 0;
-    int fat[BLOCK_NUM];
-
-    /** Copy FAT. */
-    for (i = 0; i < BLOCK_NUM; i++, fat0++) {
-        fat[i] = fat0->id;
-    }
+    return get_free_near(count, 0);
+}
 
-    /** Find a continuous space. */
-    for (i = 0; i < BLOCK_NUM - count; i++) {
-        for (j = i; j < i + count; j++) {
-            if (fat[j] > 0) {
-                flag = 1;
-                break;
+/**
+ * Find a run of free blocks, the first one at or after a goal block.
+ * Blocks kept by a snapshot are not free either.
+ * @param count Count of needed blocks.
+ * @param goal Block to start from, the search wraps around to block 0.
+ * @return -1 without enough space, else the first block number.
+ */
+int get_free_near(int count, int goal) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char *hold = hold_table();
+    int i, end, run, pass;
+
+    if (goal < 0 || goal >= BLOCK_NUM) {
+        goal = 0;
+    }
+    /**< From the goal to the end, then the runs starting before it. */
+    for (pass = 0; pass < 2; pass++) {
+        end = pass ? goal + count - 1 : BLOCK_NUM;
+        for (i = pass ? 0 : goal, run = 0; i < end && i < BLOCK_NUM; i++) {
+            if (fat0[i].id != FREE || (hold != NULL && hold[i])) {
+                run = 0;
+            } else if (++run == count) {
+                return i - count + 1;
             }
         }
-        if (flag) {
-            flag = 0;
-            i = j;
-        } else {
-            return i;
+    }
+    return -1;
+}
+
+/**
+ * Count the free blocks of an allocation group.
+ * @param group Group num.
+ * @return Free block count.
+ */
+int ag_free(int group) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char *hold = hold_table();
+    int i, n = 0;
+
+    for (i = group * AG_BLOCKS; i < (group + 1) * AG_BLOCKS; i++) {
+        n += fat0[i].id == FREE && (hold == NULL || !hold[i]);
+    }
+    return n;
+}
+
+/**
+ * Find the allocation group with the most free blocks, the lowest one on a tie.
+ * @return Group num.
+ */
+static int ag_roomiest(void) {
+    int g, n, best = 0, most = -1;
+
+    for (g = 0; g < AG_COUNT; g++) {
+        if ((n = ag_free(g)) > most) {
+            most = n;
+            best = g;
         }
     }
+    return best;
+}
 
-    return -1;
+/**
+ * Where to allocate blocks of a new entry of a directory, in the group of the directory
+ * while it has room, else in the group with the most free blocks.
+ * @param dir A block of the directory.
+ * @param count Blocks wanted.
+ * @return Goal block for get_free_near.
+ */
+int ag_goal(int dir, int count) {
+    int group = dir / AG_BLOCKS;
+
+    if (ag_free(group) < count) {
+        group = ag_roomiest();
+    }
+    return group * AG_BLOCKS;
+}
+
+/**
+ * Where to put a new directory. Top level ones are spread over the groups with the
+ * most free blocks, so each can keep its files together, deeper ones stay with their parent.
+ * @param parent First block of the parent directory.
+ * @return Goal block for get_free_near.
+ */
+int ag_goal_dir(int parent) {
+    if (parent != ((block0 *) fs_head)->root) {
+        return ag_goal(parent, 1);
+    }
+    return ag_roomiest() * AG_BLOCKS;
 }
 
 /**
@@ -1158,27 +1664,41 @@ int set_free(unsigned short first, unsigned short length, int mode) {
     for (i = 0; i < first; i++, fat0++, fat1++);
 
     if (mode == 1) {
-        /**< Reclaim space. */
-        while (fat0->id != END) {
-            offset = fat0->id - (fat0 - flag) / sizeof(fat);
-            fat0->id = FREE;
-            fat1->id = FREE;
+        /**< Reclaim space, blocks other chains share only lose a reference. */
+        while (fat0->id != END && fat0->id != FREE) {
+            offset = fat_next(fat0->id) - (fat0 - flag);
+            extent_forget(fat0 - flag);
+            if (!block_unref(fat0 - flag)) {
+                fat0->id = FREE;
+                fat1->id = FREE;
+            }
             fat0 += offset;
             fat1 += offset;
         }
-        fat0->id = FREE;
-        fat1->id = FREE;
+        extent_forget(fat0 - flag);
+        if (!block_unref(fat0 - flag)) {
+            fat0->id = FREE;
+            fat1->id = FREE;
+        }
     } else if (mode == 2) {
         /**< Format FAT */
+        extent_reset();
         for (i = 0; i < BLOCK_NUM; i++, fat0++, fat1++) {
             fat0->id = FREE;
             fat1->id = FREE;
         }
     } else {
-        /**< Allocate consecutive space. */
-        for (; i < first + length - 1; i++, fat0++, fat1++) {
-            fat0->id = first + 1;
-            fat1->id = first + 1;
+        /**< Allocate consecutive space, clearing what a format left behind. */
+        for (i = first; i < first + length; i++) {
+            extent_forget(i);
+            if (block_stale[i >> 3] & (1 << (i & 7))) {
+                block_stale[i >> 3] &= ~(1 << (i & 7));
+                memset(fs_head + BLOCK_SIZE * i, 0, BLOCK_SIZE);
+            }
+        }
+        for (i = first; i < first + length - 1; i++, fat0++, fat1++) {
+            fat0->id = i + 1;
+            fat1->id = i + 1;
         }
         fat0->id = END;
         fat1->id = END;
@@ -1187,6 +1707,40 @@ int set_free(unsigned short first, unsigned short length, int mode) {
     return 0;
 }
 
+/**
+ * Allocate a chain, in one contiguous run when there is one.
+ * @param count Block count.
+ * @param goal Block to search from, see get_free_near.
+ * @return First block, -1 without enough space.
+ */
+int chain_alloc(int count, int goal) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    int i, first, block, prev = -1;
+
+    if ((first = get_free_near(count, goal)) != -1) {
+        set_free(first, count, 0);
+        return first;
+    }
+    for (i = 0; i < count; i++) {
+        if ((block = get_free_near(1, prev == -1 ? goal : prev + 1)) == -1) {
+            if (prev != -1) {
+                set_free(first, 0, 1);
+            }
+            return -1;
+        }
+        set_free(block, 1, 0);
+        if (prev == -1) {
+            first = block;
+        } else {
+            fat0[prev].id = block;
+            fat1[prev].id = block;
+        }
+        prev = block;
+    }
+    return first;
+}
+
 /**
  * Set fcb attribute.
  * @param f The pointer of fcb.
@@ -1200,26 +1754,56 @@ int set_free(unsigned short first, unsigned short length, int mode) {
  */
 int set_fcb(fcb *f, const char *filename, const char *exname, unsigned char attr, unsigned short first,
             unsigned long length, char ffree) {
-    time_t *now = (time_t *) malloc(sizeof(time_t));
-    struct tm *timeinfo;
-    time(now);
-    timeinfo = localtime(now);
+    if (!stamp_valid) {
+        stamp_take(&f->time, &f->date);
+    } else {
+        f->time = stamp_time;
+        f->date = stamp_date;
+    }
 
     memset(f->filename, 0, 8);
     memset(f->exname, 0, 3);
+    memset(f->reserve, 0, sizeof(f->reserve));
     strncpy(f->filename, filename, 7);
     strncpy(f->exname, exname, 2);
     f->attribute = attr;
-    f->time = get_time(timeinfo);
-    f->date = get_date(timeinfo);
     f->first = first;
     f->length = length;
     f->free = ffree;
 
-    free(now);
+    dir_touch(f);
     return 0;
 }
 
+/**
+ * Read the clock in FCB format.
+ * @param ftime Output, FCB time.
+ * @param fdate Output, FCB date.
+ */
+static void stamp_take(unsigned short *ftime, unsigned short *fdate) {
+    struct tm timeinfo;
+    time_t now = time(NULL);
+
+    localtime_r(&now, &timeinfo);
+    *ftime = get_time(&timeinfo);
+    *fdate = get_date(&timeinfo);
+}
+
+/**
+ * Read the clock once for a batch of operations, set_fcb reuses it until stamp_end.
+ */
+void stamp_begin(void) {
+    stamp_take(&stamp_time, &stamp_date);
+    stamp_valid = 1;
+}
+
+/**
+ * End a batch, set_fcb reads the clock again.
+ */
+void stamp_end(void) {
+    stamp_valid = 0;
+}
+
 /**
  * Translate ISO time to short time.
  * @param timeinfo Current time structure.
@@ -1267,12 +1851,14 @@ fcb *fcb_cpy(fcb *dest, fcb *src) {
     strcpy(dest->filename, src->filename);
     strcpy(dest->exname, src->exname);
     dest->attribute = src->attribute;
+    memcpy(dest->reserve, src->reserve, sizeof(dest->reserve));
     dest->time = src->time;
     dest->date = src->date;
     dest->first = src->first;
     dest->length = src->length;
     dest->free = src->free;
 
+    dir_touch(dest);
     return dest;
 }
 
@@ -1286,7 +1872,7 @@ char *get_abspath(char *abspath, const char *relpath) {
     /**< If relpath is abspath. */
     if (!strcmp(relpath, DELIM) || relpath[0] == '/') {
         strcpy(abspath, relpath);
-        return 0;
+        return abspath;
     }
 
     char str[PATHLENGTH];
@@ -1335,9 +1921,9 @@ fcb *find_fcb(const char *path) {
     get_abspath(abspath, path);
     char *token = strtok(abspath, DELIM);
     if (token == NULL) {
-        return (fcb *) (fs_head + BLOCK_SIZE * 5);
+        return dir_slot(((block0 *) fs_head)->root, 0);
     }
-    return find_fcb_r(token, 5);
+    return find_fcb_r(token, ((block0 *) fs_head)->root);
 }
 
 /**
@@ -1347,29 +1933,16 @@ fcb *find_fcb(const char *path) {
  * @return FCB pointer of token.
  */
 fcb *find_fcb_r(char *token, int first) {
-    int i, length = BLOCK_SIZE;
-    char fullname[NAMELENGTH] = "\0";
-    fcb *root = (fcb *) (BLOCK_SIZE * first + fs_head);
-    fcb *dir;
-    block0 *init_block = (block0 *) fs_head;
-    if (first == init_block->root) {
-        length = ROOT_BLOCK_NUM * BLOCK_SIZE;
-    }
+    fcb *dir = dir_lookup(first, token);
 
-    for (i = 0, dir = root; i < length / sizeof(fcb); i++, dir++) {
-        if (dir->free == 0) {
-            continue;
-        }
-        get_fullname(fullname, dir);
-        if (!strcmp(token, fullname)) {
-            token = strtok(NULL, DELIM);
-            if (token == NULL) {
-                return dir;
-            }
-            return find_fcb_r(token, dir->first);
-        }
+    if (dir == NULL) {
+        return NULL;
     }
-    return NULL;
+    token = strtok(NULL, DELIM);
+    if (token == NULL) {
+        return dir;
+    }
+    return find_fcb_r(token, dir->first);
 }
 
 /**
@@ -1388,6 +1961,24 @@ int get_useropen() {
     return -1;
 }
 
+/**
+ * Get the useropen entry a file or folder is open in.
+ * Entries are matched on their directory slot, inline files all have first block 0.
+ * @param file Directory entry, as find_fcb returns it.
+ * @return Entry index, -1 if it is not open.
+ */
+int get_openfile(fcb *file) {
+    int i;
+
+    for (i = 0; i < MAX_OPENFILE; i++) {
+        if (openfile_list[i].free == 1 && find_fcb(openfile_list[i].dir) == file) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 /**
  * Init a folder.
  * @param first Parent folder block num.
@@ -1395,16 +1986,577 @@ int get_useropen() {
  */
 void init_folder(int first, int second) {
     int i;
-    fcb *par = (fcb *) (fs_head + BLOCK_SIZE * first);
-    fcb *cur = (fcb *) (fs_head + BLOCK_SIZE * second);
+    fcb *par = dir_slot(first, 0);
+
+    /**< The block may have been the first of a removed directory. */
+    bloom_forget(second);
+    for (i = 2; i < dir_slots(); i++) {
+        dir_slot(second, i)->free = 0;
+    }
+    set_fcb(dir_slot(second, 0), ".", "di", 0, second, BLOCK_SIZE, 1);
+    set_fcb(dir_slot(second, 1), "..", "di", 0, first, par->length, 1);
+    dir_head_sync(second);
+}
+
+/**
+ * Bytes per directory slot.
+ * Images formatted before the slot size was recorded use bare fcb slots.
+ * @return Slot size.
+ */
+int dir_slot_size(void) {
+    block0 *init_block = (block0 *) fs_head;
+
+    return init_block->slot ? init_block->slot : sizeof(fcb);
+}
+
+/**
+ * Repack the root of an image formatted before the slot size was recorded.
+ * Such a root is two neighbour blocks of flat fcb slots, the 22nd crossing into the second
+ * block. Its second half moves to the start of the second block, the layout dir_slot reads,
+ * and the slot size is recorded so it is done once.
+ */
+static void dir_upgrade(void) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    unsigned char *root = fs_head + BLOCK_SIZE * init_block->root;
+    unsigned char moved[BLOCK_SIZE];
+    int n = BLOCK_SIZE / sizeof(fcb);
+
+    if (init_block->slot != 0) {
+        return;
+    }
+    if (fat0[init_block->root].id == init_block->root + 1) {
+        memcpy(moved, root + n * sizeof(fcb), n * sizeof(fcb));
+        memset(root + n * sizeof(fcb), 0, BLOCK_SIZE * ROOT_BLOCK_NUM - n * sizeof(fcb));
+        memcpy(root + BLOCK_SIZE, moved, n * sizeof(fcb));
+    }
+    init_block->slot = sizeof(fcb);
+}
+
+/**
+ * Slots in one directory block, a slot never crosses a block.
+ * @return Slot count.
+ */
+int dir_slots(void) {
+    return (BLOCK_SIZE - dir_head_size()) / dir_slot_size();
+}
+
+/**
+ * Get a directory slot.
+ * @param block Directory block num.
+ * @param i Slot index in the block.
+ * @return FCB pointer of the slot.
+ */
+fcb *dir_slot(int block, int i) {
+    return (fcb *) (fs_head + BLOCK_SIZE * block + dir_head_size() + dir_slot_size() * i);
+}
+
+/**
+ * Bytes before the first slot of a directory block.
+ * @return DIR2_HEAD_SIZE on v2 images, else 0.
+ */
+int dir_head_size(void) {
+    return ((block0 *) fs_head)->flags & FS_DIR2 ? DIR2_HEAD_SIZE : 0;
+}
+
+/**
+ * Get the index of a directory block.
+ * @param block Directory block num.
+ * @return Index, NULL on images without one.
+ */
+dir_head *dir_head_of(int block) {
+    return dir_head_size() ? (dir_head *) (fs_head + BLOCK_SIZE * block) : NULL;
+}
+
+/**
+ * Hash a full name for the directory index, FNV-1a folded to 16 bits.
+ * @param name Full name as get_fullname gives it.
+ * @return Hash.
+ */
+unsigned short dir_hash(const char *name) {
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    }
+    return (unsigned short) (h ^ (h >> 16));
+}
+
+/**
+ * Rebuild the index of a directory block from its slots.
+ * @param block Directory block num.
+ */
+void dir_head_sync(int block) {
+    dir_head *head = dir_head_of(block);
+    char fullname[NAMELENGTH];
+    fcb *dir;
+    int i;
+
+    if (head == NULL) {
+        return;
+    }
+    memset(head, 0, DIR2_HEAD_SIZE);
+    head->magic = DIR2_MAGIC;
+    head->version = DIR2_VERSION;
+    for (i = 0; i < dir_slots(); i++) {
+        dir = dir_slot(block, i);
+        if (dir->free == 1) {
+            get_fullname(fullname, dir);
+            head->bitmap |= 1u << i;
+            head->hash[i] = dir_hash(fullname);
+            head->used++;
+        }
+    }
+}
+
+/**
+ * Check the index of a directory block against its slots.
+ * @param block Directory block num.
+ * @return 1 if it matches or the image has no index, else 0.
+ */
+int dir_head_ok(int block) {
+    dir_head *head = dir_head_of(block);
+    char fullname[NAMELENGTH];
+    fcb *dir;
+    int i, used = 0;
+
+    if (head == NULL) {
+        return 1;
+    }
+    if (head->magic != DIR2_MAGIC || head->version != DIR2_VERSION) {
+        return 0;
+    }
+    for (i = 0; i < dir_slots(); i++) {
+        dir = dir_slot(block, i);
+        if ((dir->free == 1) != ((head->bitmap >> i) & 1)) {
+            return 0;
+        }
+        if (dir->free == 1) {
+            get_fullname(fullname, dir);
+            if (head->hash[i] != dir_hash(fullname)) {
+                return 0;
+            }
+            used++;
+        }
+    }
+    return used == head->used;
+}
+
+/**
+ * Update the index after a slot changed its name or its free flag.
+ * Pointers outside the image, such as open file copies, are ignored.
+ * @param slot Changed slot.
+ */
+void dir_touch(fcb *slot) {
+    unsigned char *p = (unsigned char *) slot;
+    char fullname[NAMELENGTH];
+    dir_head *head;
+    int block, i;
+    uint32_t bit;
+
+    if (p < fs_head + BLOCK_SIZE || p >= fs_head + DISK_SIZE) {
+        return;
+    }
+    block = (int) ((p - fs_head) / BLOCK_SIZE);
+    bloom_touch(block, slot);
+    lsview_forget(block);
+    if (!dir_head_size()) {
+        return;
+    }
+    i = (int) ((p - fs_head) % BLOCK_SIZE - DIR2_HEAD_SIZE) / dir_slot_size();
+    head = dir_head_of(block);
+    if (head->magic != DIR2_MAGIC) {
+        dir_head_sync(block);
+        return;
+    }
+
+    bit = 1u << i;
+    if (head->bitmap & bit) {
+        head->used--;
+    }
+    head->bitmap &= ~bit;
+    head->hash[i] = 0;
+    if (slot->free == 1) {
+        get_fullname(fullname, slot);
+        head->bitmap |= bit;
+        head->hash[i] = dir_hash(fullname);
+        head->used++;
+    }
+}
+
+/**
+ * Find an entry by name in one directory.
+ * On v2 images only slots whose hash matches are opened.
+ * @param first First block of the directory.
+ * @param name Full name.
+ * @return Slot, NULL if not found.
+ */
+fcb *dir_lookup(int first, const char *name) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    char fullname[NAMELENGTH];
+    unsigned short h;
+    dir_head *head;
+    uint32_t bits;
+    int i = -1, block = first, n;
+    fcb *dir;
+
+    if (bloom_absent(first, name)) {
+        return NULL;
+    }
+    if (!dir_head_size()) {
+        while ((dir = dir_next(&block, &i)) != NULL) {
+            if (dir->free == 0) {
+                continue;
+            }
+            get_fullname(fullname, dir);
+            if (!strcmp(name, fullname)) {
+                return dir;
+            }
+        }
+        return NULL;
+    }
+
+    h = dir_hash(name);
+    for (n = 0; block != END && block != FREE && n < BLOCK_NUM; block = fat_next(fat0[block].id), n++) {
+        head = dir_head_of(block);
+        for (bits = head->bitmap; bits; bits &= bits - 1) {
+            i = __builtin_ctz(bits);
+            if (head->hash[i] != h) {
+                continue;
+            }
+            dir = dir_slot(block, i);
+            get_fullname(fullname, dir);
+            if (!strcmp(name, fullname)) {
+                return dir;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Step to the next slot of a directory, following its chain of blocks.
+ * Start with block set to the first block of the directory and i set to -1.
+ * @param block Current directory block, updated when the step crosses a block.
+ * @param i Current slot index in the block.
+ * @return Next slot, NULL after the last one.
+ */
+fcb *dir_next(int *block, int *i) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+
+    if (*block == END || *block == FREE) {
+        return NULL;
+    }
+    if (++(*i) == dir_slots()) {
+        *i = 0;
+        *block = fat_next(fat0[*block].id);
+        if (*block == END || *block == FREE) {
+            return NULL;
+        }
+    }
+    return dir_slot(*block, *i);
+}
+
+/**
+ * Find an unused slot in a directory, growing it by a block when full.
+ * @param first First block of the directory.
+ * @return Free slot, NULL without space.
+ */
+fcb *dir_free_slot(int first) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    int i = -1, block = first, last = first;
+    uint32_t used;
+    fcb *dir;
+
+    if (dir_head_size()) {
+        /**< The first clear bit of each index is the free slot. */
+        for (; block != END && block != FREE; block = fat_next(fat0[block].id)) {
+            used = dir_head_of(block)->bitmap | ~((1u << dir_slots()) - 1);
+            if (~used) {
+                return dir_slot(block, __builtin_ctz(~used));
+            }
+            last = block;
+        }
+    }
+    while ((dir = dir_next(&block, &i)) != NULL) {
+        if (dir->free == 0) {
+            return dir;
+        }
+        last = block;
+    }
+
+    /**< Full, grow the directory by one block, right after its last one if free. */
+    if ((block = get_free_near(1, last + 1)) == -1) {
+        return NULL;
+    }
+    set_free(block, 1, 0);
+    fat0[last].id = block;
+    fat1[last].id = block;
+    bloom_adopt(first, block);
+    lsview_forget(last);
+    for (i = 0; i < dir_slots(); i++) {
+        dir_slot(block, i)->free = 0;
+    }
+    dir_head_sync(block);
+    dir_slot(first, 0)->length += BLOCK_SIZE;
+    return dir_slot(block, 0);
+}
+
+/**
+ * Give back a slot from dir_free_slot that stays unused.
+ * If getting it grew the directory, the added block is freed again.
+ * @param first First block of the directory.
+ * @param slot Slot dir_free_slot returned.
+ */
+void dir_unslot(int first, fcb *slot) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    int block = (int) (((unsigned char *) slot - fs_head) / BLOCK_SIZE), prev = first;
+    int i, n;
+
+    if (block == first || fat0[block].id != END) {
+        return;
+    }
+    for (i = 0; i < dir_slots(); i++) {
+        if (dir_slot(block, i)->free == 1) {
+            return;
+        }
+    }
+    for (n = 0; n < BLOCK_NUM && fat_next(fat0[prev].id) != block; n++) {
+        prev = fat_next(fat0[prev].id);
+    }
+    fat0[prev].id = END;
+    fat1[prev].id = END;
+    lsview_forget(block);
+    set_free(block, 0, 1);
+    dir_slot(first, 0)->length -= BLOCK_SIZE;
+}
+
+/**
+ * Bytes of file data a directory slot can hold.
+ * @return Inline capacity, 0 when slots are bare fcbs.
+ */
+int inline_size(void) {
+    return dir_slot_size() - (int) sizeof(fcb);
+}
+
+/**
+ * Get the inline data of a file, stored right after its fcb in the slot.
+ * @param file Directory entry.
+ * @return Inline data.
+ */
+unsigned char *inline_data_of(fcb *file) {
+    return (unsigned char *) (file + 1);
+}
+
+/**
+ * Next block of a FAT entry, without the hole count.
+ * @param id FAT entry value.
+ * @return Next block num, END or FREE.
+ */
+int fat_next(unsigned short id) {
+    if (id == END || id == FREE) {
+        return id;
+    }
+    return id & FAT_NEXT_MASK;
+}
+
+/**
+ * Hole count of a FAT entry.
+ * @param id FAT entry value.
+ * @return Count of unallocated logical blocks between this block and the next one.
+ */
+int fat_gap(unsigned short id) {
+    if (id == END || id == FREE) {
+        return 0;
+    }
+    return id >> FAT_GAP_SHIFT;
+}
+
+/**
+ * Build a FAT entry.
+ * @param next Next block num, END for the last block.
+ * @param gap Hole count before the next block, at most FAT_GAP_MAX.
+ * @return FAT entry value.
+ */
+unsigned short fat_link(int next, int gap) {
+    if (next == END) {
+        return END;
+    }
+    return (unsigned short) (next | (gap << FAT_GAP_SHIFT));
+}
+
+/**
+ * Find the block holding a logical block of a file.
+ * @param first First block of the file.
+ * @param lblk Logical block num.
+ * @return Physical block num, -1 if the logical block is a hole.
+ */
+int file_block(int first, int lblk) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block = first, pos = 0;
+    extent_map *map;
+
+    /**< Far into a file, binary search its extents instead of walking the chain. */
+    if (lblk >= EXTENT_MIN_BLOCKS && (map = extent_get(first)) != NULL) {
+        return extent_find(map, lblk);
+    }
+    while (pos < lblk) {
+        if (fat0[block].id == END || fat0[block].id == FREE) {
+            return -1;
+        }
+        pos += 1 + fat_gap(fat0[block].id);
+        block = fat_next(fat0[block].id);
+    }
+    return pos == lblk ? block : -1;
+}
+
+/**
+ * Allocate a block for a logical block in a hole of a file.
+ * Holes longer than FAT_GAP_MAX are bridged by zero blocks.
+ * Only FAT0 is changed, the caller mirrors it.
+ * @param first First block of the file.
+ * @param lblk Logical block num, must be a hole.
+ * @return New block num, -1 without enough space.
+ */
+int file_alloc(int first, int lblk) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block = first, pos = 0, next, npos, target, fresh;
 
-    set_fcb(cur, ".", "di", 0, second, BLOCK_SIZE, 1);
-    cur++;
-    set_fcb(cur, "..", "di", 0, first, par->length, 1);
-    cur++;
-    for (i = 2; i < BLOCK_SIZE / sizeof(fcb); i++, cur++) {
-        cur->free = 0;
+    /**< Find the allocated block right before the hole. */
+    while (1) {
+        if (fat0[block].id == END) {
+            next = END;
+            npos = INT32_MAX;
+        } else {
+            next = fat_next(fat0[block].id);
+            npos = pos + 1 + fat_gap(fat0[block].id);
+        }
+        if (npos > lblk) {
+            break;
+        }
+        block = next;
+        pos = npos;
+    }
+
+    do {
+        target = lblk - pos - 1 > FAT_GAP_MAX ? pos + 1 + FAT_GAP_MAX : lblk;
+        /**< Right after the block before it, an append extends a contiguous run. */
+        if ((fresh = get_free_near(1, block + 1)) == -1) {
+            return -1;
+        }
+        memset(fs_head + BLOCK_SIZE * fresh, 0, BLOCK_SIZE);
+        extent_forget(block);
+        fat0[block].id = fat_link(fresh, target - pos - 1);
+        fat0[fresh].id = fat_link(next, next == END ? 0 : npos - target - 1);
+        block = fresh;
+        pos = target;
+    } while (target != lblk);
+
+    return fresh;
+}
+
+/**
+ * Get the hold table, one count per block of snapshots still using it.
+ * @return Hold table, NULL when there is no snapshot.
+ */
+unsigned char *hold_table(void) {
+    block0 *init_block = (block0 *) fs_head;
+
+    return init_block->hold ? fs_head + BLOCK_SIZE * init_block->hold : NULL;
+}
+
+/**
+ * Check if a snapshot still uses a block.
+ * @param block Block num.
+ * @return 1 if held, else 0.
+ */
+int block_held(int block) {
+    unsigned char *hold = hold_table();
+
+    return hold != NULL && hold[block] > 0;
+}
+
+/**
+ * Check if a block has to reach the disk, the live FAT uses it or a snapshot holds it.
+ * A block a snapshot kept through a copy on write is free in the live FAT.
+ * @param block Block num.
+ * @return 1 if used, else 0.
+ */
+int block_used(int block) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+
+    return fat0[block].id != FREE || block_held(block);
+}
+
+/**
+ * Get the reference table, one count per block of extra chains dedup linked to it.
+ * @return Reference table, NULL until dedup is enabled.
+ */
+unsigned char *ref_table(void) {
+    block0 *init_block = (block0 *) fs_head;
+
+    return init_block->refs ? fs_head + BLOCK_SIZE * init_block->refs : NULL;
+}
+
+/**
+ * Check if more than one chain runs through a block.
+ * @param block Block num.
+ * @return 1 if shared, else 0.
+ */
+int block_shared(int block) {
+    unsigned char *refs = ref_table();
+
+    return refs != NULL && refs[block] > 0;
+}
+
+/**
+ * Drop one chain from a block being reclaimed.
+ * @param block Block num.
+ * @return 1 if other chains still use it, 0 if it can be freed.
+ */
+int block_unref(int block) {
+    unsigned char *refs = ref_table();
+
+    if (refs != NULL && refs[block] > 0) {
+        refs[block]--;
+        return 1;
+    }
+    dedup_forget(block);
+    zfile_forget(block);
+    return 0;
+}
+
+/**
+ * Give a file its own copy of a block a snapshot still uses.
+ * The old block leaves the live chain but stays held by the snapshot.
+ * Only FAT0 is changed, the caller mirrors it.
+ * @param file FCB of the file, first is updated when lblk is 0.
+ * @param lblk Logical block num.
+ * @param block Physical block num of lblk.
+ * @return Block to write instead, -1 without space.
+ */
+int file_cow(fcb *file, int lblk, int block) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int fresh, prev;
+
+    if ((fresh = get_free_near(1, block)) == -1) {
+        return -1;
+    }
+    memcpy(fs_head + BLOCK_SIZE * fresh, fs_head + BLOCK_SIZE * block, BLOCK_SIZE);
+    fat0[fresh].id = fat0[block].id;
+    extent_forget(block);
+    fat0[block].id = FREE;
+    dedup_forget(block);
+
+    if (lblk == 0) {
+        file->first = fresh;
+    } else {
+        for (prev = file->first; fat_next(fat0[prev].id) != block; prev = fat_next(fat0[prev].id));
+        fat0[prev].id = fat_link(fresh, fat_gap(fat0[prev].id));
     }
+    return fresh;
 }
 
 /**
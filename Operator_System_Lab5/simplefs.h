@@ -11,6 +11,8 @@
 #include <string.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #ifndef OPERATOR_SYSTEM_EXP4_SIMPLEFS_H
 #define OPERATOR_SYSTEM_EXP4_SIMPLEFS_H
@@ -18,8 +20,16 @@
 #define BLOCK_NUM       1024
 #define DISK_SIZE       1048576
 #define SYS_PATH        "./fsfile"
+#define VOL_PATH        "./fsfile.vol"  /**< Description of a striped volume, SYS_PATH alone without it. */
+#define PUB_PATH        "./fsfile.pub"  /**< Image published for shared readers. */
 #define END             0xffff  /**< End of the block, a flag in FAT. */
 #define FREE            0x0000  /**< Unused block, a flag in FAT. */
+#define FAT_NEXT_MASK   0x03ff  /**< Next block num in a FAT entry. */
+#define FAT_GAP_SHIFT   10      /**< Hole count in a FAT entry, logical blocks skipped before the next block. */
+#define FAT_GAP_MAX     62      /**< Keep a full entry distinct from END. */
+#if BLOCK_NUM > FAT_NEXT_MASK + 1
+#error "BLOCK_NUM does not fit in a FAT entry"
+#endif
 #define ROOT            "/"     /**< Root directory name.*/
 #define ROOT_BLOCK_NUM  2       /**< Block of the initial root directory. */
 #define MAX_OPENFILE    10      /**< Max files to open at the same time. */
@@ -29,6 +39,45 @@
 #define FOLDER_COLOR    "\e[1;32m"
 #define DEFAULT_COLOR   "\e[0m"
 #define WRITE_SIZE      20 * BLOCK_SIZE
+#define WB_SIZE         (4 * BLOCK_SIZE)    /**< Write-back buffer of each open file. */
+#define WB_BUDGET       (8 * BLOCK_SIZE)    /**< Buffered bytes of all open files before one is flushed. */
+#define WALK_MAX_THREADS 16     /**< Upper bound of threads walking the directory tree. */
+#define FS_INLINE       0x01    /**< Format flag, small files live in their directory entry. */
+#define FCB_INLINE      0x01    /**< reserve[0] flag, file data is inline. */
+#define INLINE_SLOT_SIZE 128    /**< Directory slot size of inline format. */
+#define MAX_HOLD        255     /**< Snapshots that can share one block. */
+#define FS_DEDUP        0x02    /**< Format flag, written files share identical block runs. */
+#define FS_DIR2         0x04    /**< Format flag, directory blocks start with a dir_head (format v2). */
+#define DIR2_MAGIC      0x3244  /**< "D2", first bytes of a v2 directory block. */
+#define DIR2_VERSION    2
+#define DIR2_HEAD_SIZE  64      /**< Bytes reserved for the dir_head, one cache line. */
+#define DIR2_MAX_SLOTS  24      /**< Most slots a v2 directory block can hold. */
+#define MAX_REF         255     /**< Extra chains that can share one block. */
+#define DEDUP_SLOTS     (BLOCK_NUM * 2) /**< Slots of the in-memory dedup index. */
+#define FCB_COMPRESS    0x02    /**< reserve[0] flag, file data is a stream of lz chunks. */
+#define LZ_CHUNK        4096    /**< Bytes of file data compressed together. */
+#define ZCACHE_SLOTS    8       /**< Decompressed chunks kept in memory. */
+#define LSVIEW_SLOTS    4       /**< Sorted directories kept in memory for ls. */
+#define SYNC_NONE       0       /**< Durability policy, the image is written on exit, format and sync. */
+#define SYNC_CLOSE      1       /**< Durability policy, also when a written file is closed. */
+#define SYNC_PERIODIC   2       /**< Durability policy, the flusher commits every period. */
+#define SYNC_GROUP      3       /**< Durability policy, the flusher commits after commands, several per commit when busy. */
+#define SYNC_PERIOD     1000    /**< Default milliseconds between periodic commits. */
+#define VOL_MAX_MEMBERS 8       /**< Backing files of one volume. */
+#define VOL_PATH_LEN    256     /**< Longest path of a member file. */
+#define VOL_STRIPE      16      /**< Default blocks per stripe. */
+#define VOL_READ        0x01    /**< Volume request, read the whole image. */
+#define VOL_TRUNC       0x02    /**< Volume request, drop the old content of the members first. */
+#define VOL_SYNC        0x04    /**< Volume request, wait until the members are on disk. */
+#define GEN_BLOCKS      ((int) (BLOCK_NUM * sizeof(uint32_t) / BLOCK_SIZE)) /**< Blocks of the generation table. */
+#define BLOOM_SLOTS     16      /**< Directories with a name filter kept in memory. */
+#define BLOOM_MIN_BITS  512     /**< Smallest filter, a power of two. */
+#define BLOOM_BITS_PER_NAME 16  /**< Filter bits per name, about 0.2% false positives. */
+#define BLOOM_PROBES    4       /**< Bits set per name. */
+#define AG_BLOCKS       64      /**< Blocks per allocation group. */
+#define AG_COUNT        (BLOCK_NUM / AG_BLOCKS)
+#define EXTENT_SLOTS    8       /**< Files with an extent map kept in memory. */
+#define EXTENT_MIN_BLOCKS 16    /**< Logical blocks walked along the chain before a map is used. */
 
 /**
  * @brief Store virtual disk information.
@@ -38,6 +87,13 @@ typedef struct BLOCK0 {
     char information[200];
     unsigned short root;        /**< Block number of the root directory. */
     unsigned char *start_block; /**< Location of the first data block. */
+    unsigned short slot;        /**< Bytes per directory slot, 0 on old images. */
+    unsigned char flags;        /**< FS_* format flags. */
+    unsigned short snap;        /**< Block of the snapshot table, 0 if none. */
+    unsigned short hold;        /**< Block of the hold table, 0 if none. */
+    unsigned short refs;        /**< Block of the reference table, 0 until dedup is enabled. */
+    unsigned short gens;        /**< First of GEN_BLOCKS blocks of the generation table, 0 until send is used. */
+    uint32_t gen;               /**< Generation of the last commit. */
 } block0;
 
 /**
@@ -48,7 +104,7 @@ typedef struct FCB {
     char filename[8];
     char exname[3];
     unsigned char attribute;    /**< 0: directory or 1: file. */
-    unsigned char reserve[10];
+    unsigned char reserve[10];  /**< reserve[0] holds FCB_* flags, reserve[1..4] the stored length of a compressed file. */
     unsigned short time;        /**< File create time. */
     unsigned short date;        /**< File create date. */
     unsigned short first;       /**< First block num of the file. */
@@ -56,9 +112,29 @@ typedef struct FCB {
     char free;
 } fcb;
 
+/**
+ * @brief Index at the start of a v2 directory block.
+ * Scans read the bitmap and the hashes, one cache line, and only open slots that match.
+ * The slots stay the source of truth, the index is rebuilt from them by dir_head_sync.
+ */
+typedef struct DIRHEAD {
+    uint16_t magic;             /**< DIR2_MAGIC. */
+    uint8_t version;            /**< DIR2_VERSION. */
+    uint8_t used;               /**< Used slots in the block. */
+    uint32_t bitmap;            /**< Bit i set if slot i is used. */
+    uint16_t hash[DIR2_MAX_SLOTS];  /**< dir_hash of the full name of each used slot. */
+} dir_head;
+
+/**< The on-disk layouts must not depend on the compiler. */
+_Static_assert(sizeof(dir_head) <= DIR2_HEAD_SIZE, "dir_head must fit its reserved space");
+_Static_assert(offsetof(dir_head, bitmap) == 4 && offsetof(dir_head, hash) == 8, "dir_head layout");
+_Static_assert(sizeof(fcb) == 48 && offsetof(fcb, first) == 26 && offsetof(fcb, length) == 32 &&
+               offsetof(fcb, free) == 40, "fcb layout");
+
 /**
  * @brief File allocation table.
- * Record the next block num of file.
+ * Record the next block num of file, and in the high bits how many logical blocks
+ * of a sparse file are holes before it.
  * When value is 0xffff, this block is the last block of the file.
  */
 typedef struct FAT {
@@ -77,21 +153,184 @@ typedef struct USEROPEN {
     int count;
     char fcb_state;
     char free;
+    /** Write-back buffer, bytes written at wb_offset not yet in the image. */
+    char wbuf[WB_SIZE];
+    unsigned long wb_offset;
+    int wb_len;
 } useropen;
 
+/**
+ * @brief A point-in-time image of the file system.
+ * The snapshot owns a chain starting with two blocks of frozen FAT, followed by copies of
+ * every directory. Data blocks are shared with the live file system through the hold table.
+ */
+typedef struct SNAPSHOT {
+    char name[NAMELENGTH];
+    unsigned short fat;         /**< First block of the owned chain, the frozen FAT. */
+    unsigned short root;        /**< First block of the root directory copy. */
+    unsigned short time;
+    unsigned short date;
+    char used;
+} snapshot;
+
+#define MAX_SNAPSHOT    (BLOCK_SIZE / sizeof(snapshot))
+
+/**
+ * @brief A directory waiting to be visited by the walker.
+ */
+typedef struct WALKITEM {
+    int first;                  /**< First block of the directory. */
+    char path[PATHLENGTH];
+} walk_item;
+
+/**
+ * @brief Directories queued by one walker thread.
+ * The owner pushes and pops at the tail, idle threads steal the oldest entry at the head.
+ */
+typedef struct WALKDEQUE {
+    pthread_mutex_t lock;
+    walk_item *items;
+    int head;
+    int tail;
+    int capacity;
+} walk_deque;
+
+/**
+ * @brief Threads walking the directory tree in parallel.
+ * Each thread queues the sub directories it finds on its own deque and steals from the
+ * others once it runs dry.
+ */
+typedef struct WALKER {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    walk_deque deques[WALK_MAX_THREADS];
+    int nthreads;
+    int pending;                /**< Directories queued or being visited. */
+    int idle;                   /**< Threads waiting for work. */
+    unsigned long stamp;        /**< Bumped on every push, lets idle threads sleep safely. */
+    unsigned long steals;
+    void (*visit)(struct WALKER *w, int first, const char *path);
+    void *arg;                  /**< Visitor private data. */
+} walker;
+
+/**
+ * @brief Totals of a sub tree.
+ */
+typedef struct DUCOUNT {
+    unsigned long bytes;        /**< Sum of file lengths. */
+    int blocks;                 /**< Blocks of every chain, directories included. */
+    int dirs;
+    int files;
+} du_count;
+
+/**
+ * @brief Commit metrics of the flusher, times in milliseconds.
+ */
+typedef struct SYNCSTAT {
+    unsigned long commits;      /**< Commits that wrote blocks. */
+    unsigned long requests;     /**< Commands that asked the flusher for a commit. */
+    unsigned long blocks;       /**< Blocks written. */
+    unsigned long runs;         /**< Writes issued, neighbour blocks share one. */
+    double hold_total;          /**< fs_lock held to find and copy changed blocks. */
+    double hold_max;
+    double io_last;             /**< Write and fdatasync. */
+    double io_total;
+    double io_max;
+} sync_stat;
+
+/**
+ * @brief One block of a volume write.
+ */
+typedef struct VOLIO {
+    int block;
+    const unsigned char *data;
+} vol_io;
+
+/**
+ * @brief One entry of a batch create.
+ */
+typedef struct BATCHENTRY {
+    char name[NAMELENGTH];      /**< Name as given. */
+    char is_dir;
+    char fname[8];              /**< Name part as stored. */
+    char exname[3];             /**< Extension as stored, "di" for folders. */
+    char fullname[NAMELENGTH];  /**< Full name as get_fullname gives it. */
+} batch_entry;
+
+/**
+ * @brief Logical blocks of a file on neighbour physical blocks.
+ */
+typedef struct EXTENT {
+    int lstart;                 /**< First logical block. */
+    int pstart;                 /**< Its physical block. */
+    int len;                    /**< Blocks in the run. */
+} extent;
+
+/**
+ * @brief Runs of one chain in logical order, see extent.c.
+ */
+typedef struct EXTENTMAP {
+    int first;                  /**< First block of the file, -1 if the slot is empty. */
+    int count;
+    int capacity;
+    extent *runs;
+    unsigned long stamp;        /**< Last use, the oldest slot is replaced. */
+    unsigned char blocks[BLOCK_NUM / 8];    /**< Blocks of the chain, a change to one of them drops the map. */
+} extent_map;
+
+typedef void (*walk_visit)(walker *w, int first, const char *path);
+
+/** Problems found by fsck. */
+enum {
+    FSCK_BROKEN,                /**< Chain runs into a free or invalid block. */
+    FSCK_CYCLE,                 /**< Chain loops back on itself. */
+    FSCK_CROSS,                 /**< Block already owned by another chain. */
+    FSCK_BADFIRST,              /**< First block of an entry is invalid. */
+    FSCK_ORPHAN,                /**< Block allocated but unreachable. */
+    FSCK_MIRROR,                /**< FAT1 is not a copy of FAT0. */
+    FSCK_DIRHEAD                /**< Index of a v2 directory block does not match its slots. */
+};
+
+/**
+ * @brief A problem found by fsck and how to fix it.
+ */
+typedef struct FSCKISSUE {
+    int type;
+    int block;                  /**< Last good block of the chain, -1 if the entry itself is bad. */
+    fcb *entry;                 /**< Directory entry owning the chain. */
+    char path[PATHLENGTH];
+} fsck_issue;
+
+/**
+ * @brief State shared by the fsck threads.
+ */
+typedef struct FSCKCTX {
+    unsigned char map[BLOCK_NUM / 8];   /**< Reachability bitmap. */
+    int low;                    /**< First block a chain may use. */
+    int dirs;
+    int files;
+    pthread_mutex_t lock;       /**< Protect issues. */
+    fsck_issue *issues;
+    int count;
+    int capacity;
+} fsck_ctx;
+
 /** Global variables. */
 unsigned char *fs_head;         /**< Initial address of the virtual disk. */
 useropen openfile_list[MAX_OPENFILE];   /**< File array opened by user. */
 int curdir;                     /**< File descriptor of current directory. */
 char current_dir[80];           /**< Current directory name. */
 unsigned char *start;           /**< Location of the first data block. */
+pthread_mutex_t fs_lock;        /**< Held by the shell while running a command, and by background jobs. */
+int fs_readonly;                /**< Refuse commands that change the disk, a snapshot is mounted or a shared reader. */
+int fs_shared;                  /**< 1 in a reader mapping the published image, started with -r. */
 
 /** Declaration of functions */
 int start_sys(void);
 
 int my_format(char **args);
 
-int do_format(void);
+int do_format(int flags);
 
 int my_cd(char **args);
 
@@ -107,9 +346,21 @@ int my_rmdir(char **args);
 
 void do_rmdir(fcb *dir);
 
+int dir_empty(int first);
+
+int tree_busy(const char *path);
+
+void do_rmtree(fcb *entry);
+
 int my_ls(char **args);
 
-void do_ls(int first, char mode);
+void do_ls(int first, char mode, char key, int reverse, int offset, int limit);
+
+fcb **ls_view(int first, char key, int *count);
+
+void lsview_forget(int block);
+
+void lsview_reset(void);
 
 int my_create(char **args);
 
@@ -131,6 +382,70 @@ int my_write(char **args);
 
 int do_write(int fd, char *content, size_t len, int wstyle);
 
+int wb_write(int fd, char *content, size_t len, int wstyle);
+
+int wb_flush(int fd);
+
+void wb_flush_all(void);
+
+int my_fsync(char **args);
+
+int my_batch(char **args);
+
+int my_bulkcat(char **args);
+
+int my_bulkwrite(char **args);
+
+int do_batch(int first, batch_entry *entries, int count);
+
+int my_sync(char **args);
+
+int sync_flush(void);
+
+void sync_request(void);
+
+void sync_close(void);
+
+void sync_stop(void);
+
+int sync_policy(int policy, int period);
+
+void sync_loaded(void);
+
+void sync_rewrite_begin(void);
+
+void sync_rewrite_end(int truncate);
+
+int sync_publish(int on);
+
+int my_publish(char **args);
+
+int pub_write(const unsigned char *image);
+
+int pub_map(void);
+
+void pub_refresh(void);
+
+void pub_unmap(void);
+
+int my_volume(char **args);
+
+int vol_open(void);
+
+int vol_read(unsigned char *image);
+
+int vol_write(const vol_io *io, int n, int flags);
+
+int vol_write_used(int flags);
+
+int my_send(char **args);
+
+int my_receive(char **args);
+
+uint32_t *gen_table(void);
+
+void gen_commit(unsigned char *marks);
+
 int my_read(char **args);
 
 int do_read(int fd, int len, char *text);
@@ -139,8 +454,20 @@ int my_exit_sys();
 
 int get_free(int count);
 
+int get_free_near(int count, int goal);
+
+int ag_free(int group);
+
+int ag_goal(int dir, int count);
+
+int ag_goal_dir(int parent);
+
 int set_free(unsigned short first, unsigned short length, int mode);
 
+void stamp_begin(void);
+
+void stamp_end(void);
+
 int set_fcb(fcb *f, const char *filename, const char *exname, unsigned char attr, unsigned short first,
             unsigned long length,
             char ffree);
@@ -155,16 +482,176 @@ char * get_abspath(char *abspath, const char *relpath);
 
 int get_useropen();
 
+int get_openfile(fcb *file);
+
 fcb *find_fcb(const char *path);
 
 fcb *find_fcb_r(char *token, int root);
 
 void init_folder(int first, int second);
 
+int dir_slot_size(void);
+
+int dir_slots(void);
+
+fcb *dir_slot(int block, int i);
+
+int dir_head_size(void);
+
+dir_head *dir_head_of(int block);
+
+unsigned short dir_hash(const char *name);
+
+void dir_head_sync(int block);
+
+int dir_head_ok(int block);
+
+void dir_touch(fcb *slot);
+
+fcb *dir_lookup(int first, const char *name);
+
+int bloom_absent(int first, const char *name);
+
+void bloom_touch(int block, fcb *slot);
+
+void bloom_adopt(int first, int block);
+
+void bloom_forget(int first);
+
+void bloom_reset(void);
+
+fcb *dir_next(int *block, int *i);
+
+fcb *dir_free_slot(int first);
+
+void dir_unslot(int first, fcb *slot);
+
+int inline_size(void);
+
+unsigned char *inline_data_of(fcb *file);
+
+int fat_next(unsigned short id);
+
+int fat_gap(unsigned short id);
+
+unsigned short fat_link(int next, int gap);
+
+int file_block(int first, int lblk);
+
+int file_alloc(int first, int lblk);
+
+extent_map *extent_get(int first);
+
+int extent_find(extent_map *map, int lblk);
+
+void extent_forget(int block);
+
+void extent_reset(void);
+
+unsigned char *hold_table(void);
+
+int block_held(int block);
+
+int block_used(int block);
+
+int file_cow(fcb *file, int lblk, int block);
+
+int my_snapshot(char **args);
+
+int do_snapshot(const char *name);
+
+int snapshot_delete(const char *name);
+
+int snapshot_mount(const char *name);
+
+void snapshot_umount(void);
+
+int snapshot_mounted(void);
+
+snapshot *snapshot_table(void);
+
+unsigned char *ref_table(void);
+
+int block_shared(int block);
+
+int block_unref(int block);
+
+int my_dedup(char **args);
+
+void dedup_hash(const void *key, int len, uint64_t out[2]);
+
+int dedup_file(fcb *file);
+
+int dedup_unshare(fcb *file);
+
+void dedup_forget(int block);
+
+void dedup_reset(void);
+
+int chain_alloc(int count, int goal);
+
+int flush_sys(void);
+
+int sys_write(int truncate);
+
+int my_import(char **args);
+
+int my_export(char **args);
+
+int lz_bound(int n);
+
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap);
+
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap);
+
+unsigned long file_stored(fcb *file);
+
+int zfile_read(fcb *file, unsigned long pos, int len, char *text);
+
+int file_load(fcb *file, unsigned char *buf);
+
+int zfile_write(fcb *file, unsigned long offset, const char *content, size_t len, int truncate);
+
+void zfile_forget(int block);
+
+int my_compress(char **args);
+
+int my_bench(char **args);
+
 void get_fullname(char *fullname, fcb *fcb1);
 
 char *trans_date(char *sdate, unsigned short date);
 
 char *trans_time(char *stime, unsigned short time);
 
+int walk_tree(int first, const char *path, walk_visit visit, void *arg, int nthreads);
+
+void walk_push(walker *w, int first, const char *path);
+
+int walk_threads(void);
+
+int walk_snapshot(int first, fcb **entries);
+
+int my_find(char **args);
+
+int my_du(char **args);
+
+int do_du(fcb *entry, const char *path, int nthreads, du_count *total);
+
+int my_cat(char **args);
+
+int do_cat(fcb *entry, unsigned long length, int fd);
+
+int my_fsck(char **args);
+
+int do_fsck(int repair, int nthreads);
+
+int my_defrag(char **args);
+
+int do_defrag(fcb *file);
+
+int chain_frag(int first, int *breaks);
+
+void defrag_stop(void);
+
 #endif //OPERATOR_SYSTEM_EXP4_SIMPLEFS_H
@@ -0,0 +1,448 @@
+/**
+ * @file    snapshot.c
+ * @brief   Copy-on-write snapshots of the FAT16 file system.
+ * @details A snapshot freezes FAT0 and copies the directory tree, which is all metadata.
+ *          Data blocks stay shared: the hold table counts the snapshots using each block,
+ *          get_free never hands out a held block and do_write copies one before changing it.
+ */
+
+#include "simplefs.h"
+
+static int mounted = -1;                /**< Index of the mounted snapshot, -1 for the live one. */
+static fat live_fat[BLOCK_NUM];         /**< Live FAT while a snapshot is mounted. */
+static unsigned short live_root;        /**< Live root while a snapshot is mounted. */
+
+/**
+ * Get the snapshot table.
+ * @return Table of MAX_SNAPSHOT entries, NULL if no snapshot was ever taken.
+ */
+snapshot *snapshot_table(void) {
+    block0 *init_block = (block0 *) fs_head;
+
+    return init_block->snap ? (snapshot *) (fs_head + BLOCK_SIZE * init_block->snap) : NULL;
+}
+
+/**
+ * Find a snapshot by name.
+ * @param name Snapshot name.
+ * @return Table index, -1 if not found.
+ */
+static int snapshot_find(const char *name) {
+    snapshot *table = snapshot_table();
+    int i;
+
+    for (i = 0; table != NULL && i < MAX_SNAPSHOT; i++) {
+        if (table[i].used && !strcmp(table[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Allocate one block and append it to a chain of FAT0.
+ * @param tail Last block of the chain, updated.
+ * @return New block, -1 without space.
+ */
+static int snapshot_grow(int *tail) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block;
+
+    if ((block = get_free(1)) == -1) {
+        return -1;
+    }
+    fat0[*tail].id = block;
+    fat0[block].id = END;
+    *tail = block;
+    return block;
+}
+
+/**
+ * Copy a directory and everything below it into blocks owned by the snapshot.
+ * @param frozen Frozen FAT, the copies are chained there instead of the originals.
+ * @param first First block of the live directory.
+ * @param parent First block of the parent copy, -1 for the root.
+ * @param tail Last block of the owned chain, updated.
+ * @return First block of the copy, -1 without space.
+ */
+static int snapshot_copy_dir(fat *frozen, int first, int parent, int *tail) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block, copy, prev = -1, head = -1, i, child;
+    fcb *dir;
+
+    /**< Copy the directory blocks. */
+    for (block = first; block != END && block != FREE; block = fat_next(fat0[block].id)) {
+        if ((copy = snapshot_grow(tail)) == -1) {
+            return -1;
+        }
+        memcpy(fs_head + BLOCK_SIZE * copy, fs_head + BLOCK_SIZE * block, BLOCK_SIZE);
+        frozen[block].id = FREE;
+        frozen[copy].id = END;
+        if (prev == -1) {
+            head = copy;
+        } else {
+            frozen[prev].id = copy;
+        }
+        prev = copy;
+    }
+
+    /**< Point the copy at itself, its parent copy and its children copies. */
+    dir_slot(head, 0)->first = head;
+    dir_slot(head, 1)->first = parent == -1 ? head : parent;
+    for (block = head; block != END; block = frozen[block].id) {
+        for (i = block == head ? 2 : 0; i < dir_slots(); i++) {
+            dir = dir_slot(block, i);
+            if (dir->free == 0 || dir->attribute != 0) {
+                continue;
+            }
+            if ((child = snapshot_copy_dir(frozen, dir->first, head, tail)) == -1) {
+                return -1;
+            }
+            dir->first = child;
+        }
+    }
+    return head;
+}
+
+/**
+ * Mark the blocks owned by a snapshot.
+ * @param first First block of the owned chain.
+ * @param owned Bitmap of BLOCK_NUM bits.
+ */
+static void snapshot_owned(int first, unsigned char *owned) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block;
+
+    for (block = first; block != END && block != FREE; block = fat_next(fat0[block].id)) {
+        owned[block >> 3] |= 1 << (block & 7);
+    }
+}
+
+/**
+ * Take a snapshot.
+ * @param name Snapshot name.
+ * @return 0 on success, -1 on error.
+ */
+int do_snapshot(const char *name) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    fat frozen[BLOCK_NUM];
+    unsigned char owned[BLOCK_NUM / 8];
+    unsigned char *hold;
+    snapshot *table;
+    int i, slot, first, tail, root;
+    time_t now;
+
+    if (snapshot_find(name) != -1) {
+        fprintf(stderr, "snapshot: %s exists\n", name);
+        return -1;
+    }
+
+    /**< Tables are created with the first snapshot. */
+    if (init_block->snap == 0) {
+        if ((i = get_free(2)) == -1) {
+            fprintf(stderr, "snapshot: No more space\n");
+            return -1;
+        }
+        set_free(i, 1, 0);
+        set_free(i + 1, 1, 0);
+        memset(fs_head + BLOCK_SIZE * i, 0, BLOCK_SIZE * 2);
+        init_block->snap = i;
+        init_block->hold = i + 1;
+    }
+    table = snapshot_table();
+    hold = hold_table();
+    for (slot = 0; slot < MAX_SNAPSHOT && table[slot].used; slot++);
+    if (slot == MAX_SNAPSHOT) {
+        fprintf(stderr, "snapshot: too many snapshots\n");
+        return -1;
+    }
+
+    /**< Freeze the FAT, without the blocks of the snapshot machinery itself. */
+    memcpy(frozen, fat0, sizeof(frozen));
+    memset(owned, 0, sizeof(owned));
+    for (i = 0; i < MAX_SNAPSHOT; i++) {
+        if (table[i].used) {
+            snapshot_owned(table[i].fat, owned);
+        }
+    }
+    owned[init_block->snap >> 3] |= 1 << (init_block->snap & 7);
+    owned[init_block->hold >> 3] |= 1 << (init_block->hold & 7);
+    if (init_block->refs) {
+        owned[init_block->refs >> 3] |= 1 << (init_block->refs & 7);
+    }
+    for (i = 0; init_block->gens && i < GEN_BLOCKS; i++) {
+        owned[(init_block->gens + i) >> 3] |= 1 << ((init_block->gens + i) & 7);
+    }
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (owned[i >> 3] & (1 << (i & 7))) {
+            frozen[i].id = FREE;
+        }
+    }
+
+    /**< Owned chain, two blocks of frozen FAT then the directory copies. */
+    if ((first = get_free(2)) == -1) {
+        fprintf(stderr, "snapshot: No more space\n");
+        return -1;
+    }
+    set_free(first, 2, 0);
+    tail = first + 1;
+    if ((root = snapshot_copy_dir(frozen, init_block->root, -1, &tail)) == -1) {
+        set_free(first, 0, 1);
+        memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+        fprintf(stderr, "snapshot: No more space\n");
+        return -1;
+    }
+
+    /**< Every data block the frozen FAT uses is now shared, the copies are private. */
+    memset(owned, 0, sizeof(owned));
+    snapshot_owned(first, owned);
+    for (i = init_block->root; i < BLOCK_NUM; i++) {
+        if (frozen[i].id != FREE && !(owned[i >> 3] & (1 << (i & 7))) && hold[i] == MAX_HOLD) {
+            break;
+        }
+    }
+    if (i < BLOCK_NUM) {
+        set_free(first, 0, 1);
+        memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+        fprintf(stderr, "snapshot: too many snapshots share block %d\n", i);
+        return -1;
+    }
+    for (i = init_block->root; i < BLOCK_NUM; i++) {
+        if (frozen[i].id != FREE && !(owned[i >> 3] & (1 << (i & 7)))) {
+            hold[i]++;
+        }
+    }
+    memcpy(fs_head + BLOCK_SIZE * first, frozen, sizeof(frozen));
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+
+    time(&now);
+    memset(&table[slot], 0, sizeof(snapshot));
+    strncpy(table[slot].name, name, NAMELENGTH - 1);
+    table[slot].fat = first;
+    table[slot].root = root;
+    table[slot].time = get_time(localtime(&now));
+    table[slot].date = get_date(localtime(&now));
+    table[slot].used = 1;
+    return 0;
+}
+
+/**
+ * Delete a snapshot and release the blocks only it was using.
+ * @param name Snapshot name.
+ * @return 0 on success, -1 on error.
+ */
+int snapshot_delete(const char *name) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    fat *fat1 = (fat *) (fs_head + BLOCK_SIZE * 3);
+    fat *frozen;
+    unsigned char owned[BLOCK_NUM / 8];
+    unsigned char *hold = hold_table();
+    snapshot *table = snapshot_table();
+    int i, slot;
+
+    if ((slot = snapshot_find(name)) == -1) {
+        fprintf(stderr, "snapshot: %s: No such snapshot\n", name);
+        return -1;
+    }
+
+    memset(owned, 0, sizeof(owned));
+    snapshot_owned(table[slot].fat, owned);
+    frozen = (fat *) (fs_head + BLOCK_SIZE * table[slot].fat);
+    for (i = init_block->root; i < BLOCK_NUM; i++) {
+        if (frozen[i].id != FREE && !(owned[i >> 3] & (1 << (i & 7))) && hold[i] > 0) {
+            hold[i]--;
+        }
+    }
+    set_free(table[slot].fat, 0, 1);
+    table[slot].used = 0;
+
+    /**< Drop the tables with the last snapshot. */
+    for (i = 0; i < MAX_SNAPSHOT && !table[i].used; i++);
+    if (i == MAX_SNAPSHOT) {
+        set_free(init_block->snap, 1, 1);
+        set_free(init_block->hold, 1, 1);
+        init_block->snap = 0;
+        init_block->hold = 0;
+    }
+    memcpy(fat1, fat0, BLOCK_NUM * sizeof(fat));
+    return 0;
+}
+
+/**
+ * Show a snapshot read only in place of the live file system.
+ * @param name Snapshot name.
+ * @return 0 on success, -1 on error.
+ */
+int snapshot_mount(const char *name) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    snapshot *table = snapshot_table();
+    int slot;
+
+    if ((slot = snapshot_find(name)) == -1) {
+        fprintf(stderr, "snapshot: %s: No such snapshot\n", name);
+        return -1;
+    }
+    if (mounted == -1) {
+        /**< Commits stop while the live FAT is out of the image, write it now. */
+        flush_sys();
+        memcpy(live_fat, fat0, sizeof(live_fat));
+        live_root = init_block->root;
+    }
+
+    memcpy(fat0, fs_head + BLOCK_SIZE * table[slot].fat, BLOCK_NUM * sizeof(fat));
+    init_block->root = table[slot].root;
+    bloom_reset();
+    extent_reset();
+    lsview_reset();
+    mounted = slot;
+    fs_readonly = 1;
+    return 0;
+}
+
+/**
+ * Go back to the live file system.
+ */
+void snapshot_umount(void) {
+    block0 *init_block = (block0 *) fs_head;
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+
+    if (mounted == -1) {
+        return;
+    }
+    memcpy(fat0, live_fat, sizeof(live_fat));
+    init_block->root = live_root;
+    bloom_reset();
+    extent_reset();
+    lsview_reset();
+    mounted = -1;
+    fs_readonly = 0;
+}
+
+/**
+ * Check if a snapshot is mounted, its FAT replaces the live one in memory then.
+ * A shared reader is read-only as well but keeps the live FAT.
+ * @return 1 if mounted, else 0.
+ */
+int snapshot_mounted(void) {
+    return mounted != -1;
+}
+
+/**
+ * Reopen the root directory as current directory after the view changed.
+ */
+static void snapshot_chroot(void) {
+    fcb_cpy(&openfile_list[0].open_fcb, dir_slot(((block0 *) fs_head)->root, 0));
+    strcpy(openfile_list[0].dir, ROOT);
+    openfile_list[0].count = 0;
+    openfile_list[0].fcb_state = 0;
+    openfile_list[0].free = 1;
+    do_chdir(0);
+}
+
+/**
+ * Print all snapshots.
+ */
+static void snapshot_list(void) {
+    block0 *init_block = (block0 *) fs_head;
+    snapshot *table = snapshot_table();
+    fat *frozen;
+    char date[16], time[16];
+    int i, j, blocks;
+
+    for (i = 0; table != NULL && i < MAX_SNAPSHOT; i++) {
+        if (!table[i].used) {
+            continue;
+        }
+        frozen = (fat *) (fs_head + BLOCK_SIZE * table[i].fat);
+        for (j = init_block->root, blocks = 0; j < BLOCK_NUM; j++) {
+            if (frozen[j].id != FREE) {
+                blocks++;
+            }
+        }
+        trans_date(date, table[i].date);
+        trans_time(time, table[i].time);
+        printf("%s%-16s\t%s\t%s\t%6d blocks\n", i == mounted ? "*" : " ", table[i].name, date, time, blocks);
+    }
+}
+
+/**
+ * Manage snapshots.
+ * @param args 'create name', 'list', 'mount name', 'umount' or 'delete name'.
+ * @return Always 1.
+ */
+int my_snapshot(char **args) {
+    int i;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "snapshot: missing operand\n");
+        return 1;
+    }
+    if (!strcmp(args[1], "list")) {
+        snapshot_list();
+        return 1;
+    }
+    if (!strcmp(args[1], "umount")) {
+        if (mounted == -1) {
+            fprintf(stderr, "snapshot: no snapshot mounted\n");
+            return 1;
+        }
+        for (i = 1; i < MAX_OPENFILE; i++) {
+            do_close(i);
+        }
+        snapshot_umount();
+        snapshot_chroot();
+        return 1;
+    }
+    if (args[2] == NULL) {
+        fprintf(stderr, "snapshot: expected a snapshot name\n");
+        return 1;
+    }
+
+    if (!strcmp(args[1], "mount")) {
+        /**< A shared reader cannot swap the FAT of an image it only maps. */
+        if (fs_shared) {
+            fprintf(stderr, "snapshot: Read-only file system\n");
+            return 1;
+        }
+        /**< Open entries would point into the other view. */
+        for (i = 1; i < MAX_OPENFILE; i++) {
+            if (openfile_list[i].free == 1 && openfile_list[i].open_fcb.attribute == 1) {
+                fprintf(stderr, "snapshot: close all files before mount\n");
+                return 1;
+            }
+        }
+        if (snapshot_mount(args[2]) == 0) {
+            for (i = 1; i < MAX_OPENFILE; i++) {
+                do_close(i);
+            }
+            snapshot_chroot();
+        }
+        return 1;
+    }
+
+    /**< Also a shared reader, its image is mapped read-only. */
+    if (fs_readonly) {
+        fprintf(stderr, mounted != -1 ? "snapshot: Read-only file system, umount first\n" :
+                "snapshot: Read-only file system\n");
+        return 1;
+    }
+    if (!strcmp(args[1], "create")) {
+        /**< Written files keep their new size in the open entry until closed. */
+        for (i = 1; i < MAX_OPENFILE; i++) {
+            if (openfile_list[i].free == 1 && openfile_list[i].fcb_state == 1) {
+                fprintf(stderr, "snapshot: close written files first\n");
+                return 1;
+            }
+        }
+        do_snapshot(args[2]);
+    } else if (!strcmp(args[1], "delete")) {
+        snapshot_delete(args[2]);
+    } else {
+        fprintf(stderr, "snapshot: wrong argument\n");
+    }
+    return 1;
+}
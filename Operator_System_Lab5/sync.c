@@ -0,0 +1,432 @@
+/**
+ * @file    sync.c
+ * @brief   Durability policies and the background flusher.
+ * @details A shadow copy holds what the system file contains. A commit compares the used
+ *          blocks of the image with it under fs_lock, copies the ones that differ aside,
+ *          then writes them and waits for the disk with fs_lock released, so commands go on
+ *          while the disk works. Under the periodic and group policies the flusher thread
+ *          runs the commits, under the close policy closing a written file does.
+ *          Commands that ask for a commit while one is being written share the next one.
+ */
+
+#include <time.h>
+#include "simplefs.h"
+
+/**
+ * @brief Flusher state, guarded by its lock.
+ */
+typedef struct SYNCER {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /**< Signalled on requests and on stop. */
+    pthread_t tid;
+    int started;
+    int quit;
+    int policy;                 /**< SYNC_NONE, SYNC_CLOSE, SYNC_PERIODIC or SYNC_GROUP. */
+    int period;                 /**< Milliseconds between periodic commits. */
+    unsigned long requested;    /**< Changing commands run so far. */
+    unsigned long handled;      /**< Of those, the ones a commit already covers. */
+    sync_stat stat;
+} syncer;
+
+static syncer sync_state = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .policy = SYNC_NONE,
+        .period = SYNC_PERIOD
+};
+
+/**< One commit at a time, taken after fs_lock by whoever takes both. */
+static pthread_mutex_t sync_io = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char sync_shadow[DISK_SIZE];        /**< Content of the system file. */
+static unsigned char sync_known[BLOCK_NUM / 8];     /**< Blocks whose shadow is sure. */
+static unsigned char sync_buf[DISK_SIZE];           /**< Blocks of the commit being written. */
+static int sync_list[BLOCK_NUM];
+static vol_io sync_io_list[BLOCK_NUM];
+static int sync_pub = 0;                            /**< 1 to publish the image after every commit. */
+
+static const char *sync_names[] = {"none", "close", "periodic", "group"};
+
+/**
+ * Read the monotonic clock.
+ * @return Milliseconds.
+ */
+static double sync_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Copy aside the used blocks that differ from the system file, held ones included.
+ * Called with fs_lock and sync_io held.
+ * @return Block count.
+ */
+static int sync_stage(void) {
+    unsigned char marks[BLOCK_NUM / 8], *p;
+    int i, n = 0;
+
+    /**< A mounted snapshot has replaced the FAT in memory, the live one is not there.
+     *   A shared reader never writes the image it maps. */
+    if (snapshot_mounted() || fs_shared) {
+        return 0;
+    }
+    memset(marks, 0, sizeof(marks));
+    for (i = 0; i < BLOCK_NUM; i++) {
+        p = fs_head + BLOCK_SIZE * i;
+        if (block_used(i) &&
+            (!(sync_known[i >> 3] >> (i & 7) & 1) || memcmp(p, sync_shadow + BLOCK_SIZE * i, BLOCK_SIZE))) {
+            marks[i >> 3] |= 1 << (i & 7);
+            n++;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    /**< The commit is a generation, which changes the boot block and the table as well. */
+    gen_commit(marks);
+
+    for (i = 0, n = 0; i < BLOCK_NUM; i++) {
+        if (marks[i >> 3] & (1 << (i & 7))) {
+            p = fs_head + BLOCK_SIZE * i;
+            memcpy(sync_buf + BLOCK_SIZE * n, p, BLOCK_SIZE);
+            memcpy(sync_shadow + BLOCK_SIZE * i, p, BLOCK_SIZE);
+            sync_known[i >> 3] |= 1 << (i & 7);
+            sync_list[n++] = i;
+        }
+    }
+    return n;
+}
+
+/**
+ * Write the staged blocks and wait until the disk has them.
+ * Called with sync_io held, fs_lock is not needed.
+ * @param n Staged block count.
+ * @param runs Output, neighbour blocks merged into one write.
+ * @return 0 on success, -1 on error.
+ */
+static int sync_write(int n, int *runs) {
+    int i, ret;
+
+    *runs = 0;
+    for (i = 0; i < n; i++) {
+        sync_io_list[i].block = sync_list[i];
+        sync_io_list[i].data = sync_buf + BLOCK_SIZE * i;
+        *runs += i == 0 || sync_list[i] != sync_list[i - 1] + 1;
+    }
+    if ((ret = vol_write(sync_io_list, n, VOL_SYNC)) == -1) {
+        /**< What reached the file is unknown, write these blocks again next time. */
+        for (i = 0; i < n; i++) {
+            sync_known[sync_list[i] >> 3] &= ~(1 << (sync_list[i] & 7));
+        }
+        fprintf(stderr, "sync: cannot write the volume\n");
+    }
+    return ret;
+}
+
+/**
+ * Publish the system file for shared readers once a commit reached it.
+ * Called with sync_io held.
+ */
+static void sync_published(void) {
+    if (sync_pub) {
+        pub_write(sync_shadow);
+    }
+}
+
+/**
+ * Account one commit.
+ * @param blocks Blocks written.
+ * @param runs Writes issued.
+ * @param hold Milliseconds fs_lock was held.
+ * @param io Milliseconds of write and fdatasync.
+ */
+static void sync_account(int blocks, int runs, double hold, double io) {
+    sync_stat *s = &sync_state.stat;
+
+    pthread_mutex_lock(&sync_state.lock);
+    s->commits++;
+    s->blocks += blocks;
+    s->runs += runs;
+    s->hold_total += hold;
+    s->hold_max = hold > s->hold_max ? hold : s->hold_max;
+    s->io_last = io;
+    s->io_total += io;
+    s->io_max = io > s->io_max ? io : s->io_max;
+    pthread_mutex_unlock(&sync_state.lock);
+}
+
+/**
+ * Commit now in the calling thread, which holds fs_lock.
+ * @return 0 on success, -1 on error.
+ */
+int sync_flush(void) {
+    double start, staged;
+    int n, runs = 0, ret = 0;
+
+    pthread_mutex_lock(&sync_io);
+    start = sync_now();
+    if ((n = sync_stage()) > 0) {
+        staged = sync_now();
+        ret = sync_write(n, &runs);
+        sync_account(n, runs, staged - start, sync_now() - staged);
+        if (ret == 0) {
+            sync_published();
+        }
+    }
+    pthread_mutex_unlock(&sync_io);
+    return ret;
+}
+
+/**
+ * Flusher thread body, commits on requests or on every period.
+ * @param arg Unused.
+ */
+static void *sync_thread(void *arg) {
+    struct timespec deadline;
+    unsigned long target;
+    double start, staged;
+    int n, runs;
+
+    (void) arg;
+    pthread_mutex_lock(&sync_state.lock);
+    while (!sync_state.quit) {
+        if (sync_state.policy == SYNC_PERIODIC) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += sync_state.period / 1000;
+            deadline.tv_nsec += (long) (sync_state.period % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            while (!sync_state.quit && pthread_cond_timedwait(&sync_state.wake, &sync_state.lock, &deadline) == 0);
+        } else {
+            while (!sync_state.quit && sync_state.requested == sync_state.handled) {
+                pthread_cond_wait(&sync_state.wake, &sync_state.lock);
+            }
+        }
+        if (sync_state.quit || sync_state.requested == sync_state.handled) {
+            continue;
+        }
+        target = sync_state.requested;
+        pthread_mutex_unlock(&sync_state.lock);
+
+        pthread_mutex_lock(&fs_lock);
+        pthread_mutex_lock(&sync_io);
+        start = sync_now();
+        /**< Bytes still buffered by open files are part of the commands to cover. */
+        wb_flush_all();
+        n = sync_stage();
+        pthread_mutex_unlock(&fs_lock);
+        staged = sync_now();
+        if (n > 0) {
+            if (sync_write(n, &runs) == 0) {
+                sync_published();
+            }
+            sync_account(n, runs, staged - start, sync_now() - staged);
+        }
+        pthread_mutex_unlock(&sync_io);
+
+        pthread_mutex_lock(&sync_state.lock);
+        sync_state.handled = target;
+    }
+    pthread_mutex_unlock(&sync_state.lock);
+    return NULL;
+}
+
+/**
+ * Note that a command changed the image, called by the shell after each one.
+ */
+void sync_request(void) {
+    pthread_mutex_lock(&sync_state.lock);
+    sync_state.requested++;
+    sync_state.stat.requests += sync_state.policy >= SYNC_PERIODIC;
+    if (sync_state.policy == SYNC_GROUP) {
+        pthread_cond_signal(&sync_state.wake);
+    }
+    pthread_mutex_unlock(&sync_state.lock);
+}
+
+/**
+ * Commit after a written file is closed, under the close policy.
+ */
+void sync_close(void) {
+    if (sync_state.policy == SYNC_CLOSE) {
+        sync_flush();
+    }
+}
+
+/**
+ * Stop the flusher and wait for it.
+ * Called by the shell, which holds fs_lock.
+ */
+void sync_stop(void) {
+    if (!sync_state.started) {
+        return;
+    }
+    pthread_mutex_lock(&sync_state.lock);
+    sync_state.quit = 1;
+    pthread_cond_signal(&sync_state.wake);
+    pthread_mutex_unlock(&sync_state.lock);
+    /**< The flusher may be waiting for fs_lock to stage. */
+    pthread_mutex_unlock(&fs_lock);
+    pthread_join(sync_state.tid, NULL);
+    pthread_mutex_lock(&fs_lock);
+    sync_state.quit = 0;
+    sync_state.started = 0;
+}
+
+/**
+ * Choose how changes reach the disk.
+ * Called by the shell, which holds fs_lock.
+ * @param policy SYNC_NONE, SYNC_CLOSE, SYNC_PERIODIC or SYNC_GROUP.
+ * @param period Milliseconds between commits for SYNC_PERIODIC.
+ * @return 0 on success, -1 if the flusher cannot start.
+ */
+int sync_policy(int policy, int period) {
+    sync_stop();
+    sync_state.policy = policy;
+    sync_state.period = period;
+    sync_state.handled = sync_state.requested;
+    if (policy < SYNC_PERIODIC) {
+        return 0;
+    }
+    if (pthread_create(&sync_state.tid, NULL, sync_thread, NULL) != 0) {
+        sync_state.policy = SYNC_NONE;
+        return -1;
+    }
+    sync_state.started = 1;
+    return 0;
+}
+
+/**
+ * Take the system file as it is after the image was read from it.
+ */
+void sync_loaded(void) {
+    memcpy(sync_shadow, fs_head, DISK_SIZE);
+    memset(sync_known, 0xff, sizeof(sync_known));
+}
+
+/**
+ * Keep the flusher away from the system file while sys_write rewrites it.
+ */
+void sync_rewrite_begin(void) {
+    pthread_mutex_lock(&sync_io);
+}
+
+/**
+ * Take the system file as sys_write left it and let the flusher back.
+ * @param truncate 1 if the file was truncated, its free blocks are holes then,
+ *                 0 if only the used blocks were written, -1 if the write failed.
+ */
+void sync_rewrite_end(int truncate) {
+    int i;
+
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (truncate == -1) {
+            sync_known[i >> 3] &= ~(1 << (i & 7));
+        } else if (block_used(i)) {
+            memcpy(sync_shadow + BLOCK_SIZE * i, fs_head + BLOCK_SIZE * i, BLOCK_SIZE);
+            sync_known[i >> 3] |= 1 << (i & 7);
+        } else if (truncate) {
+            memset(sync_shadow + BLOCK_SIZE * i, 0, BLOCK_SIZE);
+            sync_known[i >> 3] |= 1 << (i & 7);
+        } else {
+            sync_known[i >> 3] &= ~(1 << (i & 7));
+        }
+    }
+    if (truncate != -1) {
+        sync_published();
+    }
+    pthread_mutex_unlock(&sync_io);
+}
+
+/**
+ * Publish the system file for shared readers, now and after every commit, or stop.
+ * Called by the shell, which holds fs_lock.
+ * @param on 1 to publish, 0 to stop.
+ * @return 0 on success, -1 on error.
+ */
+int sync_publish(int on) {
+    int ret = 0;
+
+    /**< What is published is what the system file holds, commit first. */
+    if (on && flush_sys() == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&sync_io);
+    sync_pub = on;
+    if (on) {
+        ret = pub_write(sync_shadow);
+    }
+    pthread_mutex_unlock(&sync_io);
+    return ret;
+}
+
+/**
+ * Print the policy and the commit metrics.
+ */
+static void sync_show(void) {
+    sync_stat s;
+    int policy, period;
+
+    pthread_mutex_lock(&sync_state.lock);
+    s = sync_state.stat;
+    policy = sync_state.policy;
+    period = sync_state.period;
+    pthread_mutex_unlock(&sync_state.lock);
+
+    if (policy == SYNC_PERIODIC) {
+        printf("policy: %s %d ms\n", sync_names[policy], period);
+    } else {
+        printf("policy: %s\n", sync_names[policy]);
+    }
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "commits", "requests", "blocks", "writes",
+           "hold avg", "hold max", "io last", "io avg", "io max");
+    printf("%-10lu %10lu %10lu %10lu %8.3fms %8.3fms %8.3fms %8.3fms %8.3fms\n", s.commits, s.requests, s.blocks,
+           s.runs, s.commits ? s.hold_total / s.commits : 0, s.hold_max, s.io_last,
+           s.commits ? s.io_total / s.commits : 0, s.io_max);
+}
+
+/**
+ * Flush the image to the system file, or set how it is done.
+ * @param args Nothing to commit now, 'policy none|close|group' or 'policy periodic [ms]' to choose
+ *             when changes are written, 'stat' to show the policy and commit latency.
+ * @return Always 1.
+ */
+int my_sync(char **args) {
+    int i, period = SYNC_PERIOD;
+
+    if (args[1] == NULL) {
+        sync_flush();
+        return 1;
+    }
+    if (!strcmp(args[1], "stat")) {
+        sync_show();
+        return 1;
+    }
+    if (strcmp(args[1], "policy")) {
+        fprintf(stderr, "sync: %s: unknown command\n", args[1]);
+        return 1;
+    }
+    if (args[2] == NULL) {
+        printf("%s\n", sync_names[sync_state.policy]);
+        return 1;
+    }
+
+    for (i = 0; i < 4 && strcmp(args[2], sync_names[i]); i++);
+    if (i == 4) {
+        fprintf(stderr, "sync: %s: unknown policy\n", args[2]);
+        return 1;
+    }
+    if (i == SYNC_PERIODIC && args[3] != NULL && (period = atoi(args[3])) <= 0) {
+        fprintf(stderr, "sync: wrong period %s\n", args[3]);
+        return 1;
+    }
+    /**< Whatever the old policy left unwritten goes out first. */
+    sync_flush();
+    if (sync_policy(i, period) == -1) {
+        fprintf(stderr, "sync: cannot start the flusher\n");
+    }
+    return 1;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Snapshot contents survive a restart after 'sync', under every flush policy.
+# The file is rewritten after the snapshot, so the snapshot keeps its old block
+# only through a copy on write, then the shell is killed without 'exit'.
+# Usage: snapshot_restart.sh <shell binary>
+
+shell="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+for policy in none close group periodic; do
+    rm -f fsfile
+    (printf 'sync policy %s\ncreate f.tx\nopen f.tx\nwrite -w f.tx\nOLDDATA\n\nclose f.tx\n' "$policy"
+     printf 'snapshot create s1\nopen f.tx\nwrite -w f.tx\nNEWDATA\n\nclose f.tx\nsync\n'
+     sleep 3) | "$shell" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    kill -KILL "$pid"
+    wait
+
+    out=$(printf 'snapshot mount s1\ncat f.tx\nsnapshot umount\ncat f.tx\nfsck\nexit\n' | "$shell" 2>&1)
+    for want in OLDDATA NEWDATA "0 problems"; do
+        if ! printf '%s' "$out" | grep -q "$want"; then
+            echo "policy $policy: '$want' missing after restart"
+            printf '%s\n' "$out"
+            exit 1
+        fi
+    done
+done
+echo "snapshot contents kept after restart"
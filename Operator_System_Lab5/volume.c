@@ -0,0 +1,465 @@
+/**
+ * @file    volume.c
+ * @brief   Block layer between the image and its backing files.
+ * @details A volume is one or more member files. Blocks are dealt out to the members in
+ *          stripes of a few blocks, round robin, and a read or a write goes to every member
+ *          at once from its own thread. The plain volume is the one member SYS_PATH with a
+ *          stripe as large as the disk, a striped one is described in VOL_PATH.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "simplefs.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @brief Layout of the volume.
+ */
+typedef struct VOLUME {
+    int stripe;                             /**< Blocks per stripe. */
+    int count;                              /**< Member count. */
+    char path[VOL_MAX_MEMBERS][VOL_PATH_LEN];
+    int fd[VOL_MAX_MEMBERS];
+    off_t size[VOL_MAX_MEMBERS];            /**< Bytes of each member. */
+} volume;
+
+/**
+ * @brief Work of one member thread.
+ */
+typedef struct VOLJOB {
+    int member;
+    const vol_io *io;           /**< Blocks of the whole request, the member picks its own. */
+    int n;
+    int flags;                  /**< VOL_READ, VOL_TRUNC, VOL_SYNC. */
+    unsigned char *image;       /**< Destination of VOL_READ. */
+    int ret;
+} vol_job;
+
+static volume vol = {.count = 0};
+
+/**
+ * Find where a block lives.
+ * @param v Layout.
+ * @param block Block num.
+ * @param member Output, member index.
+ * @return Byte offset in the member.
+ */
+static off_t vol_map(const volume *v, int block, int *member) {
+    int chunk = block / v->stripe;
+
+    *member = chunk % v->count;
+    return ((off_t) (chunk / v->count) * v->stripe + block % v->stripe) * BLOCK_SIZE;
+}
+
+/**
+ * Fill in the member sizes of a layout.
+ * @param v Layout, stripe and count set.
+ */
+static void vol_sizes(volume *v) {
+    off_t end;
+    int i, m;
+
+    memset(v->size, 0, sizeof(v->size));
+    for (i = 0; i < BLOCK_NUM; i++) {
+        end = vol_map(v, i, &m) + BLOCK_SIZE;
+        v->size[m] = end > v->size[m] ? end : v->size[m];
+    }
+}
+
+/**
+ * Open every member of a layout.
+ * @param v Layout, fds set on success.
+ * @return 0 on success, -1 with nothing left open.
+ */
+static int vol_open_members(volume *v) {
+    int i;
+
+    for (i = 0; i < v->count; i++) {
+        if ((v->fd[i] = open(v->path[i], O_RDWR | O_CREAT, 0644)) == -1) {
+            fprintf(stderr, "volume: cannot open %s: %s\n", v->path[i], strerror(errno));
+            while (--i >= 0) {
+                close(v->fd[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the part of the image one member holds, a stripe per read.
+ * @param job Member job.
+ * @return 0 on success, -1 on error.
+ */
+static int vol_read_member(vol_job *job) {
+    unsigned char *dst;
+    ssize_t got;
+    off_t at;
+    size_t left;
+    int block, m;
+
+    for (block = 0; block < BLOCK_NUM; block += vol.stripe) {
+        at = vol_map(&vol, block, &m);
+        if (m != job->member) {
+            continue;
+        }
+        dst = job->image + BLOCK_SIZE * block;
+        left = (size_t) BLOCK_SIZE * (BLOCK_NUM - block < vol.stripe ? BLOCK_NUM - block : vol.stripe);
+        /**< Past the end of a member are holes, the image is already zero there. */
+        while (left > 0 && (got = pread(vol.fd[m], dst, left, at)) != 0) {
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            dst += got;
+            at += got;
+            left -= got;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the blocks of a request one member holds, neighbours in one vectored write.
+ * @param job Member job.
+ * @return 0 on success, -1 on error.
+ */
+static int vol_write_member(vol_job *job) {
+    struct iovec iov[IOV_MAX];
+    int fd = vol.fd[job->member], i, m, count = 0, ret = 0;
+    off_t at, start = 0, next = -1;
+
+    if ((job->flags & VOL_TRUNC) && ftruncate(fd, 0) == -1) {
+        return -1;
+    }
+    for (i = 0; i <= job->n && ret == 0; i++) {
+        at = -1;
+        if (i < job->n && (at = vol_map(&vol, job->io[i].block, &m), m != job->member)) {
+            continue;
+        }
+        if (count > 0 && (at != next || count == IOV_MAX)) {
+            if (pwritev(fd, iov, count, start) != (ssize_t) count * BLOCK_SIZE) {
+                ret = -1;
+            }
+            count = 0;
+        }
+        if (at == -1) {
+            break;
+        }
+        if (count == 0) {
+            start = at;
+        }
+        iov[count].iov_base = (void *) job->io[i].data;
+        iov[count].iov_len = BLOCK_SIZE;
+        count++;
+        next = at + BLOCK_SIZE;
+    }
+    if (ret == 0 && (job->flags & VOL_TRUNC) && ftruncate(fd, vol.size[job->member]) == -1) {
+        ret = -1;
+    }
+    if (ret == 0 && (job->flags & VOL_SYNC) && fdatasync(fd) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * Thread body, do the part of a request one member holds.
+ * @param arg Member job.
+ */
+static void *vol_worker(void *arg) {
+    vol_job *job = (vol_job *) arg;
+
+    job->ret = job->flags & VOL_READ ? vol_read_member(job) : vol_write_member(job);
+    return NULL;
+}
+
+/**
+ * Run a request on every member in parallel.
+ * @param io Blocks to write, NULL to read.
+ * @param n Block count.
+ * @param flags VOL_READ, VOL_TRUNC, VOL_SYNC.
+ * @param image Destination of VOL_READ.
+ * @return 0 on success, -1 on error.
+ */
+static int vol_run(const vol_io *io, int n, int flags, unsigned char *image) {
+    pthread_t tid[VOL_MAX_MEMBERS];
+    vol_job job[VOL_MAX_MEMBERS];
+    int i, started[VOL_MAX_MEMBERS], ret = 0;
+
+    for (i = 0; i < vol.count; i++) {
+        job[i].member = i;
+        job[i].io = io;
+        job[i].n = n;
+        job[i].flags = flags;
+        job[i].image = image;
+        job[i].ret = 0;
+    }
+    if (vol.count == 1) {
+        vol_worker(&job[0]);
+        return job[0].ret;
+    }
+
+    for (i = 0; i < vol.count; i++) {
+        /**< A member without a thread is done by this one. */
+        if (!(started[i] = pthread_create(&tid[i], NULL, vol_worker, &job[i]) == 0)) {
+            vol_worker(&job[i]);
+        }
+    }
+    for (i = 0; i < vol.count; i++) {
+        if (started[i]) {
+            pthread_join(tid[i], NULL);
+        }
+        ret |= job[i].ret;
+    }
+    return ret;
+}
+
+/**
+ * Open the volume, striped if VOL_PATH describes one, else SYS_PATH.
+ * Exits when a member of a striped volume is missing, formatting it would lose the rest.
+ * @return 1 if the volume exists, 0 if it is new and must be formatted.
+ */
+int vol_open(void) {
+    char line[VOL_PATH_LEN + 16];
+    FILE *fp;
+    int exists = 1, i;
+
+    vol.count = 0;
+    vol.stripe = BLOCK_NUM;
+    if ((fp = fopen(VOL_PATH, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (!strncmp(line, "stripe ", 7)) {
+                vol.stripe = atoi(line + 7);
+            } else if (!strncmp(line, "member ", 7) && vol.count < VOL_MAX_MEMBERS) {
+                strncpy(vol.path[vol.count++], line + 7, VOL_PATH_LEN - 1);
+            }
+        }
+        fclose(fp);
+        if (vol.count == 0 || vol.stripe <= 0) {
+            fprintf(stderr, "volume: %s is broken\n", VOL_PATH);
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < vol.count; i++) {
+            if (access(vol.path[i], F_OK) == -1) {
+                fprintf(stderr, "volume: member %s is missing\n", vol.path[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    } else {
+        strcpy(vol.path[vol.count++], SYS_PATH);
+        exists = access(SYS_PATH, F_OK) == 0;
+    }
+
+    vol_sizes(&vol);
+    if (vol_open_members(&vol) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    return exists;
+}
+
+/**
+ * Read the whole image from the volume.
+ * @param image Destination, DISK_SIZE bytes.
+ * @return 0 on success, -1 on error.
+ */
+int vol_read(unsigned char *image) {
+    memset(image, 0, DISK_SIZE);
+    return vol_run(NULL, 0, VOL_READ, image);
+}
+
+/**
+ * Write blocks to the volume.
+ * @param io Blocks and their data, in ascending block order.
+ * @param n Block count.
+ * @param flags VOL_TRUNC to drop the old content first, VOL_SYNC to wait for the disk.
+ * @return 0 on success, -1 on error.
+ */
+int vol_write(const vol_io *io, int n, int flags) {
+    return vol_run(io, n, flags, NULL);
+}
+
+/**
+ * Write every used block of the image, one write per member and run.
+ * Blocks only a snapshot holds are used as well.
+ * @param flags VOL_TRUNC, VOL_SYNC.
+ * @return 0 on success, -1 on error.
+ */
+int vol_write_used(int flags) {
+    static vol_io io[BLOCK_NUM];
+    int i, n = 0;
+
+    for (i = 0; i < BLOCK_NUM; i++) {
+        if (block_used(i)) {
+            io[n].block = i;
+            io[n++].data = fs_head + BLOCK_SIZE * i;
+        }
+    }
+    return vol_write(io, n, flags);
+}
+
+/**
+ * Check if a file is a member of the current volume.
+ * Compared by inode, so other spellings of the same path are caught.
+ * @param path File.
+ * @return Index of the member, -1 if it is none or does not exist.
+ */
+static int vol_member(const char *path) {
+    struct stat st, mst;
+    int i;
+
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    for (i = 0; i < vol.count; i++) {
+        if (fstat(vol.fd[i], &mst) == 0 && mst.st_dev == st.st_dev && mst.st_ino == st.st_ino) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Move the image to a new layout.
+ * New members must not be files of the current one, they are truncated before the
+ * description switches over.
+ * Called by the shell, which holds fs_lock.
+ * @param stripe Blocks per stripe.
+ * @param paths Member files, NULL for the plain SYS_PATH.
+ * @param count Member count.
+ * @return 0 on success, -1 with the old layout kept.
+ */
+static int vol_relayout(int stripe, char **paths, int count) {
+    volume old = vol;
+    FILE *fp;
+    int i, ret;
+
+    vol.stripe = paths != NULL ? stripe : BLOCK_NUM;
+    vol.count = paths != NULL ? count : 1;
+    for (i = 0; i < vol.count; i++) {
+        memset(vol.path[i], 0, VOL_PATH_LEN);
+        strncpy(vol.path[i], paths != NULL ? paths[i] : SYS_PATH, VOL_PATH_LEN - 1);
+    }
+    vol_sizes(&vol);
+
+    sync_rewrite_begin();
+    if (vol_open_members(&vol) == -1) {
+        vol = old;
+        sync_rewrite_end(-1);
+        return -1;
+    }
+    if ((ret = vol_write_used(VOL_TRUNC | VOL_SYNC)) == 0) {
+        /**< The description goes last, a crash before it leaves the old volume in use. */
+        if (paths == NULL) {
+            ret = unlink(VOL_PATH) == -1 && errno != ENOENT ? -1 : 0;
+        } else if ((fp = fopen(VOL_PATH ".tmp", "w")) == NULL) {
+            ret = -1;
+        } else {
+            fprintf(fp, "stripe %d\n", vol.stripe);
+            for (i = 0; i < vol.count; i++) {
+                fprintf(fp, "member %s\n", vol.path[i]);
+            }
+            ret = fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+            if (fclose(fp) != 0 || ret == -1 || rename(VOL_PATH ".tmp", VOL_PATH) == -1) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == -1) {
+        for (i = 0; i < vol.count; i++) {
+            close(vol.fd[i]);
+        }
+        vol = old;
+    } else {
+        for (i = 0; i < old.count; i++) {
+            close(old.fd[i]);
+        }
+    }
+    /**< A member may also have been one of the old files, trust none of them after a failure. */
+    sync_rewrite_end(ret == 0 ? 1 : -1);
+    return ret;
+}
+
+/**
+ * Show the layout of the volume.
+ */
+static void vol_show(void) {
+    int i, j, m, blocks;
+
+    printf("stripe %d blocks, %d member%s\n", vol.stripe, vol.count, vol.count > 1 ? "s" : "");
+    for (i = 0; i < vol.count; i++) {
+        for (j = 0, blocks = 0; j < BLOCK_NUM; j++) {
+            vol_map(&vol, j, &m);
+            blocks += m == i;
+        }
+        printf("%d\t%d blocks\t%s\n", i, blocks, vol.path[i]);
+    }
+}
+
+/**
+ * Show or change where the image is stored.
+ * @param args Nothing to show the layout, 'stripe [-s blocks] path...' to spread the image over
+ *             the member files, 'single' to go back to SYS_PATH alone.
+ * @return Always 1.
+ */
+int my_volume(char **args) {
+    int i, stripe = VOL_STRIPE, count;
+
+    if (args[1] == NULL) {
+        vol_show();
+        return 1;
+    }
+    if (!strcmp(args[1], "single")) {
+        if (vol_member(SYS_PATH) != -1) {
+            fprintf(stderr, "volume: %s is in the current volume, stripe to other files first\n", SYS_PATH);
+            return 1;
+        }
+        if (vol_relayout(0, NULL, 1) == -1) {
+            fprintf(stderr, "volume: cannot write %s\n", SYS_PATH);
+        }
+        return 1;
+    }
+    if (strcmp(args[1], "stripe")) {
+        fprintf(stderr, "volume: %s: unknown command\n", args[1]);
+        return 1;
+    }
+
+    args += 2;
+    if (args[0] != NULL && !strcmp(args[0], "-s") && args[1] != NULL) {
+        if ((stripe = atoi(args[1])) <= 0 || stripe > BLOCK_NUM) {
+            fprintf(stderr, "volume: wrong stripe size %s\n", args[1]);
+            return 1;
+        }
+        args += 2;
+    }
+    for (count = 0; args[count] != NULL; count++) {
+        for (i = 0; i < count; i++) {
+            if (!strcmp(args[i], args[count])) {
+                fprintf(stderr, "volume: %s given twice\n", args[count]);
+                return 1;
+            }
+        }
+        if (vol_member(args[count]) != -1) {
+            fprintf(stderr, "volume: %s is in the current volume, use other files\n", args[count]);
+            return 1;
+        }
+    }
+    if (count == 0 || count > VOL_MAX_MEMBERS) {
+        fprintf(stderr, "volume: expected 1 to %d member files\n", VOL_MAX_MEMBERS);
+        return 1;
+    }
+    if (vol_relayout(stripe, args, count) == -1) {
+        fprintf(stderr, "volume: cannot move the image\n");
+    }
+    return 1;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file    walk.c
+ * @brief   Parallel traversal of the directory tree.
+ * @details A small pool of threads, each with its own deque of directories still to visit.
+ *          The visitor scans one directory and pushes every sub directory it finds,
+ *          a thread whose deque runs dry steals from the others.
+ */
+
+#include <unistd.h>
+#include "simplefs.h"
+
+static __thread int walk_self;     /**< Deque of the calling walker thread. */
+
+/**
+ * @brief Start arguments of one walker thread.
+ */
+typedef struct WALKARG {
+    walker *w;
+    int self;
+} walk_arg;
+
+/**
+ * Take a directory to visit, from the own deque first, else steal from another thread.
+ * @param w Walker.
+ * @param item Output.
+ * @return 1 if an item was taken, else 0.
+ */
+static int walk_take(walker *w, walk_item *item) {
+    walk_deque *d;
+    int k, found = 0;
+
+    for (k = 0; k < w->nthreads && !found; k++) {
+        d = &w->deques[(walk_self + k) % w->nthreads];
+        pthread_mutex_lock(&d->lock);
+        if (d->tail > d->head) {
+            if (k == 0) {
+                /**< Newest from the own deque keeps its subtree hot in cache. */
+                *item = d->items[--d->tail];
+            } else {
+                /**< Oldest from a victim is nearest its root, the biggest piece of work. */
+                *item = d->items[d->head++];
+                __atomic_add_fetch(&w->steals, 1, __ATOMIC_RELAXED);
+            }
+            if (d->tail == d->head) {
+                d->head = d->tail = 0;
+            }
+            found = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+    return found;
+}
+
+/**
+ * Thread body, take a directory, visit it, repeat until the tree is exhausted.
+ * @param arg Walker and deque index of this thread.
+ */
+static void *walk_worker(void *arg) {
+    walker *w = ((walk_arg *) arg)->w;
+    unsigned long seen = 0;
+    int fresh = 1;
+    walk_item item;
+
+    walk_self = ((walk_arg *) arg)->self;
+    while (1) {
+        if (walk_take(w, &item)) {
+            w->visit(w, item.first, item.path);
+            pthread_mutex_lock(&w->lock);
+            if (--w->pending == 0) {
+                pthread_cond_broadcast(&w->cond);
+            }
+            pthread_mutex_unlock(&w->lock);
+            fresh = 1;
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (w->pending == 0) {
+            /**< Nothing queued and nobody can queue more. */
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        if (!fresh && w->stamp == seen) {
+            /**< No push since the last failed scan, sleep until one comes. */
+            w->idle++;
+            pthread_cond_wait(&w->cond, &w->lock);
+            w->idle--;
+        }
+        seen = w->stamp;
+        fresh = 0;
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Queue a directory to be visited, on the deque of the calling thread.
+ * @param w Walker.
+ * @param first First block of the directory.
+ * @param path Absolute path of the directory.
+ */
+void walk_push(walker *w, int first, const char *path) {
+    walk_deque *d = &w->deques[walk_self % w->nthreads];
+
+    /**< Counted before it can be stolen, a thief finishing it first must not see the walk done. */
+    pthread_mutex_lock(&w->lock);
+    w->pending++;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->capacity) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head, (d->tail - d->head) * sizeof(walk_item));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->capacity = d->capacity ? d->capacity * 2 : 64;
+            d->items = (walk_item *) realloc(d->items, d->capacity * sizeof(walk_item));
+            if (d->items == NULL) {
+                fprintf(stderr, "walk: allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    d->items[d->tail].first = first;
+    strncpy(d->items[d->tail].path, path, PATHLENGTH - 1);
+    d->items[d->tail].path[PATHLENGTH - 1] = '\0';
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+
+    /**< Bumped once the item can be taken, a thread that scanned before it then scans again. */
+    pthread_mutex_lock(&w->lock);
+    w->stamp++;
+    if (w->idle > 0) {
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Default thread count, one per online cpu.
+ * @return Thread count in [1, WALK_MAX_THREADS].
+ */
+int walk_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) {
+        return 1;
+    }
+    return n > WALK_MAX_THREADS ? WALK_MAX_THREADS : (int) n;
+}
+
+/**
+ * Copy the entries of a directory, so a visitor scans a stable view of it.
+ * @param first First block of the directory.
+ * @param entries Output, every slot of the chain in order, to free by the caller.
+ * @return Entry count, -1 on allocation failure.
+ */
+int walk_snapshot(int first, fcb **entries) {
+    fat *fat0 = (fat *) (fs_head + BLOCK_SIZE);
+    int block, i, n = 0, blocks = 0;
+
+    for (block = first; block != END && block != FREE && blocks < BLOCK_NUM;
+         block = fat_next(fat0[block].id)) {
+        blocks++;
+    }
+    *entries = (fcb *) malloc(blocks * dir_slots() * sizeof(fcb));
+    if (*entries == NULL) {
+        return -1;
+    }
+    for (block = first; n < blocks * dir_slots(); block = fat_next(fat0[block].id)) {
+        for (i = 0; i < dir_slots(); i++) {
+            memcpy(&(*entries)[n++], dir_slot(block, i), sizeof(fcb));
+        }
+    }
+    return n;
+}
+
+/**
+ * Visit every directory reachable from first.
+ * The visitor runs concurrently on different directories, it must only read the image
+ * and protect its own shared state.
+ * @param first First block of the top directory.
+ * @param path Absolute path of the top directory.
+ * @param visit Called once per directory.
+ * @param arg Passed to the visitor through walker.arg.
+ * @param nthreads Thread count, 0 for the default.
+ * @return Directories stolen between threads.
+ */
+int walk_tree(int first, const char *path, walk_visit visit, void *arg, int nthreads) {
+    walker w;
+    walk_arg args[WALK_MAX_THREADS];
+    pthread_t tid[WALK_MAX_THREADS];
+    int i, started = 0;
+
+    if (nthreads <= 0) {
+        nthreads = walk_threads();
+    }
+    if (nthreads > WALK_MAX_THREADS) {
+        nthreads = WALK_MAX_THREADS;
+    }
+
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&w.deques[i].lock, NULL);
+    }
+    w.nthreads = nthreads;
+    w.visit = visit;
+    w.arg = arg;
+    walk_self = 0;
+    walk_push(&w, first, path);
+
+    for (i = 0; i < nthreads; i++) {
+        args[i].w = &w;
+        args[i].self = i;
+        if (pthread_create(&tid[started], NULL, walk_worker, &args[i]) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        /**< Fall back to the calling thread. */
+        walk_worker(&args[0]);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&w.deques[i].lock);
+        free(w.deques[i].items);
+    }
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    return (int) w.steals;
+}